@@ -0,0 +1,68 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/atomic.h>, on C11 atomics. All
+// operations are sequentially consistent, which is at least as
+// strong as the kernel's for each
+
+#ifndef _EMU_LINUX_ATOMIC_H_
+#define _EMU_LINUX_ATOMIC_H_
+
+#include <stdatomic.h>
+
+#include <linux/types.h>
+
+typedef struct {
+    _Atomic int       counter;
+} atomic_t;
+
+typedef struct {
+    _Atomic long long counter;
+} atomic64_t;
+
+#define ATOMIC_INIT(i)      { (i) }
+
+static inline int  atomic_read(atomic_t *v)                  { return atomic_load(&v->counter); }
+static inline void atomic_set(atomic_t *v, int i)            { atomic_store(&v->counter, i); }
+static inline void atomic_add(int i, atomic_t *v)            { atomic_fetch_add(&v->counter, i); }
+static inline void atomic_sub(int i, atomic_t *v)            { atomic_fetch_sub(&v->counter, i); }
+static inline void atomic_inc(atomic_t *v)                   { atomic_fetch_add(&v->counter, 1); }
+static inline void atomic_dec(atomic_t *v)                   { atomic_fetch_sub(&v->counter, 1); }
+static inline int  atomic_inc_return(atomic_t *v)            { return atomic_fetch_add(&v->counter, 1) + 1; }
+static inline int  atomic_dec_return(atomic_t *v)            { return atomic_fetch_sub(&v->counter, 1) - 1; }
+static inline bool atomic_dec_and_test(atomic_t *v)          { return atomic_dec_return(v) == 0; }
+static inline int  atomic_read_acquire(atomic_t *v)          { return atomic_load(&v->counter); }
+static inline void atomic_set_release(atomic_t *v, int i)    { atomic_store(&v->counter, i); }
+
+// On failure *old is updated to the current value, as the kernel's
+static inline bool atomic_try_cmpxchg(atomic_t *v, int *old, int i)
+{
+    return atomic_compare_exchange_strong(&v->counter, old, i);
+}
+
+static inline long long atomic64_read(atomic64_t *v)         { return atomic_load(&v->counter); }
+static inline void      atomic64_set(atomic64_t *v, long long i) { atomic_store(&v->counter, i); }
+static inline void      atomic64_inc(atomic64_t *v)          { atomic_fetch_add(&v->counter, 1); }
+static inline long long atomic64_inc_return(atomic64_t *v)   { return atomic_fetch_add(&v->counter, 1) + 1; }
+
+#endif
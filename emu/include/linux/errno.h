@@ -0,0 +1,36 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/errno.h>. The kernel's error numbers come
+// from the system's uapi header, and errno from libc
+
+#ifndef _EMU_LINUX_ERRNO_H_
+#define _EMU_LINUX_ERRNO_H_
+
+#include_next <linux/errno.h>
+#include <errno.h>
+
+// Kernel internal, for an interrupted wait
+#define ERESTARTSYS         512
+
+#endif
@@ -0,0 +1,42 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/log2.h>
+
+#ifndef _EMU_LINUX_LOG2_H_
+#define _EMU_LINUX_LOG2_H_
+
+#include <linux/types.h>
+
+static inline bool is_power_of_2(unsigned long n)
+{
+    return n != 0 && !(n & (n - 1));
+}
+
+// Smallest power of 2 not less than n, for n from 1
+static inline unsigned long roundup_pow_of_two(unsigned long n)
+{
+    return n == 1 ? 1 : 1UL << (64 - __builtin_clzl(n - 1));
+}
+
+#endif
@@ -0,0 +1,42 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/mutex.h>
+
+#ifndef _EMU_LINUX_MUTEX_H_
+#define _EMU_LINUX_MUTEX_H_
+
+#include <pthread.h>
+
+struct mutex {
+    pthread_mutex_t m;
+};
+
+static inline void mutex_init(struct mutex *l)      { pthread_mutex_init(&l->m, NULL); }
+static inline void mutex_lock(struct mutex *l)      { pthread_mutex_lock(&l->m); }
+static inline void mutex_unlock(struct mutex *l)    { pthread_mutex_unlock(&l->m); }
+
+// There are no signals to interrupt a wait
+static inline int  mutex_lock_interruptible(struct mutex *l) { mutex_lock(l); return 0; }
+
+#endif
@@ -0,0 +1,43 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/percpu-rwsem.h>, on a pthread
+// read/write lock
+
+#ifndef _EMU_LINUX_PERCPU_RWSEM_H_
+#define _EMU_LINUX_PERCPU_RWSEM_H_
+
+#include <pthread.h>
+
+struct percpu_rw_semaphore {
+    pthread_rwlock_t    rw;
+};
+
+static inline int  percpu_init_rwsem(struct percpu_rw_semaphore *s)  { return -pthread_rwlock_init(&s->rw, NULL); }
+static inline void percpu_free_rwsem(struct percpu_rw_semaphore *s)  { pthread_rwlock_destroy(&s->rw); }
+static inline void percpu_down_read(struct percpu_rw_semaphore *s)   { pthread_rwlock_rdlock(&s->rw); }
+static inline void percpu_up_read(struct percpu_rw_semaphore *s)     { pthread_rwlock_unlock(&s->rw); }
+static inline void percpu_down_write(struct percpu_rw_semaphore *s)  { pthread_rwlock_wrlock(&s->rw); }
+static inline void percpu_up_write(struct percpu_rw_semaphore *s)    { pthread_rwlock_unlock(&s->rw); }
+
+#endif
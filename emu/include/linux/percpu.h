@@ -0,0 +1,76 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/percpu.h>. A thread takes the copy
+// of the CPU it is running on, and holds that CPU's lock in place of
+// disabled preemption, so that no other thread uses the copy until
+// it is put. Copies are on separate cache lines
+
+#ifndef _EMU_LINUX_PERCPU_H_
+#define _EMU_LINUX_PERCPU_H_
+
+#include <pthread.h>
+
+#include <linux/cache.h>
+#include <linux/slab.h>
+
+#define WY_EMU_NR_CPUS              64
+
+#define __percpu
+
+// Bytes between CPUs' copies of a type
+#define WY_EMU_PCPU_STRIDE(size)    (((size) + SMP_CACHE_BYTES - 1) & ~(size_t)(SMP_CACHE_BYTES - 1))
+
+extern pthread_mutex_t wy_emu_cpu_lock[WY_EMU_NR_CPUS];
+extern __thread int    wy_emu_cpu;
+
+// From <sched.h>, declared only for _GNU_SOURCE
+extern int sched_getcpu(void);
+
+static inline int wy_emu_get_cpu(void)
+{
+    int cpu = sched_getcpu();
+
+    cpu = cpu < 0 ? 0 : cpu % WY_EMU_NR_CPUS;
+
+    pthread_mutex_lock(&wy_emu_cpu_lock[cpu]);
+    wy_emu_cpu = cpu;
+
+    return cpu;
+}
+
+static inline void wy_emu_put_cpu(void)
+{
+    pthread_mutex_unlock(&wy_emu_cpu_lock[wy_emu_cpu]);
+}
+
+#define alloc_percpu(type)          ((type*)kzalloc(WY_EMU_NR_CPUS * WY_EMU_PCPU_STRIDE(sizeof(type)), GFP_KERNEL))
+#define free_percpu(p)              kfree(p)
+
+#define per_cpu_ptr(p, cpu)         ((__typeof__(p))((char*)(p) + (cpu) * WY_EMU_PCPU_STRIDE(sizeof(*(p)))))
+#define get_cpu_ptr(p)              per_cpu_ptr(p, wy_emu_get_cpu())
+#define put_cpu_ptr(p)              wy_emu_put_cpu()
+
+#define for_each_possible_cpu(cpu)  for ((cpu) = 0; (cpu) < WY_EMU_NR_CPUS; (cpu)++)
+
+#endif
@@ -0,0 +1,44 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/rcupdate.h>. The emulation never
+// replaces an RCU protected pointer once published, so readers need
+// no protection and updaters no grace period
+
+#ifndef _EMU_LINUX_RCUPDATE_H_
+#define _EMU_LINUX_RCUPDATE_H_
+
+#define __rcu
+
+struct rcu_head {
+    struct rcu_head*    next;
+};
+
+static inline void rcu_read_lock(void)   { }
+static inline void rcu_read_unlock(void) { }
+
+#define rcu_dereference(p)              (p)
+#define rcu_dereference_protected(p, c) (p)
+#define RCU_INIT_POINTER(p, v)          ((p) = (v))
+
+#endif
@@ -0,0 +1,48 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/sched.h>. The process is one
+// address space, so every thread has the same mm
+
+#ifndef _EMU_LINUX_SCHED_H_
+#define _EMU_LINUX_SCHED_H_
+
+struct mm_struct {
+    int                 users;
+};
+
+struct task_struct {
+    struct mm_struct*   mm;
+};
+
+extern struct task_struct wy_emu_task;
+
+#define current             (&wy_emu_task)
+
+static inline void cond_resched(void) { }
+
+// The one address space never goes, so references need no counting
+static inline void mmgrab(struct mm_struct *mm) { }
+static inline void mmdrop(struct mm_struct *mm) { }
+
+#endif
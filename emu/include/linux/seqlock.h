@@ -0,0 +1,93 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/seqlock.h>, sequence counts only,
+// on C11 atomics. The count is odd whilst the single writer of the
+// data updates it, and readers retry if it was odd or changed.
+// A reader's copy of the data races with the writer by design, so,
+// as the kernel's do for KCSAN, the reads are hidden from TSan
+
+#ifndef _EMU_LINUX_SEQLOCK_H_
+#define _EMU_LINUX_SEQLOCK_H_
+
+#include <stdatomic.h>
+
+#include <linux/types.h>
+
+#if defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define __SANITIZE_THREAD__
+#endif
+#endif
+
+#ifdef __SANITIZE_THREAD__
+void __tsan_ignore_thread_begin(void);
+void __tsan_ignore_thread_end(void);
+#else
+static inline void __tsan_ignore_thread_begin(void) { }
+static inline void __tsan_ignore_thread_end(void) { }
+#endif
+
+typedef struct {
+    atomic_uint         sequence;
+} seqcount_t;
+
+static inline void seqcount_init(seqcount_t *s)
+{
+    atomic_init(&s->sequence, 0);
+}
+
+static inline void write_seqcount_begin(seqcount_t *s)
+{
+    atomic_fetch_add_explicit(&s->sequence, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void write_seqcount_end(seqcount_t *s)
+{
+    atomic_fetch_add_explicit(&s->sequence, 1, memory_order_release);
+}
+
+static inline unsigned read_seqcount_begin(seqcount_t *s)
+{
+    unsigned seq;
+
+    while ((seq = atomic_load_explicit(&s->sequence, memory_order_acquire)) & 1)
+    {
+    }
+
+    __tsan_ignore_thread_begin();
+
+    return seq;
+}
+
+static inline bool read_seqcount_retry(seqcount_t *s, unsigned start)
+{
+    __tsan_ignore_thread_end();
+
+    atomic_thread_fence(memory_order_acquire);
+
+    return atomic_load_explicit(&s->sequence, memory_order_relaxed) != start;
+}
+
+#endif
@@ -0,0 +1,62 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/slab.h>. Allocations are cache line
+// aligned, as structures with cache line aligned members need
+
+#ifndef _EMU_LINUX_SLAB_H_
+#define _EMU_LINUX_SLAB_H_
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <linux/types.h>
+
+#define GFP_KERNEL          0
+
+static inline void *kzalloc(size_t size, int flags)
+{
+    void* p;
+
+    (void)flags;
+
+    if (posix_memalign(&p, 64, size ? size : 1))
+    {
+        return NULL;
+    }
+
+    return memset(p, 0, size);
+}
+
+static inline void *kcalloc(size_t n, size_t size, int flags)
+{
+    if (size && n > SIZE_MAX / size)
+    {
+        return NULL;
+    }
+
+    return kzalloc(n * size, flags);
+}
+static inline void  kfree(const void *p)                        { free((void *)p); }
+
+#endif
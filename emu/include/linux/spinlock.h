@@ -0,0 +1,38 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/spinlock.h>. Spinlocks are
+// pthread mutexes
+
+#ifndef _EMU_LINUX_SPINLOCK_H_
+#define _EMU_LINUX_SPINLOCK_H_
+
+#include <pthread.h>
+
+typedef pthread_mutex_t spinlock_t;
+
+static inline void spin_lock_init(spinlock_t *l)    { pthread_mutex_init(l, NULL); }
+static inline void spin_lock(spinlock_t *l)         { pthread_mutex_lock(l); }
+static inline void spin_unlock(spinlock_t *l)       { pthread_mutex_unlock(l); }
+
+#endif
@@ -0,0 +1,49 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/string.h>
+
+#ifndef _EMU_LINUX_STRING_H_
+#define _EMU_LINUX_STRING_H_
+
+#include <string.h>
+
+#include <linux/types.h>
+
+// First byte of the n at s not equal to c, or NULL if all are
+static inline void *memchr_inv(const void *s, int c, size_t n)
+{
+    const uint8_t* p = s;
+
+    for (; n; n--, p++)
+    {
+        if (*p != (uint8_t)c)
+        {
+            return (void*)p;
+        }
+    }
+
+    return NULL;
+}
+
+#endif
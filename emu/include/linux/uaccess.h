@@ -0,0 +1,76 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/uaccess.h>. "User" memory is the
+// calling process's, checked by an optional hook so that a fuzzer
+// can confine commands to the buffers it owns. Failed copies
+// return the bytes not copied, as the kernel's do
+
+#ifndef _EMU_LINUX_UACCESS_H_
+#define _EMU_LINUX_UACCESS_H_
+
+#include <string.h>
+
+#include <linux/types.h>
+
+// Returns whether len bytes at addr may be accessed. NULL allows any range
+// that does not wrap
+extern bool (*wy_emu_uaccess_check)(const void *addr, unsigned long len);
+
+static inline bool access_ok(const void *addr, unsigned long len)
+{
+    if ((uintptr_t)addr + len < (uintptr_t)addr)
+    {
+        return false;
+    }
+
+    return !wy_emu_uaccess_check || wy_emu_uaccess_check(addr, len);
+}
+
+static inline unsigned long copy_from_user(void *to, const void *from, unsigned long n)
+{
+    if (!access_ok(from, n))
+    {
+        return n;
+    }
+
+    memcpy(to, from, n);
+
+    return 0;
+}
+
+static inline unsigned long copy_to_user(void *to, const void *from, unsigned long n)
+{
+    if (!access_ok(to, n))
+    {
+        return n;
+    }
+
+    memcpy(to, from, n);
+
+    return 0;
+}
+
+#define u64_to_user_ptr(x)  ((void *)(uintptr_t)(x))
+
+#endif
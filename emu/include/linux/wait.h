@@ -0,0 +1,76 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/wait.h>. A waiter tests its
+// condition under the queue's lock and wake_up takes the lock,
+// so a change made before wake_up cannot be missed
+
+#ifndef _EMU_LINUX_WAIT_H_
+#define _EMU_LINUX_WAIT_H_
+
+#include <pthread.h>
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq)
+{
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+}
+
+static inline void wake_up(wait_queue_head_t *wq)
+{
+    pthread_mutex_lock(&wq->lock);
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->lock);
+}
+
+// The lock is always taken, so any waiter sees a wake up
+static inline bool wq_has_sleeper(wait_queue_head_t *wq)
+{
+    (void)wq;
+
+    return true;
+}
+
+#define wait_event(wq, condition)                                 \
+do {                                                              \
+    pthread_mutex_lock(&(wq).lock);                               \
+    while (!(condition))                                          \
+    {                                                             \
+        pthread_cond_wait(&(wq).cond, &(wq).lock);                \
+    }                                                             \
+    pthread_mutex_unlock(&(wq).lock);                             \
+} while (0)
+
+// There are no signals to interrupt a wait
+#define wait_event_interruptible(wq, condition)                   \
+({                                                                \
+    wait_event(wq, condition);                                    \
+    0;                                                            \
+})
+
+#endif
@@ -0,0 +1,63 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// User space stand in for <linux/workqueue.h>: a FIFO of work items
+// run by a pool of threads. As in the kernel, queueing an item that
+// is already pending does nothing. Implemented in emu/workqueue.c
+
+#ifndef _EMU_LINUX_WORKQUEUE_H_
+#define _EMU_LINUX_WORKQUEUE_H_
+
+#include <pthread.h>
+
+#include <linux/types.h>
+
+struct work_struct;
+
+typedef void (*work_func_t)(struct work_struct *);
+
+struct work_struct {
+    work_func_t          func;
+    struct work_struct*  next;
+    bool                 pending;
+};
+
+struct workqueue_struct {
+    pthread_mutex_t      lock;
+    pthread_cond_t       cond;
+    struct work_struct*  head;
+    struct work_struct*  tail;
+    pthread_t*           threads;
+    int                  nthreads;
+    bool                 stop;
+};
+
+#define WQ_UNBOUND          0
+
+#define INIT_WORK(_w, _f)   do { (_w)->func = (_f); (_w)->next = NULL; (_w)->pending = false; } while (0)
+
+struct workqueue_struct *alloc_workqueue(const char *name, unsigned int flags, int max_active);
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work);
+void destroy_workqueue(struct workqueue_struct *wq);
+
+#endif
@@ -0,0 +1,161 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// User space workqueue for the emulation build, standing in for
+// the kernel's. Work items are run in the order queued by a
+// pool of threads, and destroying the queue runs what remains
+// ------------------------------------------------------------
+
+#include <stdlib.h>
+
+#include <linux/workqueue.h>
+
+static void *wy_emu_worker(void *arg)
+{
+    struct workqueue_struct* wq = arg;
+    struct work_struct*      work;
+
+    pthread_mutex_lock(&wq->lock);
+
+    while (1)
+    {
+        while (!wq->head && !wq->stop)
+        {
+            pthread_cond_wait(&wq->cond, &wq->lock);
+        }
+
+        if (!wq->head)
+        {
+            break;
+        }
+
+        work     = wq->head;
+        wq->head = work->next;
+
+        if (!wq->head)
+        {
+            wq->tail = NULL;
+        }
+
+        // No longer pending, so it may be queued again whilst it runs
+        work->next    = NULL;
+        work->pending = false;
+
+        pthread_mutex_unlock(&wq->lock);
+        work->func(work);
+        pthread_mutex_lock(&wq->lock);
+    }
+
+    pthread_mutex_unlock(&wq->lock);
+
+    return NULL;
+}
+
+struct workqueue_struct *alloc_workqueue(const char *name, unsigned int flags, int max_active)
+{
+    struct workqueue_struct* wq = calloc(1, sizeof(*wq));
+
+    (void)name;
+    (void)flags;
+
+    if (!wq)
+    {
+        return NULL;
+    }
+
+    wq->nthreads = max_active > 0 ? max_active : 1;
+    wq->threads  = calloc(wq->nthreads, sizeof(pthread_t));
+
+    pthread_mutex_init(&wq->lock, NULL);
+    pthread_cond_init(&wq->cond, NULL);
+
+    for (int idx = 0; wq->threads && idx < wq->nthreads; idx++)
+    {
+        if (pthread_create(&wq->threads[idx], NULL, wy_emu_worker, wq))
+        {
+            wq->nthreads = idx;
+            destroy_workqueue(wq);
+
+            return NULL;
+        }
+    }
+
+    if (!wq->threads)
+    {
+        free(wq);
+
+        return NULL;
+    }
+
+    return wq;
+}
+
+bool queue_work(struct workqueue_struct *wq, struct work_struct *work)
+{
+    bool queued = false;
+
+    pthread_mutex_lock(&wq->lock);
+
+    if (!work->pending)
+    {
+        work->pending = true;
+        work->next    = NULL;
+
+        if (wq->tail)
+        {
+            wq->tail->next = work;
+        }
+        else
+        {
+            wq->head = work;
+        }
+
+        wq->tail = work;
+        queued   = true;
+
+        pthread_cond_signal(&wq->cond);
+    }
+
+    pthread_mutex_unlock(&wq->lock);
+
+    return queued;
+}
+
+void destroy_workqueue(struct workqueue_struct *wq)
+{
+    pthread_mutex_lock(&wq->lock);
+    wq->stop = true;
+    pthread_cond_broadcast(&wq->cond);
+    pthread_mutex_unlock(&wq->lock);
+
+    for (int idx = 0; idx < wq->nthreads; idx++)
+    {
+        pthread_join(wq->threads[idx], NULL);
+    }
+
+    pthread_mutex_destroy(&wq->lock);
+    pthread_cond_destroy(&wq->cond);
+    free(wq->threads);
+    free(wq);
+}
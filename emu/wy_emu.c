@@ -0,0 +1,350 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// User space emulation of the wy_module command processing. The
+// command dispatch, submission, per-file queues and engine are
+// the driver's own, from wy_engine.c, built against the kernel
+// header shims in include/, so that their paths behave, and
+// profile, as the driver's do. Only the command handlers are
+// emulated here, and those needing device support that user
+// space does not have return -EOPNOTSUPP.
+// ------------------------------------------------------------
+
+// ------------------------------------------------------------
+// Headers
+// ------------------------------------------------------------
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/sched.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/uaccess.h>
+
+#include "../wy_engine.h"
+#include "wy_emu.h"
+
+// ------------------------------------------------------------
+// Structure definitions
+// ------------------------------------------------------------
+
+// Device instance context, with the fields wy_engine.c uses as the
+// driver's, and the emulated memory window
+struct wy_dev {
+    uint8_t*                 mem;                 // Emulated device memory window
+    uint32_t                 mem_size;
+    uint32_t                 max_open;
+    atomic_t                 open_count;
+    struct workqueue_struct* wq;                  // Workqueue running the engine workers
+    wy_worker_t*             workers;
+    uint32_t                 nworkers;
+    atomic_t                 next_home;
+    atomic64_t               steals;
+    wy_cmd_stats_t           cmd_stats[WY_CMD_NUM];
+    atomic_t                 live_deferred;
+    atomic_t                 live_cpls;
+    wy_config_t __rcu*       cfg;
+};
+
+// ------------------------------------------------------------
+// Static variables
+// ------------------------------------------------------------
+
+bool (*wy_emu_uaccess_check)(const void *addr, unsigned long len);
+
+// The process's one address space, as every thread's current->mm
+static struct mm_struct wy_emu_mm;
+
+struct task_struct      wy_emu_task = { &wy_emu_mm };
+
+// Held by a thread using its CPU's per-CPU data, in place of disabled preemption
+pthread_mutex_t         wy_emu_cpu_lock[WY_EMU_NR_CPUS] = { [0 ... WY_EMU_NR_CPUS - 1] = PTHREAD_MUTEX_INITIALIZER };
+__thread int            wy_emu_cpu;
+
+// ------------------------------------------------------------
+// Command dispatch table, submission and the engine, shared
+// with the driver
+// ------------------------------------------------------------
+
+#include "../wy_engine.c"
+
+// ------------------------------------------------------------
+// Command handlers
+// ------------------------------------------------------------
+
+// Every thread shares the one address space
+static int wy_module_exec_mm(wy_file_t *ctx, struct mm_struct *mm, params_t *p)
+{
+    return wy_module_exec(ctx->dev, ctx, p);
+}
+
+static int wy_module_default(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return 0;
+}
+
+static int wy_module_stream_start(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return -EOPNOTSUPP;
+}
+
+static int wy_module_stream_stop(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return -EOPNOTSUPP;
+}
+
+static int wy_module_compress(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return -EOPNOTSUPP;
+}
+
+static int wy_module_decompress(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return -EOPNOTSUPP;
+}
+
+static int wy_module_flush(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return -EOPNOTSUPP;
+}
+
+static int wy_module_mem_fill(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    uint32_t* mem = (uint32_t*)dev->mem;
+    uint32_t  idx;
+
+    if (p->len > dev->mem_size || (p->len % sizeof(uint32_t)))
+    {
+        return -EINVAL;
+    }
+
+    for (idx = 0; idx < p->len / sizeof(uint32_t); idx++)
+    {
+        mem[idx] = idx;
+    }
+
+    return 0;
+}
+
+// Bitwise CRC32C, without the pre and post inversion, as the kernel's crc32c()
+static uint32_t wy_emu_crc32c(uint32_t crc, const uint8_t *src, size_t len)
+{
+    while (len--)
+    {
+        crc ^= *src++;
+
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0x82f63b78 & -(crc & 1));
+        }
+    }
+
+    return crc;
+}
+
+// CRC32C of params.len bytes at vaddr or, when vaddr is 0, at offset in the
+// memory window. User data goes via a bounce buffer, as in the driver. There
+// is no xxHash64
+static int wy_module_csum(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    uint8_t  bounce[4096];
+    uint32_t crc = ~p->seed;
+    uint32_t done;
+    uint32_t chunk;
+
+    if (p->cmd != WY_CMD_CRC32C)
+    {
+        return -EOPNOTSUPP;
+    }
+
+    if (!p->vaddr && !wy_core_window_ok(p->offset, p->len, dev->mem_size))
+    {
+        return -EINVAL;
+    }
+
+    for (done = 0; done < p->len; done += chunk)
+    {
+        chunk = min_t(uint32_t, p->len - done, sizeof(bounce));
+
+        if (!p->vaddr)
+        {
+            crc = wy_emu_crc32c(crc, dev->mem + p->offset + done, chunk);
+        }
+        else if (copy_from_user(bounce, (const uint8_t*)u64_to_user_ptr(p->vaddr) + done, chunk))
+        {
+            return -EFAULT;
+        }
+        else
+        {
+            crc = wy_emu_crc32c(crc, bounce, chunk);
+        }
+    }
+
+    p->result = (uint64_t)~crc;
+
+    return 0;
+}
+
+// Copy between vaddr and the memory window, with the CPU
+static int wy_module_copy(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    if (!wy_core_window_ok(p->offset, p->len, dev->mem_size))
+    {
+        return -EINVAL;
+    }
+
+    if (p->cmd == WY_CMD_COPY_TO_DEV)
+    {
+        return copy_from_user(dev->mem + p->offset, u64_to_user_ptr(p->vaddr), p->len) ? -EFAULT : 0;
+    }
+
+    return copy_to_user(u64_to_user_ptr(p->vaddr), dev->mem + p->offset, p->len) ? -EFAULT : 0;
+}
+
+// ------------------------------------------------------------
+// Device and file lifetime
+// ------------------------------------------------------------
+
+wy_emu_dev_t *wy_emu_dev_create(const wy_emu_config_t *cfg)
+{
+    wy_emu_config_t def = { 0 };
+    wy_emu_dev_t*   dev = kzalloc(sizeof(wy_emu_dev_t), GFP_KERNEL);
+    wy_config_t*    dcfg;
+    uint32_t        nworkers;
+
+    if (!dev)
+    {
+        return NULL;
+    }
+
+    cfg      = cfg ? cfg : &def;
+    nworkers = cfg->engine_workers ? cfg->engine_workers : 4;
+    dcfg     = kzalloc(sizeof(wy_config_t), GFP_KERNEL);
+
+    if (dcfg)
+    {
+        dcfg->queue_depth     = clamp_t(uint32_t, cfg->queue_depth ? cfg->queue_depth : 64, 1, WY_MAX_QDEPTH);
+        dcfg->defer_threshold = cfg->defer_threshold ? cfg->defer_threshold : 65536;
+        dcfg->cq_coalesce     = 1;
+        dcfg->cmd_enable      = WY_CMD_ALL;
+
+        RCU_INIT_POINTER(dev->cfg, dcfg);
+    }
+
+    dev->mem_size = cfg->mem_window_size ? cfg->mem_window_size : 65536;
+    dev->max_open = cfg->max_open        ? cfg->max_open        : 1;
+    dev->mem      = kzalloc(dev->mem_size, GFP_KERNEL);
+    dev->wq       = alloc_workqueue("wy_module", WQ_UNBOUND, nworkers);
+
+    if (!dcfg || !dev->mem || !dev->wq || wy_module_engine_alloc(dev, nworkers))
+    {
+        wy_emu_dev_destroy(dev);
+
+        return NULL;
+    }
+
+    return dev;
+}
+
+void wy_emu_dev_destroy(wy_emu_dev_t *dev)
+{
+    // All files are closed, and wait for their commands, so none remain
+    if (dev->wq)
+    {
+        destroy_workqueue(dev->wq);
+    }
+
+    wy_module_engine_free(dev);
+
+    kfree(rcu_dereference_protected(dev->cfg, 1));
+    kfree(dev->mem);
+    kfree(dev);
+}
+
+wy_emu_file_t *wy_emu_open(wy_emu_dev_t *dev)
+{
+    wy_emu_file_t* ctx;
+    int            status;
+
+    if (!wy_core_credit_get(&dev->open_count, dev->max_open))
+    {
+        errno = EBUSY;
+
+        return NULL;
+    }
+
+    ctx    = kzalloc(sizeof(wy_emu_file_t), GFP_KERNEL);
+    status = ctx ? wy_module_file_init(ctx, dev) : -ENOMEM;
+
+    if (status)
+    {
+        kfree(ctx);
+        wy_core_credit_put(&dev->open_count);
+        errno = -status;
+
+        return NULL;
+    }
+
+    return ctx;
+}
+
+void wy_emu_release(wy_emu_file_t *ctx)
+{
+    wy_emu_dev_t* dev = ctx->dev;
+
+    // Wait for deferred commands to finish, discarding unread completions
+    wy_module_file_drain(ctx);
+    wy_module_file_free(ctx);
+    kfree(ctx);
+
+    wy_core_credit_put(&dev->open_count);
+}
+
+// ------------------------------------------------------------
+// File operations
+// ------------------------------------------------------------
+
+ssize_t wy_emu_write(wy_emu_file_t *ctx, const void *buf, size_t len)
+{
+    return wy_module_cmd_write(ctx, buf, len);
+}
+
+int wy_emu_ioctl_cmd(wy_emu_file_t *ctx, params_t *p)
+{
+    return wy_module_submit(ctx, p);
+}
+
+ssize_t wy_emu_read(wy_emu_file_t *ctx, void *buf, size_t len, bool nonblock)
+{
+    return wy_module_cmd_read(ctx, buf, len, nonblock);
+}
+
+void wy_emu_cmd_stats(wy_emu_dev_t *dev, uint32_t cmd, uint64_t *count, uint64_t *errors)
+{
+    wy_cmd_stats_t* stats = &dev->cmd_stats[wy_core_cmd_index(cmd)];
+
+    *count  = atomic64_read(&stats->count);
+    *errors = atomic64_read(&stats->errors);
+}
@@ -0,0 +1,90 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// User space emulation of the wy_module command processing, for
+// profiling with perf and valgrind and for fuzzing. Files are
+// opened on an emulated device instance and commands are
+// written, submitted by ioctl and read back as they are with
+// the driver. The command dispatch, submission, per-file
+// queues, engine and statistics are the driver's own, from
+// wy_engine.c and wy_core.h, built against the kernel header
+// shims in emu/include. "User" buffers are the calling
+// process's memory.
+//
+// Commands run are those with no kernel dependencies: default,
+// mem_fill, set_qdepth, crc32c and the two window copies.
+// Others fail with -EOPNOTSUPP.
+// ------------------------------------------------------------
+
+#ifndef _WY_EMU_H_
+#define _WY_EMU_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "../uapi/wy_module.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct wy_dev     wy_emu_dev_t;
+typedef struct wy_file    wy_emu_file_t;
+
+// Device configuration, as the driver's module parameters. Zero fields take the driver's defaults
+typedef struct {
+    uint32_t mem_window_size;
+    uint32_t defer_threshold;
+    uint32_t queue_depth;
+    uint32_t max_open;
+    uint32_t engine_workers;
+} wy_emu_config_t;
+
+// Create and destroy a device. cfg may be NULL for the defaults. All files
+// must be released before the device is destroyed
+wy_emu_dev_t*  wy_emu_dev_create (const wy_emu_config_t *cfg);
+void           wy_emu_dev_destroy(wy_emu_dev_t *dev);
+
+// Open and release a file. Open returns NULL with errno set on failure
+wy_emu_file_t* wy_emu_open       (wy_emu_dev_t *dev);
+void           wy_emu_release    (wy_emu_file_t *ctx);
+
+// The file operations, returning as the driver's do with a negative errno
+ssize_t        wy_emu_write      (wy_emu_file_t *ctx, const void *buf, size_t len);
+ssize_t        wy_emu_read       (wy_emu_file_t *ctx, void *buf, size_t len, bool nonblock);
+int            wy_emu_ioctl_cmd  (wy_emu_file_t *ctx, params_t *p);
+
+// A command's count and error count, as in the cmd_stats attribute
+void           wy_emu_cmd_stats  (wy_emu_dev_t *dev, uint32_t cmd, uint64_t *count, uint64_t *errors);
+
+// Optional check of buffers given to commands. See emu/include/linux/uaccess.h
+extern bool (*wy_emu_uaccess_check)(const void *addr, unsigned long len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
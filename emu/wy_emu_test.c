@@ -0,0 +1,394 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// Smoke and stress tests of the user space emulation, and so of
+// the driver's command dispatch, submission, per-file queues
+// and engine. The smoke tests run each path once and check its
+// results. The stress tests run threads writing, submitting and
+// reading on shared files, and check that every completion is
+// read once and that the last descriptor written is always read
+// back whole. Built with ASan and UBSan by 'make test', or with
+// TSan by 'make test SANITIZE=-fsanitize=thread'.
+// ------------------------------------------------------------
+
+// ------------------------------------------------------------
+// Headers
+// ------------------------------------------------------------
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "wy_emu.h"
+
+// ------------------------------------------------------------
+// Definitions
+// ------------------------------------------------------------
+
+#define WY_TEST_THRESHOLD           4096       // Length from which bulk commands are deferred
+#define WY_TEST_DEPTH               8          // Queue depth of the smoke tests' file
+#define WY_TEST_THREADS             8
+#define WY_TEST_ITERS               20000
+#define WY_TEST_SLICE               4096       // Each stress thread's part of the buffers and window
+#define WY_TEST_TAGS                (WY_TEST_THREADS * WY_TEST_ITERS + 1)
+
+#define WY_TEST_CHECK(c) wy_test_check((c), #c, __LINE__)
+
+// ------------------------------------------------------------
+// Static variables
+// ------------------------------------------------------------
+
+static atomic_int     wy_test_fails;
+
+// Stress test state. Each thread copies through its own slice of the
+// buffer and the memory window, so that the data checked is its own
+static wy_emu_file_t* wy_test_file;
+static uint8_t        wy_test_buf[WY_TEST_THREADS][WY_TEST_SLICE];
+static atomic_long    wy_test_tagged;                        // Tagged commands submitted
+static atomic_long    wy_test_cpls;                          // Their completions read
+static atomic_uchar   wy_test_seen[WY_TEST_TAGS];              // Tags whose completions were read
+static atomic_bool    wy_test_writing;
+
+// ------------------------------------------------------------
+// Helpers
+// ------------------------------------------------------------
+
+static void wy_test_check(bool ok, const char *what, int line)
+{
+    if (!ok)
+    {
+        fprintf(stderr, "wy_emu_test:%d: failed: %s\n", line, what);
+
+        atomic_fetch_add(&wy_test_fails, 1);
+    }
+}
+
+// A descriptor passing the ABI checks
+static params_t wy_test_params(uint32_t cmd, const void *vaddr, uint32_t len, uint32_t offset)
+{
+    params_t p;
+
+    memset(&p, 0, sizeof(params_t));
+
+    p.version = WY_ABI_VERSION;
+    p.cmd     = cmd;
+    p.vaddr   = (uintptr_t)vaddr;
+    p.len     = len;
+    p.offset  = offset;
+
+    return p;
+}
+
+// ------------------------------------------------------------
+// Smoke tests
+// ------------------------------------------------------------
+
+static void wy_test_smoke(void)
+{
+    static uint8_t  src[2 * WY_TEST_THRESHOLD];
+    static uint8_t  dst[2 * WY_TEST_THRESHOLD];
+    wy_emu_config_t cfg = { .defer_threshold = WY_TEST_THRESHOLD, .queue_depth = WY_TEST_DEPTH };
+    wy_emu_dev_t*   dev;
+    wy_emu_file_t*  ctx;
+    params_t        batch[3];
+    params_t        p;
+    uint64_t        count;
+    uint64_t        errors;
+    uint32_t        idx;
+
+    for (idx = 0; idx < sizeof(src); idx++)
+    {
+        src[idx] = (uint8_t)(idx * 7);
+    }
+
+    dev = wy_emu_dev_create(&cfg);
+    WY_TEST_CHECK(dev != NULL);
+
+    ctx = wy_emu_open(dev);
+    WY_TEST_CHECK(ctx != NULL);
+
+    // One open is allowed by default
+    WY_TEST_CHECK(wy_emu_open(dev) == NULL && errno == EBUSY);
+
+    // A batch, with a tagged command whose completion is then read
+    batch[0]     = wy_test_params(WY_CMD_DEFAULT,       NULL, 0,           0);
+    batch[1]     = wy_test_params(WY_CMD_COPY_TO_DEV,   src,  sizeof(src), 0);
+    batch[2]     = wy_test_params(WY_CMD_CRC32C,        src,  100,         0);
+    batch[1].tag = 5;
+
+    WY_TEST_CHECK(wy_emu_write(ctx, batch, sizeof(batch)) == sizeof(batch));
+    WY_TEST_CHECK(wy_emu_read(ctx, &p, sizeof(params_t), false) == sizeof(params_t));
+    WY_TEST_CHECK(p.tag == 5 && p.status == 0 && p.cmd == WY_CMD_COPY_TO_DEV);
+
+    // An untagged bulk command is deferred, and its completion read
+    p = wy_test_params(WY_CMD_COPY_FROM_DEV, dst, sizeof(dst), 0);
+
+    WY_TEST_CHECK(wy_emu_ioctl_cmd(ctx, &p) == 0);
+    WY_TEST_CHECK(wy_emu_read(ctx, &p, sizeof(params_t), false) == sizeof(params_t));
+    WY_TEST_CHECK(p.status == 0 && !memcmp(src, dst, sizeof(dst)));
+
+    // The CRC32C check value
+    p = wy_test_params(WY_CMD_CRC32C, "123456789", 9, 0);
+
+    WY_TEST_CHECK(wy_emu_ioctl_cmd(ctx, &p) == 0 && p.result == 0xe3069283);
+
+    // Descriptors outside the window or with reserved words set are refused
+    p = wy_test_params(WY_CMD_COPY_TO_DEV, src, 16, 0xfffffff0);
+    WY_TEST_CHECK(wy_emu_ioctl_cmd(ctx, &p) == -EINVAL);
+
+    p         = wy_test_params(WY_CMD_DEFAULT, NULL, 0, 0);
+    p.rsvd[1] = 1;
+    WY_TEST_CHECK(wy_emu_ioctl_cmd(ctx, &p) == -EINVAL && p.status == -EINVAL);
+
+    // Tagged commands fill the queue until their completions are read
+    for (idx = 0; idx < WY_TEST_DEPTH; idx++)
+    {
+        p     = wy_test_params(WY_CMD_DEFAULT, NULL, 0, 0);
+        p.tag = idx + 1;
+
+        WY_TEST_CHECK(wy_emu_ioctl_cmd(ctx, &p) == 0);
+    }
+
+    p     = wy_test_params(WY_CMD_DEFAULT, NULL, 0, 0);
+    p.tag = WY_TEST_DEPTH + 1;
+
+    WY_TEST_CHECK(wy_emu_ioctl_cmd(ctx, &p) == -EBUSY && p.status == -EBUSY);
+    WY_TEST_CHECK(wy_emu_write(ctx, &p, sizeof(params_t)) == -EBUSY);
+
+    for (idx = 0; idx < WY_TEST_DEPTH; idx++)
+    {
+        WY_TEST_CHECK(wy_emu_read(ctx, &p, sizeof(params_t), false) == sizeof(params_t));
+        WY_TEST_CHECK(p.tag == idx + 1);
+    }
+
+    // With no completions left, the last descriptor written is read back
+    p        = wy_test_params(WY_CMD_DEFAULT, NULL, 0, 0);
+    p.result = 42;
+
+    WY_TEST_CHECK(wy_emu_write(ctx, &p, sizeof(params_t)) == sizeof(params_t));
+    WY_TEST_CHECK(wy_emu_read(ctx, &p, sizeof(params_t), false) == sizeof(params_t));
+    WY_TEST_CHECK(p.cmd == WY_CMD_DEFAULT && p.result == 42);
+
+    wy_emu_cmd_stats(dev, WY_CMD_COPY_TO_DEV, &count, &errors);
+    WY_TEST_CHECK(count == 2 && errors == 1);
+
+    wy_emu_release(ctx);
+    wy_emu_dev_destroy(dev);
+}
+
+// ------------------------------------------------------------
+// Stress tests
+// ------------------------------------------------------------
+
+// Count a completion read, which must be of a tagged command submitted, and
+// read only once. Untagged completions, of deferred commands, are not counted
+static void wy_test_cpl(const params_t *p)
+{
+    if (!p->tag)
+    {
+        return;
+    }
+
+    WY_TEST_CHECK(p->tag < WY_TEST_TAGS && p->status == 0);
+    WY_TEST_CHECK(p->tag < WY_TEST_TAGS && !atomic_exchange(&wy_test_seen[p->tag], 1));
+
+    atomic_fetch_add(&wy_test_cpls, 1);
+}
+
+// Submits a mix of inline, tagged and deferred copies and checksums on the
+// shared file, reading completions as it goes. Tagged commands go by ioctl,
+// which leaves the last descriptor alone, so that any tagged descriptor read
+// is a completion rather than the last one written
+static void *wy_test_submitter(void *arg)
+{
+    long     id  = (long)arg;
+    uint8_t* buf = wy_test_buf[id];
+    params_t p;
+    ssize_t  status;
+    uint32_t iter;
+
+    for (iter = 0; iter < WY_TEST_ITERS; iter++)
+    {
+        // Only checksums are long enough to be deferred, as deferred copies to
+        // the thread's slice of the window could overlap
+        p = wy_test_params((iter % 3) && (iter & 1) ? WY_CMD_COPY_TO_DEV : WY_CMD_CRC32C, buf,
+                           (iter % 3) ? 64 : WY_TEST_SLICE, (uint32_t)id * WY_TEST_SLICE);
+
+        if (iter & 2)
+        {
+            p.tag  = (uint64_t)id * WY_TEST_ITERS + iter + 1;
+            status = wy_emu_ioctl_cmd(wy_test_file, &p);
+
+            WY_TEST_CHECK(status == 0 || status == -EBUSY);
+
+            if (!status)
+            {
+                atomic_fetch_add(&wy_test_tagged, 1);
+            }
+        }
+        else
+        {
+            WY_TEST_CHECK(wy_emu_write(wy_test_file, &p, sizeof(params_t)) == sizeof(params_t));
+        }
+
+        if (wy_emu_read(wy_test_file, &p, sizeof(params_t), true) == sizeof(params_t))
+        {
+            wy_test_cpl(&p);
+        }
+    }
+
+    return NULL;
+}
+
+// Writes descriptors whose fields all hold the same value
+static void *wy_test_last_writer(void *arg)
+{
+    wy_emu_file_t* ctx = arg;
+    params_t       p;
+    uint32_t       iter;
+
+    for (iter = 1; iter <= WY_TEST_ITERS; iter++)
+    {
+        p        = wy_test_params(WY_CMD_DEFAULT, NULL, iter, iter);
+        p.result = iter;
+
+        WY_TEST_CHECK(wy_emu_write(ctx, &p, sizeof(params_t)) == sizeof(params_t));
+    }
+
+    return NULL;
+}
+
+// Reads the last descriptor whilst it is written, checking it is never torn
+static void *wy_test_last_reader(void *arg)
+{
+    wy_emu_file_t* ctx = arg;
+    params_t       p;
+
+    while (atomic_load(&wy_test_writing))
+    {
+        WY_TEST_CHECK(wy_emu_read(ctx, &p, sizeof(params_t), true) == sizeof(params_t));
+        WY_TEST_CHECK(p.len == p.offset && p.result == p.len);
+    }
+
+    return NULL;
+}
+
+static void wy_test_stress(void)
+{
+    wy_emu_config_t cfg = { .defer_threshold = WY_TEST_THRESHOLD, .queue_depth = 32, .max_open = 2,
+                            .engine_workers  = 3 };
+    wy_emu_dev_t*   dev;
+    wy_emu_file_t*  last;
+    pthread_t       threads[WY_TEST_THREADS];
+    pthread_t       readers[2];
+    params_t        p;
+    long            idx;
+
+    dev          = wy_emu_dev_create(&cfg);
+    wy_test_file = wy_emu_open(dev);
+    last         = wy_emu_open(dev);
+
+    WY_TEST_CHECK(dev && wy_test_file && last);
+
+    if (!dev || !wy_test_file || !last)
+    {
+        return;
+    }
+
+    for (idx = 0; idx < WY_TEST_THREADS; idx++)
+    {
+        pthread_create(&threads[idx], NULL, wy_test_submitter, (void*)idx);
+    }
+
+    for (idx = 0; idx < WY_TEST_THREADS; idx++)
+    {
+        pthread_join(threads[idx], NULL);
+    }
+
+    // Read the remaining completions. The queue depth can only be set once
+    // none are left to read or in flight
+    for (;;)
+    {
+        p = wy_test_params(WY_CMD_SET_QDEPTH, NULL, 32, 0);
+
+        if (!wy_emu_ioctl_cmd(wy_test_file, &p))
+        {
+            break;
+        }
+
+        if (wy_emu_read(wy_test_file, &p, sizeof(params_t), false) == sizeof(params_t))
+        {
+            wy_test_cpl(&p);
+        }
+    }
+
+    // Every tagged command's completion was read, and only once
+
+    WY_TEST_CHECK(atomic_load(&wy_test_cpls) == atomic_load(&wy_test_tagged));
+
+    // Writers of the last descriptor, on a file of their own, race readers
+    atomic_store(&wy_test_writing, true);
+
+    for (idx = 0; idx < 2; idx++)
+    {
+        pthread_create(&readers[idx], NULL, wy_test_last_reader, last);
+    }
+
+    for (idx = 0; idx < WY_TEST_THREADS; idx++)
+    {
+        pthread_create(&threads[idx], NULL, wy_test_last_writer, last);
+    }
+
+    for (idx = 0; idx < WY_TEST_THREADS; idx++)
+    {
+        pthread_join(threads[idx], NULL);
+    }
+
+    atomic_store(&wy_test_writing, false);
+
+    for (idx = 0; idx < 2; idx++)
+    {
+        pthread_join(readers[idx], NULL);
+    }
+
+    wy_emu_release(last);
+    wy_emu_release(wy_test_file);
+    wy_emu_dev_destroy(dev);
+}
+
+// ------------------------------------------------------------
+// Main
+// ------------------------------------------------------------
+
+int main(void)
+{
+    wy_test_smoke();
+    wy_test_stress();
+
+    printf("wy_emu_test: %s\n", atomic_load(&wy_test_fails) ? "FAIL" : "ok");
+
+    return atomic_load(&wy_test_fails) ? 1 : 0;
+}
@@ -0,0 +1,501 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// Header only C++ (17) client library for the wy_module device.
+//
+// wy::device owns an open device file, and wy::mapping and
+// wy::buffer own mapped and page aligned memory. All are move
+// only. wy::cmd builds params_t for each command. Commands are
+// submitted one at a time with device::submit, or in batches
+// through a wy::ring. Only construction allocates or throws;
+// submission, flushing and reaping do neither.
+// ------------------------------------------------------------
+
+#ifndef _WY_MODULE_HPP_
+#define _WY_MODULE_HPP_
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "../uapi/wy_module.h"
+
+namespace wy
+{
+
+// ------------------------------------------------------------
+// Errors from construction are thrown as std::system_error
+// ------------------------------------------------------------
+
+[[noreturn]] inline void throw_errno(const char* what)
+{
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+// ------------------------------------------------------------
+// Command builders. Each returns the params_t for a command,
+// with unused fields zero
+// ------------------------------------------------------------
+
+namespace cmd
+{
+
+inline params_t make(uint32_t cmd, const void* vaddr = nullptr, uint32_t len = 0, uint32_t offset = 0)
+{
+    params_t p {};
+
+    p.cmd     = cmd;
+    p.version = WY_ABI_VERSION;
+    p.vaddr   = reinterpret_cast<uintptr_t>(vaddr);
+    p.len     = len;
+    p.offset  = offset;
+
+    return p;
+}
+
+inline params_t nop()                                     { return make(WY_CMD_DEFAULT); }
+inline params_t stream_start(uint32_t chunk)              { return make(WY_CMD_STREAM_START, nullptr, chunk); }
+inline params_t stream_stop()                             { return make(WY_CMD_STREAM_STOP); }
+inline params_t mem_fill(uint32_t len)                    { return make(WY_CMD_MEM_FILL, nullptr, len); }
+inline params_t set_qdepth(uint32_t depth)                { return make(WY_CMD_SET_QDEPTH, nullptr, depth); }
+inline params_t flush()                                   { return make(WY_CMD_FLUSH); }
+
+// Copies between a user buffer and the memory window
+inline params_t copy_to_dev(const void* src, uint32_t len, uint32_t offset)
+{
+    return make(WY_CMD_COPY_TO_DEV, src, len, offset);
+}
+
+inline params_t copy_from_dev(void* dst, uint32_t len, uint32_t offset)
+{
+    return make(WY_CMD_COPY_FROM_DEV, dst, len, offset);
+}
+
+// Checksums of a user buffer, or of the window at offset when src is null
+inline params_t crc32c(const void* src, uint32_t len, uint32_t seed = 0, uint32_t offset = 0)
+{
+    params_t p = make(WY_CMD_CRC32C, src, len, offset);
+
+    p.seed = seed;
+
+    return p;
+}
+
+inline params_t xxh64(const void* src, uint32_t len, uint32_t seed = 0, uint32_t offset = 0)
+{
+    params_t p = make(WY_CMD_XXH64, src, len, offset);
+
+    p.seed = seed;
+
+    return p;
+}
+
+// Compression of a user buffer into a frame in the window, and back
+inline params_t compress(const void* src, uint32_t len, uint32_t offset, uint32_t algo = WY_ALGO_LZ4)
+{
+    params_t p = make(WY_CMD_COMPRESS, src, len, offset);
+
+    p.algo = algo;
+
+    return p;
+}
+
+inline params_t decompress(void* dst, uint32_t cap, uint32_t offset)
+{
+    return make(WY_CMD_DECOMPRESS, dst, cap, offset);
+}
+
+// Mark a command to complete through the completion queue
+inline params_t tagged(params_t p, uint64_t tag)
+{
+    p.tag = tag;
+
+    return p;
+}
+
+} // namespace cmd
+
+// ------------------------------------------------------------
+// An open device file
+// ------------------------------------------------------------
+
+class device
+{
+public:
+    explicit device(const char* path = "/dev/wy_module", int flags = O_RDWR)
+        : fd_(::open(path, flags | O_CLOEXEC))
+    {
+        if (fd_ < 0)
+        {
+            throw_errno(path);
+        }
+    }
+
+    device(device&& other) noexcept : fd_(std::exchange(other.fd_, -1)) {}
+
+    device& operator=(device&& other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            fd_ = std::exchange(other.fd_, -1);
+        }
+
+        return *this;
+    }
+
+    device(const device&)            = delete;
+    device& operator=(const device&) = delete;
+
+    ~device() { close(); }
+
+    int fd() const { return fd_; }
+
+    // Execute a command, updating p with its status and result. Returns 0 or
+    // a negative errno. Tagged and deferred commands complete through
+    // read_completion instead, and return 0 once submitted
+    int submit(params_t& p) const
+    {
+        return ::ioctl(fd_, WY_IOC_CMD, &p) < 0 ? -errno : p.status;
+    }
+
+    // Submit with the original write interface
+    int write(const params_t& p) const
+    {
+        return ::write(fd_, &p, sizeof(params_t)) < 0 ? -errno : 0;
+    }
+
+    // Submit a batch of n commands in one write, in order. Returns the number
+    // submitted, which is less than n if one failed, or a negative errno if the
+    // first did
+    ssize_t write(const params_t* p, size_t n) const
+    {
+        ssize_t done = ::write(fd_, p, n * sizeof(params_t));
+
+        return done < 0 ? -errno : done / ssize_t(sizeof(params_t));
+    }
+
+    // Read the next completion, blocking unless opened O_NONBLOCK. Returns 0,
+    // -EAGAIN, or another negative errno
+    int read_completion(params_t& p) const
+    {
+        return ::read(fd_, &p, sizeof(params_t)) < 0 ? -errno : 0;
+    }
+
+    // Wake the ring consumer, optionally waiting for it to drain the SQ
+    int flush(bool wait = false) const
+    {
+        return ::ioctl(fd_, WY_IOC_FLUSH, wait ? WY_FLUSH_WAIT : 0) < 0 ? -errno : 0;
+    }
+
+    // Positional access to the memory window
+    ssize_t window_read(void* dst, size_t len, uint32_t offset) const
+    {
+        return ::pread(fd_, dst, len, WY_MEM_BASE + offset);
+    }
+
+    ssize_t window_write(const void* src, size_t len, uint32_t offset) const
+    {
+        return ::pwrite(fd_, src, len, WY_MEM_BASE + offset);
+    }
+
+private:
+    void close()
+    {
+        if (fd_ >= 0)
+        {
+            ::close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    int fd_;
+};
+
+// ------------------------------------------------------------
+// A region of the device mapped into memory, such as the
+// register page or a file's rings
+// ------------------------------------------------------------
+
+class mapping
+{
+public:
+    mapping() = default;
+
+    mapping(const device& dev, size_t len, off_t offset)
+        : addr_(::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, dev.fd(), offset)), len_(len)
+    {
+        if (addr_ == MAP_FAILED)
+        {
+            addr_ = nullptr;
+            throw_errno("mmap");
+        }
+    }
+
+    mapping(mapping&& other) noexcept
+        : addr_(std::exchange(other.addr_, nullptr)), len_(std::exchange(other.len_, 0)) {}
+
+    mapping& operator=(mapping&& other) noexcept
+    {
+        if (this != &other)
+        {
+            unmap();
+            addr_ = std::exchange(other.addr_, nullptr);
+            len_  = std::exchange(other.len_, 0);
+        }
+
+        return *this;
+    }
+
+    mapping(const mapping&)            = delete;
+    mapping& operator=(const mapping&) = delete;
+
+    ~mapping() { unmap(); }
+
+    template <typename T> T* as() const { return static_cast<T*>(addr_); }
+
+    void*  data() const { return addr_; }
+    size_t size() const { return len_; }
+
+private:
+    void unmap()
+    {
+        if (addr_)
+        {
+            ::munmap(addr_, len_);
+            addr_ = nullptr;
+        }
+    }
+
+    void*  addr_ = nullptr;
+    size_t len_  = 0;
+};
+
+// ------------------------------------------------------------
+// A page aligned user buffer for commands' vaddr. Page
+// alignment keeps pinned and DMA copies to whole pages
+// ------------------------------------------------------------
+
+class buffer
+{
+public:
+    buffer() = default;
+
+    explicit buffer(size_t len) : len_(len)
+    {
+        if (posix_memalign(&addr_, static_cast<size_t>(::sysconf(_SC_PAGESIZE)), len))
+        {
+            addr_ = nullptr;
+            throw std::bad_alloc();
+        }
+
+        std::memset(addr_, 0, len);
+    }
+
+    buffer(buffer&& other) noexcept
+        : addr_(std::exchange(other.addr_, nullptr)), len_(std::exchange(other.len_, 0)) {}
+
+    buffer& operator=(buffer&& other) noexcept
+    {
+        if (this != &other)
+        {
+            std::free(addr_);
+            addr_ = std::exchange(other.addr_, nullptr);
+            len_  = std::exchange(other.len_, 0);
+        }
+
+        return *this;
+    }
+
+    buffer(const buffer&)            = delete;
+    buffer& operator=(const buffer&) = delete;
+
+    ~buffer() { std::free(addr_); }
+
+    template <typename T> T* as() const { return static_cast<T*>(addr_); }
+
+    void*    data() const { return addr_; }
+    uint32_t size() const { return static_cast<uint32_t>(len_); }
+
+private:
+    void*  addr_ = nullptr;
+    size_t len_  = 0;
+};
+
+// ------------------------------------------------------------
+// The emulated register page. A command is issued with a single
+// store to the doorbell
+// ------------------------------------------------------------
+
+class regs
+{
+public:
+    explicit regs(const device& dev) : map_(dev, static_cast<size_t>(::sysconf(_SC_PAGESIZE)), WY_REGS_OFFSET) {}
+
+    // Issue a command and spin until the device reports it done
+    int issue(uint32_t cmd, uint32_t len)
+    {
+        volatile wy_regs_t* r = map_.as<wy_regs_t>();
+        uint32_t            n = r->doorbell + 1;
+
+        r->cmd = cmd;
+        r->len = len;
+        __atomic_store_n(&r->doorbell, n, __ATOMIC_RELEASE);
+
+        while (__atomic_load_n(&r->done, __ATOMIC_ACQUIRE) != n)
+        {
+        }
+
+        return r->status;
+    }
+
+private:
+    mapping map_;
+};
+
+// ------------------------------------------------------------
+// A file's submission and completion rings. Entries are pushed
+// and then submitted together, with a system call only when the
+// driver's consumer is idle. A device may have one ring per
+// open file
+// ------------------------------------------------------------
+
+class ring
+{
+public:
+    explicit ring(const device& dev, uint32_t sq_entries = 256, uint32_t cq_entries = 0,
+                  uint32_t flags = 0, int32_t sq_cpu = -1, uint32_t sq_idle_ms = 0)
+        : dev_(&dev)
+    {
+        wy_ring_setup_t setup {};
+
+        setup.sq_entries = sq_entries;
+        setup.cq_entries = cq_entries;
+        setup.flags      = flags;
+        setup.sq_cpu     = sq_cpu;
+        setup.sq_idle_ms = sq_idle_ms;
+
+        if (::ioctl(dev.fd(), WY_IOC_RING_SETUP, &setup) < 0)
+        {
+            throw_errno("WY_IOC_RING_SETUP");
+        }
+
+        map_     = mapping(dev, setup.size, WY_RING_OFFSET);
+        hdr_     = map_.as<wy_ring_hdr_t>();
+        sqes_    = reinterpret_cast<params_t*>(map_.as<char>() + setup.sq_off);
+        cqes_    = reinterpret_cast<params_t*>(map_.as<char>() + setup.cq_off);
+        sq_mask_ = setup.sq_entries - 1;
+        cq_mask_ = setup.cq_entries - 1;
+        sq_tail_ = hdr_->sq_tail;
+    }
+
+    ring(ring&&)            = default;
+    ring& operator=(ring&&) = default;
+
+    // Queue an entry without submitting it. Returns false if the SQ is full
+    bool push(const params_t& p)
+    {
+        if (sq_tail_ - __atomic_load_n(&hdr_->sq_head, __ATOMIC_ACQUIRE) > sq_mask_)
+        {
+            return false;
+        }
+
+        sqes_[sq_tail_++ & sq_mask_] = p;
+
+        return true;
+    }
+
+    // Queue up to n entries, returning how many were queued
+    size_t push(const params_t* p, size_t n)
+    {
+        size_t idx = 0;
+
+        while (idx < n && push(p[idx]))
+        {
+            idx++;
+        }
+
+        return idx;
+    }
+
+    // Publish queued entries, flushing only if the consumer needs waking.
+    // The fence pairs with the one the driver makes before going idle
+    int submit(bool wait = false)
+    {
+        __atomic_store_n(&hdr_->sq_tail, sq_tail_, __ATOMIC_RELEASE);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (wait || (__atomic_load_n(&hdr_->flags, __ATOMIC_RELAXED) & WY_RING_NEED_WAKEUP))
+        {
+            return dev_->flush(wait);
+        }
+
+        return 0;
+    }
+
+    // Call f(const params_t&) for each available completion, returning the count
+    template <typename F> size_t reap(F&& f)
+    {
+        uint32_t head = hdr_->cq_head;
+        uint32_t tail = __atomic_load_n(&hdr_->cq_tail, __ATOMIC_ACQUIRE);
+        size_t   n    = 0;
+
+        for (; head != tail; head++, n++)
+        {
+            f(static_cast<const params_t&>(cqes_[head & cq_mask_]));
+        }
+
+        __atomic_store_n(&hdr_->cq_head, head, __ATOMIC_RELEASE);
+
+        return n;
+    }
+
+    // Entries pushed but not yet consumed by the driver
+    uint32_t pending() const { return sq_tail_ - __atomic_load_n(&hdr_->sq_head, __ATOMIC_ACQUIRE); }
+
+private:
+    const device*  dev_;
+    mapping        map_;
+    wy_ring_hdr_t* hdr_     = nullptr;
+    params_t*      sqes_    = nullptr;
+    params_t*      cqes_    = nullptr;
+    uint32_t       sq_mask_ = 0;
+    uint32_t       cq_mask_ = 0;
+    uint32_t       sq_tail_ = 0;
+};
+
+} // namespace wy
+
+#endif
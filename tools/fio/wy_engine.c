@@ -0,0 +1,437 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// fio external ioengine for the wy_module device, loaded with
+// ioengine=external:/path/to/wy_engine.so
+//
+// Each fio I/O is one command on the device's memory window,
+// at the I/O's offset: writes copy the buffer to the window
+// (or checksum it, with wy_cmd=crc32c or xxh64) and reads copy
+// the window into the buffer. The job's size should be at most
+// the window size (mem_window_size, 64KiB by default).
+//
+// With wy_mode=ring (the default), I/Os are queued on the
+// file's mmap'd submission ring and reaped from its completion
+// ring, so fio's iodepth and batching options apply. With
+// wy_mode=ioctl each I/O is a synchronous WY_IOC_CMD.
+// ------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fio.h"
+#include "optgroup.h"
+
+#include "../../uapi/wy_module.h"
+
+// ------------------------------------------------------------
+// Definitions
+// ------------------------------------------------------------
+
+// Engine options, set in the job file
+struct wy_options
+{
+    void*          pad;       // fio requires the first member to be a pointer
+    char*          mode;      // "ring" or "ioctl"
+    char*          cmd;       // "copy", "crc32c" or "xxh64"
+    unsigned int   sqpoll;    // Consume the SQ with a driver polling thread
+};
+
+// Per thread engine state. fio's I/O units complete through the
+// ring with their address as the tag
+struct wy_data
+{
+    int            use_ring;
+    uint32_t       write_cmd;
+    struct io_u**  events;    // Completed I/O units, returned by event
+    void*          map;
+    size_t         map_size;
+    wy_ring_hdr_t* hdr;
+    params_t*      sqes;
+    params_t*      cqes;
+    uint32_t       sq_mask;
+    uint32_t       cq_mask;
+    uint32_t       sq_tail;   // Local SQ tail, published by commit
+};
+
+static struct fio_option options[] =
+{
+    {
+        .name     = "wy_mode",
+        .lname    = "wy_module submission mode",
+        .type     = FIO_OPT_STR_STORE,
+        .off1     = offsetof(struct wy_options, mode),
+        .def      = "ring",
+        .help     = "Submit through the mmap'd rings (ring) or WY_IOC_CMD (ioctl)",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "wy_cmd",
+        .lname    = "wy_module write command",
+        .type     = FIO_OPT_STR_STORE,
+        .off1     = offsetof(struct wy_options, cmd),
+        .def      = "copy",
+        .help     = "Command for writes: copy, crc32c or xxh64",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = "wy_sqpoll",
+        .lname    = "wy_module SQ polling",
+        .type     = FIO_OPT_BOOL,
+        .off1     = offsetof(struct wy_options, sqpoll),
+        .def      = "0",
+        .help     = "Consume the ring with a driver polling thread",
+        .category = FIO_OPT_C_ENGINE,
+        .group    = FIO_OPT_G_INVALID,
+    },
+    {
+        .name     = NULL,
+    },
+};
+
+// ------------------------------------------------------------
+// Engine set up and tear down
+// ------------------------------------------------------------
+
+static int wy_init(struct thread_data *td)
+{
+    struct wy_options* o = td->eo;
+    struct wy_data*    wd;
+
+    wd = calloc(1, sizeof(*wd));
+
+    if (!wd)
+    {
+        return 1;
+    }
+
+    wd->events = calloc(td->o.iodepth, sizeof(struct io_u*));
+
+    if (!wd->events)
+    {
+        free(wd);
+        return 1;
+    }
+
+    wd->use_ring = strcmp(o->mode, "ioctl") != 0;
+
+    if (!strcmp(o->cmd, "crc32c"))
+    {
+        wd->write_cmd = WY_CMD_CRC32C;
+    }
+    else if (!strcmp(o->cmd, "xxh64"))
+    {
+        wd->write_cmd = WY_CMD_XXH64;
+    }
+    else
+    {
+        wd->write_cmd = WY_CMD_COPY_TO_DEV;
+    }
+
+    td->io_ops_data = wd;
+
+    return 0;
+}
+
+static void wy_cleanup(struct thread_data *td)
+{
+    struct wy_data* wd = td->io_ops_data;
+
+    if (wd)
+    {
+        if (wd->map)
+        {
+            munmap(wd->map, wd->map_size);
+        }
+
+        free(wd->events);
+        free(wd);
+    }
+}
+
+// ------------------------------------------------------------
+// Open the device, setting up its rings in ring mode. Rings are
+// per open file, so a job has a single file
+// ------------------------------------------------------------
+
+static int wy_open_file(struct thread_data *td, struct fio_file *f)
+{
+    struct wy_options* o  = td->eo;
+    struct wy_data*    wd = td->io_ops_data;
+    wy_ring_setup_t    setup;
+    uint32_t           entries;
+
+    if (wd->map)
+    {
+        log_err("wy_module: only one file per job is supported\n");
+        return EINVAL;
+    }
+
+    f->fd = open(f->file_name, O_RDWR | O_CLOEXEC);
+
+    if (f->fd < 0)
+    {
+        td_verror(td, errno, "open");
+        return errno;
+    }
+
+    if (!wd->use_ring)
+    {
+        return 0;
+    }
+
+    // The SQ is the iodepth rounded up to a power of 2, with the default CQ
+    for (entries = 1; entries < td->o.iodepth; entries <<= 1)
+        ;
+
+    memset(&setup, 0, sizeof(setup));
+    setup.sq_entries = entries;
+    setup.flags      = o->sqpoll ? WY_RING_SETUP_SQPOLL : 0;
+    setup.sq_cpu     = -1;
+
+    if (ioctl(f->fd, WY_IOC_RING_SETUP, &setup) < 0)
+    {
+        td_verror(td, errno, "WY_IOC_RING_SETUP");
+        goto err;
+    }
+
+    wd->map = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, f->fd, WY_RING_OFFSET);
+
+    if (wd->map == MAP_FAILED)
+    {
+        wd->map = NULL;
+        td_verror(td, errno, "mmap");
+        goto err;
+    }
+
+    wd->map_size = setup.size;
+    wd->hdr      = wd->map;
+    wd->sqes     = (params_t*)((char*)wd->map + setup.sq_off);
+    wd->cqes     = (params_t*)((char*)wd->map + setup.cq_off);
+    wd->sq_mask  = setup.sq_entries - 1;
+    wd->cq_mask  = setup.cq_entries - 1;
+    wd->sq_tail  = wd->hdr->sq_tail;
+
+    return 0;
+
+err:
+    close(f->fd);
+    f->fd = -1;
+
+    return td->error;
+}
+
+static int wy_close_file(struct thread_data *td, struct fio_file *f)
+{
+    struct wy_data* wd = td->io_ops_data;
+
+    if (wd->map)
+    {
+        munmap(wd->map, wd->map_size);
+        wd->map = NULL;
+    }
+
+    if (f->fd >= 0)
+    {
+        close(f->fd);
+    }
+
+    f->fd = -1;
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Fill the command for an I/O unit
+// ------------------------------------------------------------
+
+static void wy_prep_cmd(struct wy_data *wd, struct io_u *io_u, params_t *p)
+{
+    memset(p, 0, sizeof(*p));
+
+    p->version = WY_ABI_VERSION;
+    p->cmd     = io_u->ddir == DDIR_READ ? WY_CMD_COPY_FROM_DEV : wd->write_cmd;
+    p->vaddr   = (uintptr_t)io_u->xfer_buf;
+    p->len     = io_u->xfer_buflen;
+    p->offset  = io_u->offset;
+
+    // Ring entries carry the I/O unit back in their completion. A
+    // tagged WY_IOC_CMD would complete through read, so it has none
+    if (wd->use_ring)
+    {
+        p->tag = (uintptr_t)io_u;
+    }
+}
+
+static void wy_complete(struct io_u *io_u, const params_t *p)
+{
+    io_u->error = p->status < 0 ? -p->status : 0;
+    io_u->resid = p->status < 0 ? io_u->xfer_buflen : 0;
+}
+
+// ------------------------------------------------------------
+// Queue an I/O. In ring mode it is only visible to the driver
+// once committed
+// ------------------------------------------------------------
+
+static enum fio_q_status wy_queue(struct thread_data *td, struct io_u *io_u)
+{
+    struct wy_data* wd = td->io_ops_data;
+    params_t        p;
+
+    fio_ro_check(td, io_u);
+
+    // Nothing is cached, so syncs and trims have nothing to do
+    if (io_u->ddir != DDIR_READ && io_u->ddir != DDIR_WRITE)
+    {
+        return FIO_Q_COMPLETED;
+    }
+
+    wy_prep_cmd(wd, io_u, &p);
+
+    if (!wd->use_ring)
+    {
+        if (ioctl(io_u->file->fd, WY_IOC_CMD, &p) < 0)
+        {
+            p.status = -errno;
+        }
+
+        wy_complete(io_u, &p);
+
+        return FIO_Q_COMPLETED;
+    }
+
+    if (wd->sq_tail - __atomic_load_n(&wd->hdr->sq_head, __ATOMIC_ACQUIRE) > wd->sq_mask)
+    {
+        return FIO_Q_BUSY;
+    }
+
+    wd->sqes[wd->sq_tail++ & wd->sq_mask] = p;
+
+    return FIO_Q_QUEUED;
+}
+
+// ------------------------------------------------------------
+// Publish queued entries, flushing only if the driver's ring
+// consumer is idle. The fence pairs with the driver's before
+// it sets WY_RING_NEED_WAKEUP
+// ------------------------------------------------------------
+
+static int wy_commit(struct thread_data *td)
+{
+    struct wy_data* wd = td->io_ops_data;
+
+    if (!wd->use_ring)
+    {
+        return 0;
+    }
+
+    __atomic_store_n(&wd->hdr->sq_tail, wd->sq_tail, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&wd->hdr->flags, __ATOMIC_RELAXED) & WY_RING_NEED_WAKEUP)
+    {
+        if (ioctl(td->files[0]->fd, WY_IOC_FLUSH, 0) < 0)
+        {
+            td_verror(td, errno, "WY_IOC_FLUSH");
+            return -errno;
+        }
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Reap between min and max completions. Whilst fewer than min
+// are available, wait for the consumer to drain the SQ
+// ------------------------------------------------------------
+
+static int wy_getevents(struct thread_data *td, unsigned int min, unsigned int max, const struct timespec *t)
+{
+    struct wy_data* wd     = td->io_ops_data;
+    unsigned int    events = 0;
+
+    while (1)
+    {
+        uint32_t head = wd->hdr->cq_head;
+        uint32_t tail = __atomic_load_n(&wd->hdr->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail && events < max; head++)
+        {
+            const params_t* p    = &wd->cqes[head & wd->cq_mask];
+            struct io_u*    io_u = (struct io_u*)(uintptr_t)p->tag;
+
+            wy_complete(io_u, p);
+            wd->events[events++] = io_u;
+        }
+
+        __atomic_store_n(&wd->hdr->cq_head, head, __ATOMIC_RELEASE);
+
+        if (events >= min)
+        {
+            return events;
+        }
+
+        if (ioctl(td->files[0]->fd, WY_IOC_FLUSH, WY_FLUSH_WAIT) < 0 && errno != EINTR)
+        {
+            td_verror(td, errno, "WY_IOC_FLUSH");
+            return -errno;
+        }
+    }
+}
+
+static struct io_u *wy_event(struct thread_data *td, int event)
+{
+    struct wy_data* wd = td->io_ops_data;
+
+    return wd->events[event];
+}
+
+// ------------------------------------------------------------
+// The engine, found by fio under this symbol name
+// ------------------------------------------------------------
+
+struct ioengine_ops ioengine =
+{
+    .name               = "wy_module",
+    .version            = FIO_IOOPS_VERSION,
+    .flags              = FIO_DISKLESSIO | FIO_NODISKUTIL | FIO_NOEXTEND,
+    .init               = wy_init,
+    .cleanup            = wy_cleanup,
+    .open_file          = wy_open_file,
+    .close_file         = wy_close_file,
+    .queue              = wy_queue,
+    .commit             = wy_commit,
+    .getevents          = wy_getevents,
+    .event              = wy_event,
+    .options            = options,
+    .option_struct_size = sizeof(struct wy_options),
+};
@@ -0,0 +1,338 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+
+// ------------------------------------------------------------
+// libFuzzer target for the wy_module command ABI, run against
+// the user space emulation in emu/. The input drives a file with
+// a sequence of operations: batched writes and ioctl submissions
+// of raw descriptors, completion reads, and ring setup layouts
+// through the core decoder. "User" memory is an arena allocated
+// for each input, and emu's uaccess hook accepts only buffers
+// within it, so that a command touching memory its checks did
+// not cover is reported by ASan. Descriptors written and read
+// are staged at the start of the arena, as a process's buffers
+// would be, and vaddrs point into the rest.
+//
+// Built with clang's -fsanitize=fuzzer, or with WY_FUZZ_MAIN
+// defined as a program that replays inputs given as files.
+// ------------------------------------------------------------
+
+// ------------------------------------------------------------
+// Headers
+// ------------------------------------------------------------
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../wy_core.h"
+#include "wy_emu.h"
+
+// ------------------------------------------------------------
+// Definitions
+// ------------------------------------------------------------
+
+#define WY_FUZZ_ARENA               16384
+#define WY_FUZZ_MAX_BATCH           8
+
+// Bytes at the start of the arena staging descriptors, with room for a
+// trailing partial one after a full batch
+#define WY_FUZZ_STAGE               ((WY_FUZZ_MAX_BATCH + 1) * sizeof(params_t))
+
+// Operations, selected by an input byte
+#define WY_FUZZ_OP_WRITE            0
+#define WY_FUZZ_OP_IOCTL            1
+#define WY_FUZZ_OP_READ             2
+#define WY_FUZZ_OP_RING             3
+#define WY_FUZZ_OP_NUM              4
+
+// Input remaining to be consumed
+typedef struct {
+    const uint8_t* data;
+    size_t         size;
+} wy_fuzz_in_t;
+
+// Device configurations, selected by the first input byte, so that both the
+// inline and deferred paths and full queues are reached
+static const wy_emu_config_t wy_fuzz_cfgs[] =
+{
+    { 65536, 65536, 64, 1, 2 },
+    { 65536, 256,   4,  1, 2 },
+    { 4096,  0,     1,  1, 1 },
+    { 65536, 1,     64, 1, 4 },
+};
+
+static uint8_t* wy_fuzz_arena;
+
+// ------------------------------------------------------------
+// Input helpers
+// ------------------------------------------------------------
+
+static bool wy_fuzz_take(wy_fuzz_in_t *in, void *dst, size_t len)
+{
+    if (in->size < len)
+    {
+        return false;
+    }
+
+    memcpy(dst, in->data, len);
+    in->data += len;
+    in->size -= len;
+
+    return true;
+}
+
+// Only arena memory is user memory
+static bool wy_fuzz_uaccess_check(const void *addr, unsigned long len)
+{
+    uintptr_t base = (uintptr_t)wy_fuzz_arena;
+    uintptr_t ptr  = (uintptr_t)addr;
+
+    return ptr >= base && wy_core_window_ok(ptr - base, len, WY_FUZZ_ARENA);
+}
+
+// Make a descriptor's vaddr mostly point into the arena beyond the staging
+// area. With the top bit set the raw value is kept, to exercise the rejection
+// of bad addresses
+static void wy_fuzz_fixup(params_t *p)
+{
+    if (!(p->vaddr >> 63) && p->vaddr)
+    {
+        p->vaddr = (uintptr_t)wy_fuzz_arena + WY_FUZZ_STAGE + p->vaddr % (WY_FUZZ_ARENA - WY_FUZZ_STAGE);
+    }
+}
+
+// ------------------------------------------------------------
+// Operations
+// ------------------------------------------------------------
+
+static void wy_fuzz_write(wy_emu_file_t *ctx, wy_fuzz_in_t *in)
+{
+    params_t* batch = (params_t*)wy_fuzz_arena;
+    uint8_t   sel;
+    size_t    count;
+    size_t    len;
+    ssize_t   status;
+
+    if (!wy_fuzz_take(in, &sel, 1))
+    {
+        return;
+    }
+
+    count = sel % WY_FUZZ_MAX_BATCH + 1;
+
+    memset(batch, 0, WY_FUZZ_STAGE);
+
+    for (len = 0; len < count && wy_fuzz_take(in, &batch[len], sizeof(params_t)); len++)
+    {
+        wy_fuzz_fixup(&batch[len]);
+    }
+
+    // A trailing partial descriptor, to check the length validation
+    len = len * sizeof(params_t) + (sel & 0x80 ? sel % sizeof(params_t) : 0);
+
+    if (!len)
+    {
+        return;
+    }
+
+    status = wy_emu_write(ctx, batch, len);
+
+    if (status > 0 && (status % sizeof(params_t) || (size_t)status > len))
+    {
+        __builtin_trap();
+    }
+}
+
+static void wy_fuzz_ioctl(wy_emu_file_t *ctx, wy_fuzz_in_t *in)
+{
+    params_t p;
+
+    if (wy_fuzz_take(in, &p, sizeof(params_t)))
+    {
+        wy_fuzz_fixup(&p);
+        wy_emu_ioctl_cmd(ctx, &p);
+    }
+}
+
+// Read into the staging area, which a failed read must leave untouched
+static void wy_fuzz_read(wy_emu_file_t *ctx, wy_fuzz_in_t *in)
+{
+    params_t p;
+    uint8_t  sel = 0;
+    ssize_t  status;
+
+    wy_fuzz_take(in, &sel, 1);
+
+    memset(wy_fuzz_arena, 0xa5, sizeof(params_t));
+
+    status = wy_emu_read(ctx, wy_fuzz_arena, sel & 1 ? sizeof(params_t) - 1 : sizeof(params_t), true);
+
+    memcpy(&p, wy_fuzz_arena, sizeof(params_t));
+
+    // Lengths other than a descriptor must be rejected
+    if (status == sizeof(params_t) && (sel & 1))
+    {
+        __builtin_trap();
+    }
+
+    if (status != sizeof(params_t) && memchr_inv(&p, 0xa5, sizeof(params_t)))
+    {
+        __builtin_trap();
+    }
+}
+
+// A ring setup's layout must be rejected, or fit its size with both queues
+// powers of 2 and within bounds
+static void wy_fuzz_ring(wy_fuzz_in_t *in)
+{
+    wy_ring_setup_t setup;
+    ssize_t         size;
+
+    if (!wy_fuzz_take(in, &setup, sizeof(setup)))
+    {
+        return;
+    }
+
+    size = wy_core_ring_layout(&setup);
+
+    if (size < 0)
+    {
+        return;
+    }
+
+    if (!is_power_of_2(setup.cq_entries) || setup.cq_entries > 2 * WY_MAX_QDEPTH ||
+        setup.sq_off < sizeof(wy_ring_hdr_t) ||
+        setup.cq_off < setup.sq_off + setup.sq_entries * sizeof(params_t) ||
+        (size_t)size < setup.cq_off + setup.cq_entries * sizeof(params_t))
+    {
+        __builtin_trap();
+    }
+}
+
+// ------------------------------------------------------------
+// Entry point
+// ------------------------------------------------------------
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    wy_fuzz_in_t   in = { data, size };
+    wy_emu_dev_t*  dev;
+    wy_emu_file_t* ctx;
+    uint8_t        op;
+    uint64_t       count;
+    uint64_t       errors;
+
+    if (!wy_fuzz_take(&in, &op, 1))
+    {
+        return 0;
+    }
+
+    dev = wy_emu_dev_create(&wy_fuzz_cfgs[op % (sizeof(wy_fuzz_cfgs) / sizeof(wy_fuzz_cfgs[0]))]);
+
+    if (!dev)
+    {
+        return 0;
+    }
+
+    wy_fuzz_arena        = calloc(1, WY_FUZZ_ARENA);
+    wy_emu_uaccess_check = wy_fuzz_uaccess_check;
+    ctx                  = wy_emu_open(dev);
+
+    while (ctx && wy_fuzz_arena && wy_fuzz_take(&in, &op, 1))
+    {
+        switch (op % WY_FUZZ_OP_NUM)
+        {
+        case WY_FUZZ_OP_WRITE: wy_fuzz_write(ctx, &in); break;
+        case WY_FUZZ_OP_IOCTL: wy_fuzz_ioctl(ctx, &in); break;
+        case WY_FUZZ_OP_READ:  wy_fuzz_read(ctx, &in);  break;
+        case WY_FUZZ_OP_RING:  wy_fuzz_ring(&in);       break;
+        }
+    }
+
+    // Release waits for deferred commands, which may still use the arena
+    if (ctx)
+    {
+        wy_emu_release(ctx);
+    }
+
+    for (op = 0; op < WY_CMD_NUM; op++)
+    {
+        wy_emu_cmd_stats(dev, op, &count, &errors);
+
+        if (errors > count)
+        {
+            __builtin_trap();
+        }
+    }
+
+    free(wy_fuzz_arena);
+    wy_fuzz_arena = NULL;
+
+    wy_emu_dev_destroy(dev);
+
+    return 0;
+}
+
+#ifdef WY_FUZZ_MAIN
+
+// Replay inputs without libFuzzer, such as a crash found elsewhere or a corpus
+int main(int argc, char *argv[])
+{
+    for (int idx = 1; idx < argc; idx++)
+    {
+        FILE*    fp = fopen(argv[idx], "rb");
+        uint8_t* buf;
+        long     len;
+
+        if (!fp)
+        {
+            perror(argv[idx]);
+            return 1;
+        }
+
+        fseek(fp, 0, SEEK_END);
+        len = ftell(fp);
+        rewind(fp);
+
+        buf = malloc(len ? len : 1);
+
+        if (!buf || fread(buf, 1, len, fp) != (size_t)len)
+        {
+            fprintf(stderr, "%s: read failed\n", argv[idx]);
+            return 1;
+        }
+
+        fclose(fp);
+
+        LLVMFuzzerTestOneInput(buf, len);
+        free(buf);
+
+        printf("%s: ok\n", argv[idx]);
+    }
+
+    return 0;
+}
+
+#endif
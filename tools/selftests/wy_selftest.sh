@@ -0,0 +1,116 @@
+#!/bin/sh
+#
+# Selftest of the wy_module driver, run as root with the module built.
+# Loads the module, runs wy_stress against it, and checks that:
+#
+#   wy_stress's checks all pass
+#   cmd_stats changed by exactly the executions and errors wy_stress made
+#   the accounting attribute shows nothing live once every file is closed
+#   the module unloads, without logging leaks, bugs or warnings
+#
+#   sudo ./wy_selftest.sh
+#
+# MODULE gives the module, by default the one built in the top directory,
+# and PROCS, THREADS, ITERS and SLICE the wy_stress options. Exits with 0
+# on success, 1 on a failure and 4, kselftest's skip, if it cannot run.
+
+KSFT_SKIP=4
+
+DIR=$(dirname "$0")
+MODULE=${MODULE:-$DIR/../../wy_module.ko}
+PROCS=${PROCS:-4}
+THREADS=${THREADS:-4}
+ITERS=${ITERS:-200}
+SLICE=${SLICE:-16384}
+DEV=/dev/wy_module
+SYS=/sys/class/chardrv/wy_module
+MARK="wy_selftest: start $$"
+TMP=$(mktemp -d)
+LOADED=0
+
+cleanup()
+{
+    [ $LOADED = 1 ] && rmmod wy_module
+    rm -rf "$TMP"
+}
+
+trap cleanup EXIT
+
+skip()
+{
+    echo "SKIP: $*"
+    exit $KSFT_SKIP
+}
+
+fail()
+{
+    echo "FAIL: $*"
+    exit 1
+}
+
+# ------------------------------------------------------------
+# Load
+# ------------------------------------------------------------
+
+[ "$(id -u)" = 0 ]        || skip "must be run as root"
+[ -f "$MODULE" ]          || skip "no module at $MODULE"
+[ -x "$DIR/wy_stress" ]   || skip "wy_stress is not built"
+grep -q '^wy_module ' /proc/modules && skip "wy_module is already loaded"
+
+echo "$MARK" > /dev/kmsg
+
+# Every thread has two files open at once and every process one more, and
+# each thread a slice of the window. Bulk commands of a page or more are
+# deferred to the engine
+insmod "$MODULE" max_open=$((PROCS * (2 * THREADS + 1) + 8)) mem_window_size=$((PROCS * THREADS * SLICE)) \
+       defer_threshold=4096 || fail "insmod $MODULE"
+LOADED=1
+
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    [ -c $DEV ] && break
+    sleep 0.5
+done
+
+[ -c $DEV ] || fail "no $DEV"
+
+# ------------------------------------------------------------
+# Stress
+# ------------------------------------------------------------
+
+cat $SYS/cmd_stats > "$TMP/before"
+
+"$DIR/wy_stress" -d $DEV -p "$PROCS" -t "$THREADS" -n "$ITERS" -s "$SLICE" > "$TMP/expected" || fail "wy_stress"
+
+cat $SYS/cmd_stats > "$TMP/after"
+
+# Lines of name, count and errors. Each command's change must be as expected
+awk 'FILENAME == ARGV[1] { count[$1] = $2; errors[$1] = $3; next }
+     FILENAME == ARGV[2] { delta[$1] = ($2 - count[$1]) " " ($3 - errors[$1]); next }
+     delta[$1] != $2 " " $3 { print "cmd_stats " $1 ": " delta[$1] ", expected " $2 " " $3; bad = 1 }
+     END { exit bad }' "$TMP/before" "$TMP/after" "$TMP/expected" || fail "cmd_stats"
+
+# Releases are finished by the time the processes are reaped, but allow a
+# moment for any straggler
+for i in 1 2 3 4 5 6 7 8 9 10; do
+    awk '$2 != 0 { live = 1 } END { exit live }' $SYS/accounting && break
+    sleep 0.1
+done
+
+awk '$2 != 0 { print "accounting " $1 " " $2; live = 1 } END { exit live }' $SYS/accounting || fail "live objects"
+
+# ------------------------------------------------------------
+# Unload
+# ------------------------------------------------------------
+
+rmmod wy_module || fail "rmmod"
+LOADED=0
+
+dmesg | awk -v mark="$MARK" 'index($0, mark) { found = 1 } found' > "$TMP/log"
+
+[ -s "$TMP/log" ] || fail "kernel log from the start of the test is lost"
+
+if grep -E 'wy_module.*leaked|BUG:|WARNING:' "$TMP/log"; then
+    fail "kernel log"
+fi
+
+echo "PASS: wy_module"
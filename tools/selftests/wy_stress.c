@@ -0,0 +1,780 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// Stress and error path test of a loaded wy_module instance,
+// run by wy_selftest.sh.
+//
+// Forks -p processes of -t threads each. The threads of a
+// process share one file for inline commands and concurrent
+// writes and reads of the last parameters, and each thread also
+// opens its own file for:
+//
+//   tagged and deferred copies through its own -s byte slice of
+//   the memory window, checked by copying back and by CRC32C
+//   batches of tagged commands, completing out of order
+//   the queue depth limit, and release with commands in flight
+//   a ring, consumed by a work item or an SQ poll thread
+//
+// and the first thread of each process runs the error paths.
+// Every check is made against results computed here.
+//
+// On success, prints the number of executions and errors of each
+// command, in the format of the cmd_stats attribute, for the
+// runner to compare with the change in cmd_stats. The instance
+// must allow at least p * (2t + 1) opens, have a window of at
+// least p * t * s bytes, and a defer_threshold over 256 bytes,
+// so that the commands on the shared files run inline.
+// ------------------------------------------------------------
+
+// ------------------------------------------------------------
+// Headers
+// ------------------------------------------------------------
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "../../uapi/wy_module.h"
+
+// ------------------------------------------------------------
+// Definitions
+// ------------------------------------------------------------
+
+#define WY_STRESS_SMALL             256        // Length of commands on the shared file
+#define WY_STRESS_BATCH             8          // Tagged commands per batch write
+#define WY_STRESS_QDEPTH            4          // Queue depth set for the limit test
+#define WY_STRESS_RING_ENTRIES      8
+#define WY_STRESS_TAG_BASE          0x5700000000000000ULL
+
+// Command names, as in the driver's cmd_stats
+static const char* const wy_stress_names[WY_CMD_NUM] =
+{
+    "default", "stream_start", "stream_stop", "mem_fill", "set_qdepth", "crc32c",
+    "xxh64", "compress", "decompress", "copy_to_dev", "copy_from_dev", "flush",
+};
+
+// Expected changes in cmd_stats, and the failure count, shared by the processes
+typedef struct {
+    uint64_t count[WY_CMD_NUM];
+    uint64_t errors[WY_CMD_NUM];
+    uint32_t failures;
+} wy_stress_tally_t;
+
+// A thread's test context
+typedef struct {
+    uint32_t proc;
+    uint32_t thread;
+    int      shared_fd;      // The process's shared file
+    uint32_t offset;         // This thread's slice of the memory window
+    uint8_t* buf;            // Data copied and summed, of slice bytes
+    uint8_t* chk;            // Data copied back, of slice bytes
+} wy_stress_ctx_t;
+
+static const char*        wy_stress_dev     = "/dev/wy_module";
+static uint32_t           wy_stress_procs   = 4;
+static uint32_t           wy_stress_threads = 4;
+static uint32_t           wy_stress_iters   = 200;
+static uint32_t           wy_stress_slice   = 16384;
+static wy_stress_tally_t* wy_stress_tally;
+
+// ------------------------------------------------------------
+// Helpers
+// ------------------------------------------------------------
+
+// Report a failed check, and return false from the calling test
+#define WY_STRESS_CHECK(_ctx, _cond, ...)                            \
+    do                                                               \
+    {                                                                \
+        if (!(_cond))                                                \
+        {                                                            \
+            wy_stress_fail(_ctx, __LINE__, #_cond, __VA_ARGS__);     \
+            return false;                                            \
+        }                                                            \
+    } while (0)
+
+static void wy_stress_fail(const wy_stress_ctx_t *ctx, int line, const char *cond, const char *fmt, ...)
+{
+    va_list args;
+    int     err = errno;
+
+    flockfile(stderr);
+    fprintf(stderr, "FAIL: process %u thread %u line %d: %s: ", ctx->proc, ctx->thread, line, cond);
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fprintf(stderr, " (errno %d)\n", err);
+    funlockfile(stderr);
+
+    __atomic_fetch_add(&wy_stress_tally->failures, 1, __ATOMIC_RELAXED);
+}
+
+// Count an execution of a command by the driver, with the status it returned
+static void wy_stress_account(uint32_t cmd, int32_t status)
+{
+    cmd = cmd < WY_CMD_NUM ? cmd : WY_CMD_DEFAULT;
+
+    __atomic_fetch_add(&wy_stress_tally->count[cmd], 1, __ATOMIC_RELAXED);
+
+    if (status)
+    {
+        __atomic_fetch_add(&wy_stress_tally->errors[cmd], 1, __ATOMIC_RELAXED);
+    }
+}
+
+static void wy_stress_params(params_t *p, uint32_t cmd, const void *vaddr, uint32_t len, uint32_t offset,
+                             uint64_t tag)
+{
+    memset(p, 0, sizeof(params_t));
+
+    p->cmd     = cmd;
+    p->version = WY_ABI_VERSION;
+    p->vaddr   = (uintptr_t)vaddr;
+    p->len     = len;
+    p->offset  = offset;
+    p->tag     = tag;
+}
+
+// Standard CRC32C, as returned by WY_CMD_CRC32C with a zero seed
+static uint32_t wy_stress_crc32c(const uint8_t *src, size_t len)
+{
+    uint32_t crc = ~0U;
+    size_t   idx;
+    int      bit;
+
+    for (idx = 0; idx < len; idx++)
+    {
+        crc ^= src[idx];
+
+        for (bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0x82f63b78U & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+// Fill a buffer with a pattern particular to the thread and iteration
+static void wy_stress_fill(uint8_t *buf, size_t len, uint64_t seed)
+{
+    uint64_t x = seed * 0x9e3779b97f4a7c15ULL + 1;
+    size_t   idx;
+
+    for (idx = 0; idx < len; idx++)
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+
+        buf[idx] = (uint8_t)x;
+    }
+}
+
+// Read one completion of a tagged command
+static bool wy_stress_reap(wy_stress_ctx_t *ctx, int fd, params_t *cpl)
+{
+    WY_STRESS_CHECK(ctx, read(fd, cpl, sizeof(params_t)) == sizeof(params_t), "completion read");
+    WY_STRESS_CHECK(ctx, cpl->tag >= WY_STRESS_TAG_BASE, "tag %llx", (unsigned long long)cpl->tag);
+
+    wy_stress_account(cpl->cmd, cpl->status);
+
+    return true;
+}
+
+// Submit one tagged command by write, and wait for its completion
+static bool wy_stress_tagged(wy_stress_ctx_t *ctx, int fd, params_t *p)
+{
+    params_t cpl;
+
+    WY_STRESS_CHECK(ctx, write(fd, p, sizeof(params_t)) == sizeof(params_t), "cmd %u", p->cmd);
+
+    if (!wy_stress_reap(ctx, fd, &cpl))
+    {
+        return false;
+    }
+
+    WY_STRESS_CHECK(ctx, cpl.tag == p->tag, "tag %llx", (unsigned long long)cpl.tag);
+    WY_STRESS_CHECK(ctx, cpl.status == 0, "cmd %u status %d", cpl.cmd, cpl.status);
+
+    *p = cpl;
+
+    return true;
+}
+
+// ------------------------------------------------------------
+// Tests on a thread's own file
+// ------------------------------------------------------------
+
+// Copy the buffer through the thread's slice of the window and back, and sum
+// it in the window and in a batch of segments, as tagged commands
+static bool wy_stress_data(wy_stress_ctx_t *ctx, int fd, uint32_t iter)
+{
+    params_t batch[WY_STRESS_BATCH];
+    params_t p;
+    params_t cpl;
+    uint32_t seg  = wy_stress_slice / WY_STRESS_BATCH;
+    uint32_t seen = 0;
+    uint32_t crc;
+    uint32_t idx;
+
+    wy_stress_fill(ctx->buf, wy_stress_slice, ((uint64_t)ctx->proc << 40) | ((uint64_t)ctx->thread << 20) | iter);
+    memset(ctx->chk, 0, wy_stress_slice);
+
+    crc = wy_stress_crc32c(ctx->buf, wy_stress_slice);
+
+    wy_stress_params(&p, WY_CMD_COPY_TO_DEV, ctx->buf, wy_stress_slice, ctx->offset, WY_STRESS_TAG_BASE + 1);
+
+    if (!wy_stress_tagged(ctx, fd, &p))
+    {
+        return false;
+    }
+
+    wy_stress_params(&p, WY_CMD_CRC32C, NULL, wy_stress_slice, ctx->offset, WY_STRESS_TAG_BASE + 2);
+
+    if (!wy_stress_tagged(ctx, fd, &p))
+    {
+        return false;
+    }
+
+    WY_STRESS_CHECK(ctx, (uint32_t)p.result == crc, "window crc %08x, expected %08x", (uint32_t)p.result, crc);
+
+    wy_stress_params(&p, WY_CMD_COPY_FROM_DEV, ctx->chk, wy_stress_slice, ctx->offset, WY_STRESS_TAG_BASE + 3);
+
+    if (!wy_stress_tagged(ctx, fd, &p))
+    {
+        return false;
+    }
+
+    WY_STRESS_CHECK(ctx, !memcmp(ctx->buf, ctx->chk, wy_stress_slice), "copy back, iteration %u", iter);
+
+    // Segments' sums in one write, completing in any order
+    for (idx = 0; idx < WY_STRESS_BATCH; idx++)
+    {
+        wy_stress_params(&batch[idx], WY_CMD_CRC32C, ctx->buf + idx * seg, seg, 0, WY_STRESS_TAG_BASE + idx);
+    }
+
+    WY_STRESS_CHECK(ctx, write(fd, batch, sizeof(batch)) == sizeof(batch), "batch write");
+
+    for (idx = 0; idx < WY_STRESS_BATCH; idx++)
+    {
+        if (!wy_stress_reap(ctx, fd, &cpl))
+        {
+            return false;
+        }
+
+        cpl.tag -= WY_STRESS_TAG_BASE;
+
+        WY_STRESS_CHECK(ctx, cpl.tag < WY_STRESS_BATCH && !(seen & (1U << cpl.tag)), "batch tag %llu",
+                        (unsigned long long)cpl.tag);
+        WY_STRESS_CHECK(ctx, cpl.status == 0, "batch status %d", cpl.status);
+        WY_STRESS_CHECK(ctx, (uint32_t)cpl.result == wy_stress_crc32c(ctx->buf + cpl.tag * seg, seg),
+                        "batch crc of segment %llu", (unsigned long long)cpl.tag);
+
+        seen |= 1U << cpl.tag;
+    }
+
+    return true;
+}
+
+// Fill a reduced queue depth, and then release the file with deferred
+// commands in flight, for the driver to drain
+static bool wy_stress_limits(wy_stress_ctx_t *ctx, int fd)
+{
+    params_t p;
+    params_t cpl;
+    uint32_t idx;
+
+    wy_stress_params(&p, WY_CMD_SET_QDEPTH, NULL, WY_STRESS_QDEPTH, 0, 0);
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_CMD, &p) == 0, "set_qdepth status %d", p.status);
+    wy_stress_account(p.cmd, p.status);
+
+    for (idx = 0; idx < WY_STRESS_QDEPTH; idx++)
+    {
+        wy_stress_params(&p, WY_CMD_DEFAULT, NULL, 0, 0, WY_STRESS_TAG_BASE + idx);
+
+        WY_STRESS_CHECK(ctx, write(fd, &p, sizeof(p)) == sizeof(p), "tagged write %u", idx);
+    }
+
+    wy_stress_params(&p, WY_CMD_DEFAULT, NULL, 0, 0, WY_STRESS_TAG_BASE + idx);
+
+    WY_STRESS_CHECK(ctx, write(fd, &p, sizeof(p)) < 0 && errno == EBUSY, "write beyond the queue depth");
+
+    for (idx = 0; idx < WY_STRESS_QDEPTH; idx++)
+    {
+        if (!wy_stress_reap(ctx, fd, &cpl))
+        {
+            return false;
+        }
+
+        WY_STRESS_CHECK(ctx, cpl.status == 0, "tagged default status %d", cpl.status);
+    }
+
+    for (idx = 0; idx < WY_STRESS_QDEPTH; idx++)
+    {
+        wy_stress_params(&p, WY_CMD_COPY_TO_DEV, ctx->buf, wy_stress_slice, ctx->offset, WY_STRESS_TAG_BASE + idx);
+
+        WY_STRESS_CHECK(ctx, write(fd, &p, sizeof(p)) == sizeof(p), "copy before release %u", idx);
+
+        // Executed whilst or before the file is released
+        wy_stress_account(p.cmd, 0);
+    }
+
+    return true;
+}
+
+// Sum the buffer's segments through a ring, and release it with its mapping
+static bool wy_stress_ring(wy_stress_ctx_t *ctx, int fd, bool sqpoll)
+{
+    wy_ring_setup_t setup = { .sq_entries = WY_STRESS_RING_ENTRIES, .flags = sqpoll ? WY_RING_SETUP_SQPOLL : 0,
+                              .sq_cpu = -1 };
+    uint32_t        seg   = wy_stress_slice / WY_STRESS_RING_ENTRIES;
+    wy_ring_hdr_t*  hdr;
+    params_t*       sqes;
+    params_t*       cqes;
+    params_t*       cpl;
+    uint8_t*        map;
+    uint32_t        tail;
+    uint32_t        idx;
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_RING_SETUP, &setup) == 0, "ring setup");
+
+    map = mmap(NULL, setup.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, WY_RING_OFFSET);
+
+    WY_STRESS_CHECK(ctx, map != MAP_FAILED, "ring mmap");
+
+    hdr  = (wy_ring_hdr_t*)map;
+    sqes = (params_t*)(map + setup.sq_off);
+    cqes = (params_t*)(map + setup.cq_off);
+    tail = __atomic_load_n(&hdr->sq_tail, __ATOMIC_RELAXED);
+
+    for (idx = 0; idx < WY_STRESS_RING_ENTRIES; idx++)
+    {
+        wy_stress_params(&sqes[(tail + idx) & (setup.sq_entries - 1)], WY_CMD_CRC32C, ctx->buf + idx * seg, seg, 0,
+                         WY_STRESS_TAG_BASE + idx);
+    }
+
+    __atomic_store_n(&hdr->sq_tail, tail + WY_STRESS_RING_ENTRIES, __ATOMIC_RELEASE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (ioctl(fd, WY_IOC_FLUSH, WY_FLUSH_WAIT))
+    {
+        wy_stress_fail(ctx, __LINE__, "ring flush", "sqpoll %d", sqpoll);
+        munmap(map, setup.size);
+
+        return false;
+    }
+
+    for (idx = 0; idx < WY_STRESS_RING_ENTRIES; idx++)
+    {
+        if (__atomic_load_n(&hdr->cq_tail, __ATOMIC_ACQUIRE) == hdr->cq_head)
+        {
+            wy_stress_fail(ctx, __LINE__, "ring completion", "%u of %u", idx, WY_STRESS_RING_ENTRIES);
+            munmap(map, setup.size);
+
+            return false;
+        }
+
+        cpl = &cqes[hdr->cq_head & (setup.cq_entries - 1)];
+
+        wy_stress_account(cpl->cmd, cpl->status);
+
+        if (cpl->tag != WY_STRESS_TAG_BASE + idx || cpl->status ||
+            (uint32_t)cpl->result != wy_stress_crc32c(ctx->buf + idx * seg, seg))
+        {
+            wy_stress_fail(ctx, __LINE__, "ring result", "entry %u status %d", idx, cpl->status);
+            munmap(map, setup.size);
+
+            return false;
+        }
+
+        __atomic_store_n(&hdr->cq_head, hdr->cq_head + 1, __ATOMIC_RELEASE);
+    }
+
+    munmap(map, setup.size);
+
+    return true;
+}
+
+// ------------------------------------------------------------
+// Tests on the process's shared file
+// ------------------------------------------------------------
+
+// Sum the start of the buffer inline, and publish and read back descriptors
+// concurrently with the other threads. A descriptor read back must be whole:
+// every one written has the same seed and algo, which the hash ignores
+static bool wy_stress_shared(wy_stress_ctx_t *ctx, uint32_t iter)
+{
+    params_t p;
+    uint32_t token = (ctx->thread << 24) | iter;
+
+    wy_stress_params(&p, WY_CMD_CRC32C, ctx->buf, WY_STRESS_SMALL, 0, 0);
+
+    WY_STRESS_CHECK(ctx, ioctl(ctx->shared_fd, WY_IOC_CMD, &p) == 0, "shared crc status %d", p.status);
+    wy_stress_account(p.cmd, p.status);
+
+    WY_STRESS_CHECK(ctx, (uint32_t)p.result == wy_stress_crc32c(ctx->buf, WY_STRESS_SMALL), "shared crc");
+
+    wy_stress_params(&p, WY_CMD_XXH64, NULL, 0, 0, 0);
+    p.seed = token;
+    p.algo = token;
+
+    WY_STRESS_CHECK(ctx, write(ctx->shared_fd, &p, sizeof(p)) == sizeof(p), "shared write");
+    wy_stress_account(p.cmd, 0);
+
+    WY_STRESS_CHECK(ctx, read(ctx->shared_fd, &p, sizeof(p)) == sizeof(p), "shared read");
+    WY_STRESS_CHECK(ctx, p.cmd == WY_CMD_XXH64 && p.version == WY_ABI_VERSION && p.seed == p.algo,
+                    "torn descriptor cmd %u seed %08x algo %08x", p.cmd, p.seed, p.algo);
+
+    return true;
+}
+
+// ------------------------------------------------------------
+// Error paths, each of which must fail without side effects
+// ------------------------------------------------------------
+
+static bool wy_stress_errors(wy_stress_ctx_t *ctx, int fd)
+{
+    long            page = sysconf(_SC_PAGESIZE);
+    wy_ring_setup_t setup;
+    params_t        batch[2];
+    params_t        p;
+    uint8_t*        ro;
+    uint8_t*        gone;
+
+    // Transfers that are not whole descriptors
+    WY_STRESS_CHECK(ctx, write(fd, &p, 10) < 0 && errno == EINVAL, "partial write");
+    WY_STRESS_CHECK(ctx, read(fd, &p, 10) < 0 && errno == EINVAL, "partial read");
+    WY_STRESS_CHECK(ctx, ioctl(fd, _IO(WY_IOC_MAGIC, 99), 0) < 0 && errno == ENOTTY, "unknown ioctl");
+
+    // Rejected before execution
+    wy_stress_params(&p, WY_CMD_DEFAULT, NULL, 0, 0, 0);
+    p.version = WY_ABI_VERSION + 1;
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_CMD, &p) < 0 && errno == EINVAL && p.status == -EINVAL, "bad version");
+
+    wy_stress_params(&p, WY_CMD_DEFAULT, NULL, 0, 0, 0);
+    p.rsvd[2] = 1;
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_CMD, &p) < 0 && errno == EINVAL, "reserved field set");
+
+    // A batch stopping at a bad descriptor reports those submitted before it
+    wy_stress_params(&batch[0], WY_CMD_DEFAULT, NULL, 0, 0, 0);
+    wy_stress_params(&batch[1], WY_CMD_DEFAULT, NULL, 0, 0, 0);
+    batch[1].version = 0;
+
+    WY_STRESS_CHECK(ctx, write(fd, batch, sizeof(batch)) == sizeof(params_t), "batch with a bad descriptor");
+    wy_stress_account(WY_CMD_DEFAULT, 0);
+
+    // Unknown commands run the default
+    wy_stress_params(&p, WY_CMD_NUM + 1000, NULL, 0, 0, 0);
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_CMD, &p) == 0, "unknown command status %d", p.status);
+    wy_stress_account(p.cmd, 0);
+
+    // Executed and failed
+    wy_stress_params(&p, WY_CMD_COPY_TO_DEV, ctx->buf, 16, UINT32_MAX - 8, 0);
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_CMD, &p) < 0 && errno == EINVAL, "copy beyond the window");
+    wy_stress_account(p.cmd, p.status);
+
+    wy_stress_params(&p, WY_CMD_MEM_FILL, NULL, 3, 0, 0);
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_CMD, &p) < 0 && errno == EINVAL, "unaligned fill");
+    wy_stress_account(p.cmd, p.status);
+
+    gone = mmap(NULL, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    WY_STRESS_CHECK(ctx, gone != MAP_FAILED, "mmap");
+    munmap(gone, page);
+
+    wy_stress_params(&p, WY_CMD_CRC32C, gone, WY_STRESS_SMALL, 0, 0);
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_CMD, &p) < 0 && errno == EFAULT, "sum of unmapped memory");
+    wy_stress_account(p.cmd, p.status);
+
+    ro = mmap(NULL, page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    WY_STRESS_CHECK(ctx, ro != MAP_FAILED, "mmap");
+
+    wy_stress_params(&p, WY_CMD_COPY_FROM_DEV, ro, WY_STRESS_SMALL, 0, 0);
+
+    if (ioctl(fd, WY_IOC_CMD, &p) == 0 || !p.status)
+    {
+        munmap(ro, page);
+        wy_stress_fail(ctx, __LINE__, "copy to read only memory", "status %d", p.status);
+
+        return false;
+    }
+
+    wy_stress_account(p.cmd, p.status);
+    munmap(ro, page);
+
+    // Flushes without a ring
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_FLUSH, 0) < 0 && errno == ENXIO, "flush ioctl without a ring");
+
+    wy_stress_params(&p, WY_CMD_FLUSH, NULL, 0, 0, 0);
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_CMD, &p) < 0 && errno == ENXIO, "flush command without a ring");
+    wy_stress_account(p.cmd, p.status);
+
+    // Bad ring layouts, and a second ring
+    memset(&setup, 0, sizeof(setup));
+    setup.sq_entries = 3;
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_RING_SETUP, &setup) < 0 && errno == EINVAL, "ring of 3 entries");
+
+    memset(&setup, 0, sizeof(setup));
+    setup.sq_entries = WY_STRESS_RING_ENTRIES;
+    setup.flags      = ~WY_RING_SETUP_SQPOLL;
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_RING_SETUP, &setup) < 0 && errno == EINVAL, "ring with unknown flags");
+
+    memset(&setup, 0, sizeof(setup));
+    setup.sq_entries = WY_STRESS_RING_ENTRIES;
+
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_RING_SETUP, &setup) == 0, "ring setup");
+    WY_STRESS_CHECK(ctx, ioctl(fd, WY_IOC_RING_SETUP, &setup) < 0 && errno == EBUSY, "second ring");
+
+    return true;
+}
+
+// ------------------------------------------------------------
+// Thread and process bodies
+// ------------------------------------------------------------
+
+static bool wy_stress_run(wy_stress_ctx_t *ctx)
+{
+    uint32_t iter;
+    bool     ok = true;
+    int      fd;
+
+    fd = open(wy_stress_dev, O_RDWR);
+
+    WY_STRESS_CHECK(ctx, fd >= 0, "open %s", wy_stress_dev);
+
+    for (iter = 0; ok && iter < wy_stress_iters; iter++)
+    {
+        ok = wy_stress_data(ctx, fd, iter) && wy_stress_shared(ctx, iter);
+    }
+
+    ok = ok && wy_stress_limits(ctx, fd);
+
+    close(fd);
+
+    if (!ok)
+    {
+        return false;
+    }
+
+    // Each ring on a file of its own, released with its mapping
+    fd = open(wy_stress_dev, O_RDWR);
+
+    WY_STRESS_CHECK(ctx, fd >= 0, "open %s", wy_stress_dev);
+
+    ok = wy_stress_ring(ctx, fd, ctx->thread & 1);
+
+    close(fd);
+
+    if (!ok || ctx->thread)
+    {
+        return ok;
+    }
+
+    fd = open(wy_stress_dev, O_RDWR);
+
+    WY_STRESS_CHECK(ctx, fd >= 0, "open %s", wy_stress_dev);
+
+    ok = wy_stress_errors(ctx, fd);
+
+    close(fd);
+
+    return ok;
+}
+
+static void* wy_stress_thread(void *arg)
+{
+    wy_stress_run(arg);
+
+    return NULL;
+}
+
+static int wy_stress_proc(uint32_t proc)
+{
+    wy_stress_ctx_t ctx[wy_stress_threads];
+    pthread_t       tid[wy_stress_threads];
+    uint32_t        idx;
+    int             shared_fd;
+
+    shared_fd = open(wy_stress_dev, O_RDWR);
+
+    if (shared_fd < 0)
+    {
+        perror(wy_stress_dev);
+
+        return 1;
+    }
+
+    for (idx = 0; idx < wy_stress_threads; idx++)
+    {
+        ctx[idx].proc      = proc;
+        ctx[idx].thread    = idx;
+        ctx[idx].shared_fd = shared_fd;
+        ctx[idx].offset    = (proc * wy_stress_threads + idx) * wy_stress_slice;
+        ctx[idx].buf       = aligned_alloc(4096, wy_stress_slice);
+        ctx[idx].chk       = aligned_alloc(4096, wy_stress_slice);
+
+        if (!ctx[idx].buf || !ctx[idx].chk || pthread_create(&tid[idx], NULL, wy_stress_thread, &ctx[idx]))
+        {
+            fprintf(stderr, "FAIL: process %u: cannot start thread %u\n", proc, idx);
+
+            return 1;
+        }
+    }
+
+    for (idx = 0; idx < wy_stress_threads; idx++)
+    {
+        pthread_join(tid[idx], NULL);
+        free(ctx[idx].buf);
+        free(ctx[idx].chk);
+    }
+
+    close(shared_fd);
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Main
+// ------------------------------------------------------------
+
+static void wy_stress_usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-p procs] [-t threads] [-n iterations] [-s slice]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t procs_ok = 0;
+    uint32_t idx;
+    off_t    window;
+    pid_t    pid;
+    int      status;
+    int      opt;
+    int      fd;
+
+    while ((opt = getopt(argc, argv, "d:p:t:n:s:h")) != -1)
+    {
+        switch (opt)
+        {
+        case 'd': wy_stress_dev     = optarg;                      break;
+        case 'p': wy_stress_procs   = strtoul(optarg, NULL, 0);    break;
+        case 't': wy_stress_threads = strtoul(optarg, NULL, 0);    break;
+        case 'n': wy_stress_iters   = strtoul(optarg, NULL, 0);    break;
+        case 's': wy_stress_slice   = strtoul(optarg, NULL, 0);    break;
+        default:
+            wy_stress_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (!wy_stress_procs || !wy_stress_threads || wy_stress_slice < 4096 || wy_stress_slice % 4096)
+    {
+        wy_stress_usage(argv[0]);
+        return 2;
+    }
+
+    // The file size is the end of the memory window
+    fd = open(wy_stress_dev, O_RDWR);
+
+    if (fd < 0)
+    {
+        perror(wy_stress_dev);
+        return 1;
+    }
+
+    window = lseek(fd, 0, SEEK_END) - WY_MEM_BASE;
+    close(fd);
+
+    if (window < (off_t)wy_stress_procs * wy_stress_threads * wy_stress_slice)
+    {
+        fprintf(stderr, "%s: window of %lld bytes is too small for %u x %u slices of %u bytes\n", wy_stress_dev,
+                (long long)window, wy_stress_procs, wy_stress_threads, wy_stress_slice);
+        return 1;
+    }
+
+    wy_stress_tally = mmap(NULL, sizeof(wy_stress_tally_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (wy_stress_tally == MAP_FAILED)
+    {
+        perror("mmap");
+        return 1;
+    }
+
+    for (idx = 0; idx < wy_stress_procs; idx++)
+    {
+        pid = fork();
+
+        if (pid < 0)
+        {
+            perror("fork");
+            break;
+        }
+
+        if (!pid)
+        {
+            _exit(wy_stress_proc(idx));
+        }
+    }
+
+    while (wait(&status) > 0)
+    {
+        procs_ok += WIFEXITED(status) && !WEXITSTATUS(status);
+    }
+
+    if (procs_ok != wy_stress_procs || wy_stress_tally->failures)
+    {
+        fprintf(stderr, "FAIL: %u of %u processes completed, %u checks failed\n", procs_ok, wy_stress_procs,
+                wy_stress_tally->failures);
+        return 1;
+    }
+
+    for (idx = 0; idx < WY_CMD_NUM; idx++)
+    {
+        printf("%-12s %llu %llu\n", wy_stress_names[idx], (unsigned long long)wy_stress_tally->count[idx],
+               (unsigned long long)wy_stress_tally->errors[idx]);
+    }
+
+    return 0;
+}
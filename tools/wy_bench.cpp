@@ -0,0 +1,885 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// Micro-benchmark of the wy_module submission paths.
+//
+// Measures operations per second and latency percentiles for
+// each of:
+//
+//   write  one params_t per write
+//   batch  qd params_t per write
+//   ioctl  one WY_IOC_CMD per command
+//   ring   qd entries per submission of the file's mmap'd rings
+//   uring  qd io_uring writes of one params_t each
+//
+// for every combination of the given payload sizes, thread
+// counts and queue depths, printing the results as JSON. Each
+// thread opens its own file, so max_open must be at least the
+// largest thread count. With --shared, the threads instead all
+// submit through one file, as the threads of a process sharing
+// a descriptor do, to show how submission scales within a file:
+//
+//   wy_bench -S -m write,batch,ioctl -c crc32c -s 64 -t 1,2,4,8,16,32
+//
+// ring is not run shared, a file having only one ring. Latency
+// is per command: from the call
+// for the write and ioctl paths, from the batch's write for
+// batch, and from queueing the entry to reaping its completion
+// for ring and uring. Payloads should be below defer_threshold,
+// so that commands submitted by write and ioctl run inline.
+//
+// With --verify, each combination also checks that every ring
+// and io_uring completion matches exactly one outstanding
+// command, that the driver's command statistics grew by the
+// number of commands issued, that its live object accounting
+// is back to zero once the threads' files are closed, and that
+// data copied to the window reads back intact. This assumes
+// nothing else is using the device, and is intended for long
+// stress runs rather than for measurement.
+// ------------------------------------------------------------
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <getopt.h>
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+#include "../lib/wy_module.hpp"
+
+namespace
+{
+
+// ------------------------------------------------------------
+// Definitions
+// ------------------------------------------------------------
+
+const char* const bench_modes[] = { "write", "batch", "ioctl", "ring", "uring" };
+
+struct options
+{
+    std::string           dev      = "/dev/wy_module";
+    std::string           cmd      = "copy";
+    std::vector<uint32_t> modes    = { 0, 1, 2, 3, 4 };
+    std::vector<uint32_t> sizes    = { 4096 };
+    std::vector<uint32_t> threads  = { 1 };
+    std::vector<uint32_t> qds      = { 32 };
+    double                seconds  = 2.0;
+    bool                  sqpoll   = false;
+    bool                  verify   = false;
+    bool                  shared   = false;
+};
+
+inline uint64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ------------------------------------------------------------
+// Log-linear latency histogram, with 64 buckets per power of
+// 2, so percentiles are within about 1.5% of the true value
+// without keeping every sample
+// ------------------------------------------------------------
+
+class histogram
+{
+public:
+    static constexpr uint32_t sub_bits = 6;
+    static constexpr uint32_t sub      = 1U << sub_bits;
+
+    histogram() : counts_((64 - sub_bits + 1) * sub) {}
+
+    void record(uint64_t ns, uint64_t n = 1)
+    {
+        counts_[index(ns)] += n;
+        total_             += n;
+        sum_               += ns * n;
+        max_                = std::max(max_, ns);
+    }
+
+    void merge(const histogram& other)
+    {
+        for (size_t idx = 0; idx < counts_.size(); idx++)
+        {
+            counts_[idx] += other.counts_[idx];
+        }
+
+        total_ += other.total_;
+        sum_   += other.sum_;
+        max_    = std::max(max_, other.max_);
+    }
+
+    // Smallest recorded value with at least fraction q of samples at or below it
+    uint64_t percentile(double q) const
+    {
+        uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(q * total_ + 0.5));
+        uint64_t seen   = 0;
+
+        for (size_t idx = 0; idx < counts_.size(); idx++)
+        {
+            seen += counts_[idx];
+
+            if (seen >= target)
+            {
+                return std::min(value(idx), max_);
+            }
+        }
+
+        return max_;
+    }
+
+    uint64_t total() const { return total_; }
+    uint64_t max()   const { return max_; }
+    uint64_t mean()  const { return total_ ? sum_ / total_ : 0; }
+
+private:
+    static size_t index(uint64_t v)
+    {
+        if (v < sub)
+        {
+            return v;
+        }
+
+        uint32_t shift = 63 - __builtin_clzll(v) - sub_bits;
+
+        return (shift + 1) * sub + ((v >> shift) - sub);
+    }
+
+    // Upper bound of a bucket's values
+    static uint64_t value(size_t idx)
+    {
+        if (idx < sub)
+        {
+            return idx;
+        }
+
+        uint32_t shift = idx / sub - 1;
+
+        return (((idx % sub) + sub + 1) << shift) - 1;
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t              total_ = 0;
+    uint64_t              sum_   = 0;
+    uint64_t              max_   = 0;
+};
+
+// ------------------------------------------------------------
+// Minimal io_uring instance, set up with the raw system calls
+// so that liburing is not needed. Only what the benchmark uses:
+// queueing writes and reaping their completions
+// ------------------------------------------------------------
+
+class uring
+{
+public:
+    explicit uring(uint32_t entries)
+    {
+        io_uring_params p {};
+
+        fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+
+        if (fd_ < 0)
+        {
+            wy::throw_errno("io_uring_setup");
+        }
+
+        size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+        size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+        {
+            sq_len = cq_len = std::max(sq_len, cq_len);
+        }
+
+        sq_ = map(sq_len, IORING_OFF_SQ_RING);
+        cq_ = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq_ : map(cq_len, IORING_OFF_CQ_RING);
+
+        sqes_     = static_cast<io_uring_sqe*>(map(p.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES).data);
+        sq_tail_  = field(sq_, p.sq_off.tail);
+        sq_mask_  = *field(sq_, p.sq_off.ring_mask);
+        sq_array_ = field(sq_, p.sq_off.array);
+        cq_head_  = field(cq_, p.cq_off.head);
+        cq_tail_  = field(cq_, p.cq_off.tail);
+        cq_mask_  = *field(cq_, p.cq_off.ring_mask);
+        cqes_     = reinterpret_cast<io_uring_cqe*>(static_cast<char*>(cq_.data) + p.cq_off.cqes);
+    }
+
+    uring(const uring&)            = delete;
+    uring& operator=(const uring&) = delete;
+
+    ~uring()
+    {
+        for (auto& m : maps_)
+        {
+            ::munmap(m.data, m.len);
+        }
+
+        ::close(fd_);
+    }
+
+    // Queue a write of len bytes at offset 0 of fd
+    void write(int fd, const void* buf, uint32_t len, uint64_t user_data)
+    {
+        uint32_t      tail = *sq_tail_;
+        uint32_t      idx  = tail & sq_mask_;
+        io_uring_sqe* sqe  = &sqes_[idx];
+
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = IORING_OP_WRITE;
+        sqe->fd        = fd;
+        sqe->addr      = reinterpret_cast<uintptr_t>(buf);
+        sqe->len       = len;
+        sqe->user_data = user_data;
+
+        sq_array_[idx] = idx;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+    }
+
+    // Submit n queued entries and wait for n completions
+    int enter(uint32_t n)
+    {
+        return ::syscall(__NR_io_uring_enter, fd_, n, n, IORING_ENTER_GETEVENTS, nullptr, 0) < 0 ? -errno : 0;
+    }
+
+    // Call f(const io_uring_cqe&) for each available completion, returning the count
+    template <typename F> size_t reap(F&& f)
+    {
+        uint32_t head = *cq_head_;
+        uint32_t tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        size_t   n    = 0;
+
+        for (; head != tail; head++, n++)
+        {
+            f(static_cast<const io_uring_cqe&>(cqes_[head & cq_mask_]));
+        }
+
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+
+        return n;
+    }
+
+private:
+    struct region
+    {
+        void*  data = nullptr;
+        size_t len  = 0;
+    };
+
+    region map(size_t len, off_t offset)
+    {
+        void* data = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+
+        if (data == MAP_FAILED)
+        {
+            wy::throw_errno("io_uring mmap");
+        }
+
+        maps_.push_back({ data, len });
+
+        return maps_.back();
+    }
+
+    static uint32_t* field(const region& r, uint32_t offset)
+    {
+        return reinterpret_cast<uint32_t*>(static_cast<char*>(r.data) + offset);
+    }
+
+    int                 fd_;
+    std::vector<region> maps_;
+    region              sq_;
+    region              cq_;
+    io_uring_sqe*       sqes_;
+    io_uring_cqe*       cqes_;
+    uint32_t*           sq_tail_;
+    uint32_t*           sq_array_;
+    uint32_t*           cq_head_;
+    uint32_t*           cq_tail_;
+    uint32_t            sq_mask_;
+    uint32_t            cq_mask_;
+};
+
+// ------------------------------------------------------------
+// Per thread state and results
+// ------------------------------------------------------------
+
+struct worker
+{
+    histogram   lat;
+    uint64_t    ops    = 0;
+    uint64_t    errors = 0;
+    uint64_t    bad    = 0;   // Completions not matching an outstanding command
+    std::string error;
+};
+
+struct run_state
+{
+    std::atomic<uint32_t> ready { 0 };
+    std::atomic<bool>     go    { false };
+    std::atomic<bool>     stop  { false };
+};
+
+// Build the command under test on a thread's buffer
+params_t make_cmd(const options& opt, const wy::buffer& buf, uint32_t size)
+{
+    if (opt.cmd == "crc32c") return wy::cmd::crc32c(buf.data(), size);
+    if (opt.cmd == "xxh64")  return wy::cmd::xxh64(buf.data(), size);
+    if (opt.cmd == "fill")   return wy::cmd::mem_fill(size);
+    if (opt.cmd == "nop")    return wy::cmd::nop();
+
+    return wy::cmd::copy_to_dev(buf.data(), size, 0);
+}
+
+// ------------------------------------------------------------
+// Benchmark loops, one per mode. Each runs until stop is set
+// ------------------------------------------------------------
+
+void run_write(const wy::device& dev, const params_t& cmd, uint32_t, run_state& st, worker& w)
+{
+    while (!st.stop.load(std::memory_order_relaxed))
+    {
+        uint64_t t0     = now_ns();
+        int      status = dev.write(cmd);
+
+        w.lat.record(now_ns() - t0);
+        w.ops++;
+        w.errors += status != 0;
+    }
+}
+
+void run_batch(const wy::device& dev, const params_t& cmd, uint32_t qd, run_state& st, worker& w)
+{
+    std::vector<params_t> batch(qd, cmd);
+
+    while (!st.stop.load(std::memory_order_relaxed))
+    {
+        uint64_t t0   = now_ns();
+        ssize_t  done = dev.write(batch.data(), qd);
+        uint64_t t1   = now_ns();
+
+        w.lat.record(t1 - t0, qd);
+        w.ops    += qd;
+        w.errors += done < 0 ? qd : qd - done;
+    }
+}
+
+void run_ioctl(const wy::device& dev, const params_t& cmd, uint32_t, run_state& st, worker& w)
+{
+    while (!st.stop.load(std::memory_order_relaxed))
+    {
+        params_t p      = cmd;
+        uint64_t t0     = now_ns();
+        int      status = dev.submit(p);
+
+        w.lat.record(now_ns() - t0);
+        w.ops++;
+        w.errors += status != 0;
+    }
+}
+
+void run_ring(const wy::device& dev, const params_t& cmd, uint32_t qd, run_state& st, worker& w, bool sqpoll)
+{
+    wy::ring              ring(dev, qd, 0, sqpoll ? WY_RING_SETUP_SQPOLL : 0);
+    std::vector<uint64_t> start(qd);
+
+    while (!st.stop.load(std::memory_order_relaxed))
+    {
+        uint32_t done = 0;
+
+        for (uint32_t idx = 0; idx < qd; idx++)
+        {
+            start[idx] = now_ns();
+            ring.push(wy::cmd::tagged(cmd, idx + 1));
+        }
+
+        if (ring.submit())
+        {
+            throw std::runtime_error("ring flush failed");
+        }
+
+        // The CQ holds twice the SQ, so the consumer never stops for space
+        while (done < qd)
+        {
+            done += ring.reap([&](const params_t& p) {
+                // Tags are 1 to qd, and each start is cleared once completed
+                if (p.tag - 1 >= qd || !start[p.tag - 1])
+                {
+                    w.bad++;
+                    return;
+                }
+
+                w.lat.record(now_ns() - start[p.tag - 1]);
+                w.errors        += p.status != 0;
+                start[p.tag - 1] = 0;
+            });
+        }
+
+        w.ops += qd;
+    }
+}
+
+void run_uring(const wy::device& dev, const params_t& cmd, uint32_t qd, run_state& st, worker& w)
+{
+    uring                 ring(qd);
+    std::vector<params_t> batch(qd, cmd);
+    std::vector<uint64_t> start(qd);
+
+    while (!st.stop.load(std::memory_order_relaxed))
+    {
+        uint32_t done = 0;
+
+        for (uint32_t idx = 0; idx < qd; idx++)
+        {
+            start[idx] = now_ns();
+            ring.write(dev.fd(), &batch[idx], sizeof(params_t), idx);
+        }
+
+        if (int status = ring.enter(qd))
+        {
+            errno = -status;
+            wy::throw_errno("io_uring_enter");
+        }
+
+        while (done < qd)
+        {
+            done += ring.reap([&](const io_uring_cqe& cqe) {
+                if (cqe.user_data >= qd || !start[cqe.user_data])
+                {
+                    w.bad++;
+                    return;
+                }
+
+                w.lat.record(now_ns() - start[cqe.user_data]);
+                w.errors              += cqe.res != sizeof(params_t);
+                start[cqe.user_data]   = 0;
+            });
+        }
+
+        w.ops += qd;
+    }
+}
+
+// ------------------------------------------------------------
+// Verification against the driver's sysfs counters
+// ------------------------------------------------------------
+
+std::string read_file(const std::string& path)
+{
+    std::ifstream     in(path);
+    std::stringstream ss;
+
+    ss << in.rdbuf();
+
+    return ss.str();
+}
+
+std::string sysfs_dir(const options& opt)
+{
+    return "/sys/class/chardrv/" + opt.dev.substr(opt.dev.find_last_of('/') + 1) + "/";
+}
+
+// Total commands executed, from the cmd_stats lines of name, count and errors
+uint64_t cmds_executed(const options& opt)
+{
+    std::istringstream in(read_file(sysfs_dir(opt) + "cmd_stats"));
+    std::string        name;
+    uint64_t           count, errors, total = 0;
+
+    while (in >> name >> count >> errors)
+    {
+        total += count;
+    }
+
+    return total;
+}
+
+// Whether every live object count is zero, with the counts as a JSON object
+bool live_objects(const options& opt, std::string& json)
+{
+    std::istringstream in(read_file(sysfs_dir(opt) + "accounting"));
+    std::string        name;
+    long               value;
+    bool               zero = true;
+
+    json = "{";
+
+    while (in >> name >> value)
+    {
+        json += (json.size() > 1 ? ", \"" : "\"") + name + "\": " + std::to_string(value);
+        zero  = zero && !value;
+    }
+
+    json += "}";
+
+    return zero && json.size() > 2;
+}
+
+// Copy a pattern to the window and back, comparing the result
+bool data_round_trip(const options& opt, uint32_t size)
+{
+    try
+    {
+        uint32_t   window = std::stoul("0" + read_file("/sys/module/wy_module/parameters/mem_window_size"));
+        uint32_t   len    = std::min(std::max<uint32_t>(size, 1), window ? window : 65536);
+        wy::device dev(opt.dev.c_str());
+        wy::buffer src(len);
+        wy::buffer dst(len);
+
+        for (uint32_t idx = 0; idx < len; idx++)
+        {
+            src.as<uint8_t>()[idx] = static_cast<uint8_t>((idx * 2654435761U) >> 24);
+        }
+
+        params_t to   = wy::cmd::copy_to_dev(src.data(), len, 0);
+        params_t from = wy::cmd::copy_from_dev(dst.data(), len, 0);
+
+        return !dev.submit(to) && !dev.submit(from) && !std::memcmp(src.data(), dst.data(), len);
+    }
+    catch (const std::exception&)
+    {
+        return false;
+    }
+}
+
+// ------------------------------------------------------------
+// Run one mode with one combination of parameters on the given
+// number of threads, and print its JSON result object
+// ------------------------------------------------------------
+
+void bench(const options& opt, uint32_t mode, uint32_t size, uint32_t nthreads, uint32_t qd, bool first)
+{
+    std::vector<worker>       workers(nthreads);
+    std::vector<std::thread>  threads;
+    run_state                 st;
+    std::optional<wy::device> shared;
+    uint64_t                  cmds_before = opt.verify ? cmds_executed(opt) : 0;
+
+    std::printf("%s    {\"mode\": \"%s\", \"cmd\": \"%s\", \"size\": %" PRIu32 ", \"threads\": %" PRIu32
+                ", \"qd\": %" PRIu32 ", \"shared\": %s,\n",
+                first ? "" : ",\n", bench_modes[mode], opt.cmd.c_str(), size, nthreads, qd,
+                opt.shared ? "true" : "false");
+
+    try
+    {
+        if (opt.shared && mode == 3)
+        {
+            throw std::invalid_argument("ring needs a file per thread");
+        }
+
+        if (opt.shared)
+        {
+            shared.emplace(opt.dev.c_str());
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::printf("     \"error\": \"%s\"}", e.what());
+        return;
+    }
+
+    for (uint32_t t = 0; t < nthreads; t++)
+    {
+        threads.emplace_back([&, t] {
+            worker& w = workers[t];
+
+            try
+            {
+                std::optional<wy::device> own;
+                const wy::device&         dev = shared ? *shared : own.emplace(opt.dev.c_str());
+                wy::buffer                buf(std::max<uint32_t>(size, 1));
+                params_t                  cmd = make_cmd(opt, buf, size);
+
+                st.ready++;
+
+                while (!st.go.load())
+                {
+                    std::this_thread::yield();
+                }
+
+                switch (mode)
+                {
+                case 0:  run_write(dev, cmd, qd, st, w);             break;
+                case 1:  run_batch(dev, cmd, qd, st, w);             break;
+                case 2:  run_ioctl(dev, cmd, qd, st, w);             break;
+                case 3:  run_ring(dev, cmd, qd, st, w, opt.sqpoll);  break;
+                default: run_uring(dev, cmd, qd, st, w);             break;
+                }
+            }
+            catch (const std::exception& e)
+            {
+                w.error = e.what();
+
+                if (!st.go.load())
+                {
+                    st.ready++;
+                }
+            }
+        });
+    }
+
+    while (st.ready.load() < nthreads)
+    {
+        std::this_thread::yield();
+    }
+
+    uint64_t t0 = now_ns();
+
+    st.go = true;
+    std::this_thread::sleep_for(std::chrono::duration<double>(opt.seconds));
+    st.stop = true;
+
+    for (auto& th : threads)
+    {
+        th.join();
+    }
+
+    shared.reset();
+
+    double      secs = (now_ns() - t0) / 1e9;
+    histogram   lat;
+    uint64_t    ops    = 0;
+    uint64_t    errors = 0;
+    uint64_t    bad    = 0;
+    std::string error;
+
+    for (auto& w : workers)
+    {
+        lat.merge(w.lat);
+        ops    += w.ops;
+        errors += w.errors;
+        bad    += w.bad;
+
+        if (error.empty())
+        {
+            error = w.error;
+        }
+    }
+
+    if (!error.empty())
+    {
+        std::printf("     \"error\": \"%s\"}", error.c_str());
+        return;
+    }
+
+    std::printf("     \"seconds\": %.3f, \"ops\": %" PRIu64 ", \"errors\": %" PRIu64
+                ", \"ops_per_sec\": %.0f, \"mb_per_sec\": %.1f,\n",
+                secs, ops, errors, ops / secs, (ops - errors) * double(size) / secs / 1e6);
+    std::printf("     \"lat_ns\": {\"mean\": %" PRIu64 ", \"p50\": %" PRIu64 ", \"p99\": %" PRIu64
+                ", \"p999\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+                lat.mean(), lat.percentile(0.5), lat.percentile(0.99), lat.percentile(0.999), lat.max());
+
+    if (opt.verify)
+    {
+        // The threads' files are closed, so all their commands have completed
+        uint64_t    executed = cmds_executed(opt) - cmds_before;
+        std::string live;
+        bool        idle     = live_objects(opt, live);
+        bool        data     = data_round_trip(opt, size);
+
+        std::printf(",\n     \"verify\": {\"ok\": %s, \"executed\": %" PRIu64 ", \"bad_completions\": %" PRIu64
+                    ", \"data_ok\": %s, \"live\": %s}",
+                    executed == ops && !bad && idle && data ? "true" : "false",
+                    executed, bad, data ? "true" : "false", live.c_str());
+    }
+
+    std::printf("}");
+}
+
+// ------------------------------------------------------------
+// Command line handling
+// ------------------------------------------------------------
+
+std::vector<uint32_t> parse_list(const char* arg)
+{
+    std::vector<uint32_t> list;
+    std::string           s(arg);
+    size_t                pos = 0;
+
+    while (pos <= s.size())
+    {
+        size_t end = s.find(',', pos);
+
+        if (end == std::string::npos)
+        {
+            end = s.size();
+        }
+
+        list.push_back(static_cast<uint32_t>(std::stoul(s.substr(pos, end - pos), nullptr, 0)));
+        pos = end + 1;
+    }
+
+    return list;
+}
+
+std::vector<uint32_t> parse_modes(const char* arg)
+{
+    std::vector<uint32_t> list;
+    std::string           s(arg);
+    size_t                pos = 0;
+
+    while (pos <= s.size())
+    {
+        size_t      end  = std::min(s.find(',', pos), s.size());
+        std::string name = s.substr(pos, end - pos);
+        auto        it   = std::find(std::begin(bench_modes), std::end(bench_modes), name);
+
+        if (it == std::end(bench_modes))
+        {
+            throw std::invalid_argument("unknown mode " + name);
+        }
+
+        list.push_back(static_cast<uint32_t>(it - std::begin(bench_modes)));
+        pos = end + 1;
+    }
+
+    return list;
+}
+
+void usage(const char* prog)
+{
+    std::fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  -d, --dev PATH       device file (default /dev/wy_module)\n"
+        "  -m, --mode LIST      modes from write,batch,ioctl,ring,uring (default all)\n"
+        "  -c, --cmd NAME       copy, crc32c, xxh64, fill or nop (default copy)\n"
+        "  -s, --size LIST      payload sizes in bytes (default 4096)\n"
+        "  -t, --threads LIST   thread counts, each with its own file (default 1)\n"
+        "  -S, --shared         threads share one file instead (not for ring)\n"
+        "  -q, --qd LIST        queue depths, powers of 2 for ring (default 32)\n"
+        "  -T, --time SECS      run time of each combination (default 2)\n"
+        "  -p, --sqpoll         use an SQ poll thread for ring\n"
+        "  -v, --verify         check completions and driver accounting\n"
+        "Lists are comma separated, and every combination is run. Results are\n"
+        "printed as JSON. nop logs each command, so is mainly for the paths' cost\n",
+        prog);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    static const option longopts[] =
+    {
+        { "dev",     required_argument, nullptr, 'd' },
+        { "mode",    required_argument, nullptr, 'm' },
+        { "cmd",     required_argument, nullptr, 'c' },
+        { "size",    required_argument, nullptr, 's' },
+        { "threads", required_argument, nullptr, 't' },
+        { "qd",      required_argument, nullptr, 'q' },
+        { "time",    required_argument, nullptr, 'T' },
+        { "sqpoll",  no_argument,       nullptr, 'p' },
+        { "verify",  no_argument,       nullptr, 'v' },
+        { "shared",  no_argument,       nullptr, 'S' },
+        { "help",    no_argument,       nullptr, 'h' },
+        { nullptr,   0,                 nullptr, 0   }
+    };
+
+    options opt;
+    int     c;
+
+    try
+    {
+        while ((c = getopt_long(argc, argv, "d:m:c:s:t:q:T:pvSh", longopts, nullptr)) != -1)
+        {
+            switch (c)
+            {
+            case 'd': opt.dev     = optarg;              break;
+            case 'm': opt.modes   = parse_modes(optarg); break;
+            case 'c': opt.cmd     = optarg;              break;
+            case 's': opt.sizes   = parse_list(optarg);  break;
+            case 't': opt.threads = parse_list(optarg);  break;
+            case 'q': opt.qds     = parse_list(optarg);  break;
+            case 'T': opt.seconds = std::stod(optarg);   break;
+            case 'p': opt.sqpoll  = true;                break;
+            case 'v': opt.verify  = true;                break;
+            case 'S': opt.shared  = true;                break;
+            default:  usage(argv[0]);                    return c == 'h' ? 0 : 1;
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::fprintf(stderr, "%s: bad argument: %s\n", argv[0], e.what());
+        return 1;
+    }
+
+    for (auto n : opt.threads)
+    {
+        if (!n)
+        {
+            std::fprintf(stderr, "%s: thread counts must be at least 1\n", argv[0]);
+            return 1;
+        }
+    }
+
+    for (auto qd : opt.qds)
+    {
+        if (!qd || (qd & (qd - 1)))
+        {
+            std::fprintf(stderr, "%s: queue depths must be powers of 2\n", argv[0]);
+            return 1;
+        }
+    }
+
+    bool first = true;
+
+    std::printf("{\"device\": \"%s\", \"results\": [\n", opt.dev.c_str());
+
+    for (auto mode : opt.modes)
+    {
+        for (auto size : opt.sizes)
+        {
+            for (auto nthreads : opt.threads)
+            {
+                for (auto qd : opt.qds)
+                {
+                    // Queue depth only applies to the batched modes
+                    if ((mode == 0 || mode == 2) && qd != opt.qds.front())
+                    {
+                        continue;
+                    }
+
+                    bench(opt, mode, size, nthreads, qd, first);
+                    first = false;
+                    std::fflush(stdout);
+                }
+            }
+        }
+    }
+
+    std::printf("\n]}\n");
+
+    return 0;
+}
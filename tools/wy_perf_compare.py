@@ -0,0 +1,267 @@
+#!/usr/bin/env python3
+#=============================================================
+#
+# Copyright (c) 2023 Simon Southwell. All rights reserved.
+#
+# Date: 17th September 2023
+#
+# This file is part of the kernel module exmaple.
+#
+# The code is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This code is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this code. If not, see <http://www.gnu.org/licenses/>.
+#
+#=============================================================
+
+"""Compare wy_module performance between two git revisions.
+
+Builds the module at each revision in a temporary worktree, and wy_bench
+once, from the test revision or with --bench-working-tree from the working
+tree, so that both modules are measured by the same benchmark and older
+revisions without one can be compared. The benchmark's ABI must suit both
+modules. It then alternately loads each module and runs the benchmark
+under taskset, so that drift over the run affects both revisions alike. Every result of
+the sweep is repeated --runs times per revision, and the throughput and
+p99 latency deltas are reported with a Welch's t-test p-value. The CPUs
+to pin to must be given, as unpinned runs migrate between CPUs and
+frequency domains and are too noisy to compare. Needs root, for insmod
+and rmmod, and the kernel build tree. Uses only the Python standard
+library.
+
+    tools/wy_perf_compare.py HEAD~1 HEAD --runs 5 --cpus 2-5 -- -m write,ring -t 1,4
+"""
+
+import argparse
+import json
+import math
+import os
+import shutil
+import statistics
+import subprocess
+import sys
+import tempfile
+
+MODULE = "wy_module"
+
+# ------------------------------------------------------------
+# Statistics
+# ------------------------------------------------------------
+
+def betacf(a, b, x):
+    """Continued fraction for the regularised incomplete beta function."""
+    tiny = 1e-300
+    c, d = 1.0, 1.0 - (a + b) * x / (a + 1.0)
+    d = 1.0 / (d if abs(d) > tiny else tiny)
+    h = d
+
+    for m in range(1, 300):
+        m2 = 2 * m
+
+        for num in (m * (b - m) * x / ((a + m2 - 1.0) * (a + m2)),
+                    -(a + m) * (a + b + m) * x / ((a + m2) * (a + m2 + 1.0))):
+            d = 1.0 + num * d
+            d = 1.0 / (d if abs(d) > tiny else tiny)
+            c = 1.0 + num / c
+            c = c if abs(c) > tiny else tiny
+            h *= d * c
+
+        if abs(d * c - 1.0) < 1e-12:
+            break
+
+    return h
+
+
+def betainc(a, b, x):
+    """Regularised incomplete beta function I_x(a, b)."""
+    if x <= 0.0:
+        return 0.0
+    if x >= 1.0:
+        return 1.0
+
+    front = math.exp(math.lgamma(a + b) - math.lgamma(a) - math.lgamma(b) +
+                     a * math.log(x) + b * math.log(1.0 - x))
+
+    if x < (a + 1.0) / (a + b + 2.0):
+        return front * betacf(a, b, x) / a
+
+    return 1.0 - front * betacf(b, a, 1.0 - x) / b
+
+
+def welch_p(xs, ys):
+    """Two sided p-value of Welch's t-test that xs and ys have equal means."""
+    if len(xs) < 2 or len(ys) < 2:
+        return float("nan")
+
+    vx = statistics.variance(xs) / len(xs)
+    vy = statistics.variance(ys) / len(ys)
+
+    if vx + vy == 0.0:
+        return 1.0 if statistics.mean(xs) == statistics.mean(ys) else 0.0
+
+    t  = (statistics.mean(xs) - statistics.mean(ys)) / math.sqrt(vx + vy)
+    df = (vx + vy) ** 2 / (vx ** 2 / (len(xs) - 1) + vy ** 2 / (len(ys) - 1))
+
+    return betainc(df / 2.0, 0.5, df / (df + t * t))
+
+# ------------------------------------------------------------
+# Building and running a revision
+# ------------------------------------------------------------
+
+def run(cmd, **kw):
+    print("+ " + " ".join(cmd), file=sys.stderr)
+    return subprocess.run(cmd, check=True, **kw)
+
+
+def checkout(repo, rev, tree):
+    """Check rev out into a new worktree."""
+    run(["git", "-C", repo, "worktree", "add", "--detach", tree, rev], stdout=subprocess.DEVNULL)
+
+
+def build(tree):
+    """Build a tree's module."""
+    run(["make", "-C", tree], stdout=subprocess.DEVNULL)
+
+
+def build_bench(tree):
+    """Build a tree's benchmark, returning its path."""
+    run(["make", "-C", os.path.join(tree, "tools"), "wy_bench"], stdout=subprocess.DEVNULL)
+
+    return os.path.join(tree, "tools", "wy_bench")
+
+
+def module_loaded():
+    with open("/proc/modules") as f:
+        return any(line.split()[0] == MODULE for line in f)
+
+
+def load(tree, params):
+    if module_loaded():
+        run(["rmmod", MODULE])
+
+    run(["insmod", os.path.join(tree, MODULE + ".ko")] + params)
+
+
+def bench(wy_bench, rev, cpus, bench_args):
+    """Run the benchmark against rev's module, returning its results keyed by combination."""
+    cmd = ["taskset", "-c", cpus, wy_bench] + bench_args
+
+    out = run(cmd, stdout=subprocess.PIPE, text=True).stdout
+    res = {}
+
+    for r in json.loads(out)["results"]:
+        if "error" in r:
+            raise RuntimeError("%s: %s" % (rev, r["error"]))
+
+        key = (r["mode"], r["cmd"], r["size"], r["threads"], r["qd"])
+        res[key] = (r["ops_per_sec"], r["lat_ns"]["p99"])
+
+    return res
+
+# ------------------------------------------------------------
+# Report
+# ------------------------------------------------------------
+
+def report(samples, revs, alpha):
+    """Compare the samples of the two revisions, indexed as revs."""
+    base, test = revs
+    rows       = []
+
+    print("%-28s %-10s %14s %14s %8s %8s" % ("mode/cmd/size/threads/qd", "metric", base[:14], test[:14], "delta", "p"))
+
+    for key in sorted(samples[0]):
+        for idx, metric in enumerate(("ops/s", "p99 ns")):
+            xs = [s[idx] for s in samples[0][key]]
+            ys = [s[idx] for s in samples[1].get(key, [])]
+
+            if not ys:
+                continue
+
+            mx, my = statistics.mean(xs), statistics.mean(ys)
+            delta  = (my - mx) / mx * 100.0 if mx else float("nan")
+            p      = welch_p(xs, ys)
+            flag   = "*" if p < alpha else ""
+
+            print("%-28s %-10s %14.0f %14.0f %+7.1f%% %8.3f %s" %
+                  ("/".join(str(k) for k in key), metric, mx, my, delta, p, flag))
+
+            rows.append({"mode": key[0], "cmd": key[1], "size": key[2], "threads": key[3], "qd": key[4],
+                         "metric": metric, "base": mx, "test": my, "delta_pct": delta, "p": p,
+                         "significant": p < alpha})
+
+    print("* p < %g" % alpha)
+
+    return rows
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.splitlines()[0],
+                                 epilog="Arguments after -- are passed to wy_bench.")
+    ap.add_argument("base", help="baseline revision")
+    ap.add_argument("test", help="revision to compare against the baseline")
+    ap.add_argument("--runs", type=int, default=5, help="benchmark runs per revision (default 5)")
+    ap.add_argument("--cpus", required=True, help="CPU list to pin the benchmark to with taskset, e.g. 2-5")
+    ap.add_argument("--params", default="max_open=64", help="module parameters (default max_open=64)")
+    ap.add_argument("--alpha", type=float, default=0.05, help="significance level (default 0.05)")
+    ap.add_argument("--json", help="also write the comparison to this file")
+    ap.add_argument("--bench-working-tree", action="store_true",
+                    help="build wy_bench from the working tree rather than the test revision")
+    ap.add_argument("--keep", action="store_true", help="keep the worktrees")
+    ap.add_argument("bench_args", nargs="*", help=argparse.SUPPRESS)
+    args = ap.parse_args()
+
+    if not args.cpus.strip():
+        ap.error("--cpus must name at least one CPU")
+
+    repo    = subprocess.run(["git", "rev-parse", "--show-toplevel"], check=True,
+                             stdout=subprocess.PIPE, text=True).stdout.strip()
+    workdir = tempfile.mkdtemp(prefix="wy_perf_")
+    revs    = (args.base, args.test)
+    trees   = []
+    samples = ({}, {})
+
+    try:
+        # Worktrees are named by position as well as revision, so that the same
+        # revision twice, or names differing only in '/' and '_', do not collide
+        for idx, rev in enumerate(revs):
+            tree = os.path.join(workdir, "%d_%s" % (idx, rev.replace("/", "_")))
+
+            checkout(repo, rev, tree)
+            trees.append(tree)
+            build(tree)
+
+        wy_bench = build_bench(repo if args.bench_working_tree else trees[1])
+
+        for _ in range(args.runs):
+            for idx, rev in enumerate(revs):
+                load(trees[idx], args.params.split())
+
+                for key, value in bench(wy_bench, rev, args.cpus, args.bench_args).items():
+                    samples[idx].setdefault(key, []).append(value)
+
+        rows = report(samples, revs, args.alpha)
+
+        if args.json:
+            with open(args.json, "w") as f:
+                json.dump({"base": args.base, "test": args.test, "runs": args.runs, "results": rows}, f, indent=2)
+    finally:
+        if module_loaded():
+            subprocess.run(["rmmod", MODULE])
+
+        if not args.keep:
+            for tree in trees:
+                subprocess.run(["git", "-C", repo, "worktree", "remove", "--force", tree])
+
+            shutil.rmtree(workdir, ignore_errors=True)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,173 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// Definitions shared between the wy_module driver and user
+// space programs using it
+// ------------------------------------------------------------
+
+#ifndef _WY_MODULE_H_
+#define _WY_MODULE_H_
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+// ------------------------------------------------------------
+// Definitions
+// ------------------------------------------------------------
+
+// Version of the params_t layout. params.version must be set to this value
+#define WY_ABI_VERSION              1
+
+// Command values for params.cmd. Unknown values run WY_CMD_DEFAULT
+#define WY_CMD_DEFAULT              0          // Default operation: logs and succeeds
+#define WY_CMD_STREAM_START         1          // Start streaming to reads of this file; params.len is bytes produced per period
+#define WY_CMD_STREAM_STOP          2          // Stop this file's producer. Remaining data can still be read
+#define WY_CMD_MEM_FILL             3          // Fill params.len bytes of the memory window with a word pattern
+#define WY_CMD_SET_QDEPTH           4          // Set this file's queue depth to params.len (untagged, when idle)
+#define WY_CMD_CRC32C               5          // CRC32C of params.len bytes into params.result, seeded by params.seed
+#define WY_CMD_XXH64                6          // xxHash64 of params.len bytes into params.result, seeded by params.seed
+#define WY_CMD_COMPRESS             7          // Compress params.len bytes at vaddr into the window at params.offset
+#define WY_CMD_DECOMPRESS           8          // Decompress the window at params.offset into params.len bytes at vaddr
+#define WY_CMD_COPY_TO_DEV          9          // Copy params.len bytes from vaddr to the window at params.offset
+#define WY_CMD_COPY_FROM_DEV        10         // Copy params.len bytes from the window at params.offset to vaddr
+#define WY_CMD_FLUSH                11         // Wake the file's ring consumer to process its submission queue
+#define WY_CMD_NUM                  12         // Number of command values
+
+// Compression algorithms for params.algo
+#define WY_ALGO_LZ4                 0
+#define WY_ALGO_ZSTD                1
+
+// Magic number of a compressed frame header in the memory window
+#define WY_COMP_MAGIC               0x5a435957 // "WYCZ"
+
+// File offset of the device memory window. Offsets below this address the
+// command interface, so plain write/read of params_t at offset 0 is unaffected
+#define WY_MEM_BASE                 0x1000
+
+// mmap offsets of the register page and of a file's rings
+#define WY_REGS_OFFSET              0
+#define WY_RING_OFFSET              0x10000000
+
+// Ring flags, set by the driver in wy_ring_hdr_t.flags
+#define WY_RING_NEED_WAKEUP         (1U << 0)  // Consumer idle: flush to have new entries processed
+
+// Flags for WY_IOC_FLUSH
+#define WY_FLUSH_WAIT               (1U << 0)  // Return once the entries submitted so far are consumed
+
+// Flags for wy_ring_setup_t.flags
+#define WY_RING_SETUP_SQPOLL        (1U << 0)  // Consume the SQ with a polling kernel thread
+
+// ------------------------------------------------------------
+// Structures
+// ------------------------------------------------------------
+
+// Command parameters, written to the device and returned by read and in
+// completions. The layout uses only fixed width types with explicit padding and
+// is one 64 byte cache line, so it is the same for 32 and 64 bit user space and
+// descriptors in an array or ring never share a line. Writes are one or more
+// whole descriptors.
+typedef struct wy_params {
+    __u32     cmd;
+    __u32     version;    // WY_ABI_VERSION
+    __u64     vaddr;      // User buffer address, cast through uintptr_t
+    __u32     len;
+    __s32     status;     // Returned command status (0 or negative errno)
+    __u64     tag;        // User tag, echoed in the completion. Non-zero tags complete through read
+    __u32     offset;     // Memory window offset, for commands on the window when vaddr is 0
+    __u32     seed;       // Initial CRC or hash seed, so checksums can be chained over buffers
+    __u64     result;     // Returned command result
+    __u32     algo;       // WY_ALGO_xxx algorithm, for the compression commands
+    __u32     rsvd[3];    // Must be zero
+} params_t;
+
+// Header of a compressed frame in the memory window, so that a frame can be
+// decompressed knowing only its offset. The compressed data follows it.
+typedef struct {
+    __u32     magic;      // WY_COMP_MAGIC
+    __u32     algo;       // WY_ALGO_xxx algorithm of the data
+    __u32     rawlen;     // Uncompressed length in bytes
+    __u32     clen;       // Compressed length in bytes, excluding the header
+} wy_comp_hdr_t;
+
+// Layout of the device register page, as mapped into user space. A command is
+// issued by writing cmd and len and then writing a new value to doorbell. The
+// device writes status and then copies the doorbell value to done on completion.
+typedef struct {
+    __u32     doorbell;
+    __u32     done;
+    __s32     status;
+    __u32     cmd;
+    __u32     len;
+} wy_regs_t;
+
+// Header of a file's ring mapping, followed by the submission queue (SQ) and
+// completion queue (CQ) entries at the offsets returned by WY_IOC_RING_SETUP.
+// User space fills SQ entries and advances sq_tail, and reads CQ entries and
+// advances cq_head. The driver advances sq_head and cq_tail. Indices run freely
+// and are masked by the entry counts. The SQ and CQ halves are on separate
+// cache lines.
+//
+// To submit without a system call, update sq_tail, make a full memory barrier,
+// and then only if flags has WY_RING_NEED_WAKEUP set, flush with WY_IOC_FLUSH
+// or a WY_CMD_FLUSH write. The consumer also stops while the CQ is full, with
+// WY_RING_NEED_WAKEUP set, and is restarted by a flush after reaping. With
+// WY_RING_SETUP_SQPOLL, a kernel thread polls the SQ and only sets the flag
+// once it has been idle for sq_idle_ms.
+//
+// Entries run in the address space of the process that set up the rings. Only
+// that process may map and flush them, and a forked child does not inherit the
+// mapping. Others get EPERM.
+typedef struct {
+    __u32     sq_head;
+    __u32     sq_tail;
+    __u32     flags;      // WY_RING_xxx
+    __u32     rsvd0[13];
+    __u32     cq_head;
+    __u32     cq_tail;
+    __u32     rsvd1[14];
+} wy_ring_hdr_t;
+
+// WY_IOC_RING_SETUP argument
+typedef struct {
+    __u32     sq_entries; // In: SQ entries, a power of 2
+    __u32     cq_entries; // In/out: CQ entries, a power of 2 (0 for twice sq_entries)
+    __u32     flags;      // In: WY_RING_SETUP_xxx
+    __s32     sq_cpu;     // In: CPU to bind the SQ poll thread to, or -1 for any
+    __u32     sq_idle_ms; // In: SQ poll thread idle time before sleeping (0 for the default)
+    __u32     sq_off;     // Out: offset of the SQ entries in the mapping
+    __u32     cq_off;     // Out: offset of the CQ entries in the mapping
+    __u32     size;       // Out: size to mmap at WY_RING_OFFSET
+} wy_ring_setup_t;
+
+// ------------------------------------------------------------
+// ioctl commands
+// ------------------------------------------------------------
+
+#define WY_IOC_MAGIC                'W'
+
+#define WY_IOC_RING_SETUP           _IOWR(WY_IOC_MAGIC, 1, wy_ring_setup_t) // Create this file's rings
+#define WY_IOC_FLUSH                _IO(WY_IOC_MAGIC, 2)                    // Wake the ring consumer. Arg is WY_FLUSH_xxx
+#define WY_IOC_CMD                  _IOWR(WY_IOC_MAGIC, 3, params_t)        // Submit params and return them updated
+
+#endif
@@ -0,0 +1,234 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// Core command decoding and queue accounting of the wy_module
+// driver. These depend on no device, file or task state, so
+// they can be exercised on their own, such as from a KUnit
+// suite including this header, as well as by the driver. The
+// user space emulation in emu/ builds them against shims of
+// the kernel headers used here.
+// ------------------------------------------------------------
+
+#ifndef _WY_CORE_H_
+#define _WY_CORE_H_
+
+#include <linux/types.h>
+#include <linux/errno.h>
+#include <linux/string.h>
+#include <linux/log2.h>
+#include <linux/atomic.h>
+#include <linux/uaccess.h>
+
+#include "uapi/wy_module.h"
+
+// ------------------------------------------------------------
+// Definitions
+// ------------------------------------------------------------
+
+// Maximum per-file queue depth
+#define WY_MAX_QDEPTH               4096
+
+// The descriptor layout is part of the ABI
+static_assert(sizeof(params_t) == 64, "params_t is not one cache line");
+
+// Per command statistics, indexed as the dispatch table
+typedef struct {
+    atomic64_t    count;
+    atomic64_t    errors;
+} wy_cmd_stats_t;
+
+// A file's submission function, called for each descriptor written
+struct wy_file;
+
+typedef int (*wy_core_submit_t)(struct wy_file *, params_t *);
+
+// ------------------------------------------------------------
+// Command decoding
+// ------------------------------------------------------------
+
+// Dispatch table index of a command. Unknown commands run the default
+static inline uint32_t wy_core_cmd_index(uint32_t cmd)
+{
+    return cmd < WY_CMD_NUM ? cmd : WY_CMD_DEFAULT;
+}
+
+// Check the parts of params_t not specific to a command. As the layout is
+// fixed, this together with the size of the transfer is all the validation
+// user space descriptors need
+static inline bool wy_core_params_ok(const params_t *p)
+{
+    return p->version == WY_ABI_VERSION && !memchr_inv(p->rsvd, 0, sizeof(p->rsvd));
+}
+
+// Number of descriptors in a write of len bytes, or -EINVAL if it is not
+// one or more whole descriptors
+static inline ssize_t wy_core_batch_count(size_t len)
+{
+    if (!len || len % sizeof(params_t))
+    {
+        return -EINVAL;
+    }
+
+    return len / sizeof(params_t);
+}
+
+// Result of a batch write that submitted done descriptors and then stopped
+// with status. A failure is reported only if nothing was submitted
+static inline ssize_t wy_core_batch_result(size_t done, int status)
+{
+    if (status && !done)
+    {
+        return status;
+    }
+
+    return done * sizeof(params_t);
+}
+
+// Submit a write of len bytes at buffer, copying each descriptor to p and
+// submitting them in order, stopping at the first failure. Returns as the
+// write does, with *submitted set if p holds the last descriptor passed to
+// submit. p is the caller's, so concurrent writes need no serialising here
+static inline ssize_t wy_core_write(struct wy_file *ctx, params_t *p, const char *buffer, size_t len,
+                                    wy_core_submit_t submit, bool *submitted)
+{
+    ssize_t count  = wy_core_batch_count(len);
+    ssize_t done   = 0;
+    int     status = 0;
+
+    *submitted = false;
+
+    if (count < 0)
+    {
+        return count;
+    }
+
+    for (; done < count; done++)
+    {
+        if (copy_from_user(p, buffer + done * sizeof(params_t), sizeof(params_t)))
+        {
+            status = -EFAULT;
+        }
+        else
+        {
+            status     = submit(ctx, p);
+            *submitted = true;
+        }
+
+        if (status)
+        {
+            break;
+        }
+    }
+
+    return wy_core_batch_result(done, status);
+}
+
+// Whether len bytes at offset lie within a window of size bytes. Checked
+// without forming offset + len, which user space could make overflow
+static inline bool wy_core_window_ok(uint64_t offset, uint64_t len, uint64_t size)
+{
+    return offset <= size && len <= size - offset;
+}
+
+// ------------------------------------------------------------
+// Credits. A count limited to a maximum, as used for a device's
+// opens and a file's completion queue reservations
+// ------------------------------------------------------------
+
+// Take a credit, returning false, with the count unchanged, if limit are taken
+static inline bool wy_core_credit_get(atomic_t *count, uint32_t limit)
+{
+    if (atomic_inc_return(count) > limit)
+    {
+        atomic_dec(count);
+
+        return false;
+    }
+
+    return true;
+}
+
+static inline void wy_core_credit_put(atomic_t *count)
+{
+    atomic_dec(count);
+}
+
+// ------------------------------------------------------------
+// Ring index arithmetic. Indices run freely and wrap at 2^32,
+// and are masked by the power of 2 entry counts
+// ------------------------------------------------------------
+
+static inline uint32_t wy_core_ring_slot(uint32_t idx, uint32_t entries)
+{
+    return idx & (entries - 1);
+}
+
+// Whether there is an SQ entry to execute and room for its completion. A
+// tail more than the SQ size ahead of the head can only be corrupt, so is
+// treated as empty
+static inline bool wy_core_ring_ready(uint32_t sq_head, uint32_t sq_tail, uint32_t sq_entries,
+                                      uint32_t cq_head, uint32_t cq_tail, uint32_t cq_entries)
+{
+    uint32_t pending = sq_tail - sq_head;
+    uint32_t queued  = cq_tail - cq_head;
+
+    return pending && pending <= sq_entries && queued < cq_entries;
+}
+
+// Validate a ring setup's sizes, defaulting the CQ to twice the SQ, and fill
+// in the mapping's layout. Returns the bytes used by the rings, before any
+// rounding to whole pages, or -EINVAL
+static inline ssize_t wy_core_ring_layout(wy_ring_setup_t *setup)
+{
+    uint32_t sq_entries = setup->sq_entries;
+    uint32_t cq_entries = setup->cq_entries ? setup->cq_entries : sq_entries * 2;
+
+    if (!is_power_of_2(sq_entries) || !is_power_of_2(cq_entries) ||
+        sq_entries > WY_MAX_QDEPTH || cq_entries > 2 * WY_MAX_QDEPTH)
+    {
+        return -EINVAL;
+    }
+
+    setup->cq_entries = cq_entries;
+    setup->sq_off     = sizeof(wy_ring_hdr_t);
+    setup->cq_off     = setup->sq_off + sq_entries * sizeof(params_t);
+
+    return setup->cq_off + cq_entries * sizeof(params_t);
+}
+
+// ------------------------------------------------------------
+// Statistics
+// ------------------------------------------------------------
+
+static inline void wy_core_account(wy_cmd_stats_t *stats, int status)
+{
+    atomic64_inc(&stats->count);
+
+    if (status)
+    {
+        atomic64_inc(&stats->errors);
+    }
+}
+
+#endif
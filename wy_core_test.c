@@ -0,0 +1,813 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// KUnit suites for the core command decoding and queue
+// accounting in wy_core.h, and for the command dispatch,
+// submission and per-file queues of wy_engine.c, which is
+// included here against a stub device, as the emulation in
+// emu/ does. Built into the kernel as CONFIG_WY_CORE_KUNIT_TEST,
+// as by 'make kunit', or as the module wy_core_test.ko, which
+// runs the suites on loading
+// ------------------------------------------------------------
+
+// ------------------------------------------------------------
+// Headers
+// ------------------------------------------------------------
+
+#include <kunit/test.h>
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/mman.h>
+#include <linux/uaccess.h>
+
+#include "wy_core.h"
+#include "wy_engine.h"
+
+// ------------------------------------------------------------
+// Structure definitions
+// ------------------------------------------------------------
+
+// Stub device instance, with the fields wy_engine.c uses and a
+// record of the command handlers run
+struct wy_dev {
+    wy_config_t __rcu*       cfg;
+    struct workqueue_struct* wq;
+    wy_worker_t*             workers;
+    uint32_t                 nworkers;
+    atomic_t                 next_home;
+    atomic64_t               steals;
+    wy_cmd_stats_t           cmd_stats[WY_CMD_NUM];
+    atomic_t                 live_deferred;
+    atomic_t                 live_cpls;
+    wy_handler_t             handled;             // Handler of the last command run
+    atomic_t                 runs;                // Count of handlers run
+};
+
+// Engine suite fixture: a device with an open file, and a page
+// of user memory for descriptors written and read
+typedef struct {
+    wy_dev_t                 dev;
+    wy_file_t                ctx;
+    char __user*             ubuf;
+} wy_engine_test_t;
+
+// ------------------------------------------------------------
+// Command dispatch table, submission and the engine, as the
+// driver's
+// ------------------------------------------------------------
+
+#include "wy_engine.c"
+
+// ------------------------------------------------------------
+// Stub command handlers. Each records that it ran and succeeds
+// ------------------------------------------------------------
+
+static int wy_core_test_handled(wy_dev_t *dev, wy_handler_t handler)
+{
+    dev->handled = handler;
+
+    atomic_inc(&dev->runs);
+
+    return 0;
+}
+
+// The stub commands use no user memory, so need no address space
+static int wy_module_exec_mm(wy_file_t *ctx, struct mm_struct *mm, params_t *p)
+{
+    return wy_module_exec(ctx->dev, ctx, p);
+}
+
+static int wy_module_default(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return wy_core_test_handled(dev, wy_module_default);
+}
+
+static int wy_module_stream_start(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return wy_core_test_handled(dev, wy_module_stream_start);
+}
+
+static int wy_module_stream_stop(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return wy_core_test_handled(dev, wy_module_stream_stop);
+}
+
+static int wy_module_mem_fill(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return wy_core_test_handled(dev, wy_module_mem_fill);
+}
+
+static int wy_module_csum(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return wy_core_test_handled(dev, wy_module_csum);
+}
+
+static int wy_module_compress(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return wy_core_test_handled(dev, wy_module_compress);
+}
+
+static int wy_module_decompress(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return wy_core_test_handled(dev, wy_module_decompress);
+}
+
+static int wy_module_copy(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return wy_core_test_handled(dev, wy_module_copy);
+}
+
+static int wy_module_flush(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    return wy_core_test_handled(dev, wy_module_flush);
+}
+
+// ------------------------------------------------------------
+// Helpers
+// ------------------------------------------------------------
+
+// A descriptor passing the ABI checks
+static void wy_core_test_params(params_t *p)
+{
+    memset(p, 0, sizeof(params_t));
+
+    p->version = WY_ABI_VERSION;
+}
+
+// ------------------------------------------------------------
+// Command decoding
+// ------------------------------------------------------------
+
+// Commands index themselves, and unknown ones the default
+static void wy_core_test_cmd_index(struct kunit *test)
+{
+    uint32_t cmd;
+
+    for (cmd = 0; cmd < WY_CMD_NUM; cmd++)
+    {
+        KUNIT_EXPECT_EQ(test, wy_core_cmd_index(cmd), cmd);
+    }
+
+    KUNIT_EXPECT_EQ(test, wy_core_cmd_index(WY_CMD_NUM), (uint32_t)WY_CMD_DEFAULT);
+    KUNIT_EXPECT_EQ(test, wy_core_cmd_index(U32_MAX),    (uint32_t)WY_CMD_DEFAULT);
+}
+
+static void wy_core_test_params_ok(struct kunit *test)
+{
+    params_t p;
+    uint32_t idx;
+
+    wy_core_test_params(&p);
+    KUNIT_EXPECT_TRUE(test, wy_core_params_ok(&p));
+
+    // Command specific fields are not checked here
+    p.cmd    = U32_MAX;
+    p.vaddr  = U64_MAX;
+    p.len    = U32_MAX;
+    p.offset = U32_MAX;
+    KUNIT_EXPECT_TRUE(test, wy_core_params_ok(&p));
+
+    // Any other version is rejected
+    wy_core_test_params(&p);
+    p.version = 0;
+    KUNIT_EXPECT_FALSE(test, wy_core_params_ok(&p));
+
+    p.version = WY_ABI_VERSION + 1;
+    KUNIT_EXPECT_FALSE(test, wy_core_params_ok(&p));
+
+    // As is a non-zero reserved word, whichever it is
+    for (idx = 0; idx < ARRAY_SIZE(p.rsvd); idx++)
+    {
+        wy_core_test_params(&p);
+        p.rsvd[idx] = 1U << 31;
+        KUNIT_EXPECT_FALSE(test, wy_core_params_ok(&p));
+    }
+}
+
+static void wy_core_test_batch_count(struct kunit *test)
+{
+    KUNIT_EXPECT_EQ(test, wy_core_batch_count(0),                        (ssize_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, wy_core_batch_count(1),                        (ssize_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, wy_core_batch_count(sizeof(params_t) - 1),     (ssize_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, wy_core_batch_count(sizeof(params_t)),         (ssize_t)1);
+    KUNIT_EXPECT_EQ(test, wy_core_batch_count(sizeof(params_t) + 1),     (ssize_t)-EINVAL);
+    KUNIT_EXPECT_EQ(test, wy_core_batch_count(16 * sizeof(params_t)),    (ssize_t)16);
+    KUNIT_EXPECT_EQ(test, wy_core_batch_count(16 * sizeof(params_t) - 8), (ssize_t)-EINVAL);
+}
+
+// A failure is only reported when nothing was submitted, else the bytes submitted
+static void wy_core_test_batch_result(struct kunit *test)
+{
+    KUNIT_EXPECT_EQ(test, wy_core_batch_result(0, 0),       (ssize_t)0);
+    KUNIT_EXPECT_EQ(test, wy_core_batch_result(0, -EFAULT), (ssize_t)-EFAULT);
+    KUNIT_EXPECT_EQ(test, wy_core_batch_result(0, -EBUSY),  (ssize_t)-EBUSY);
+    KUNIT_EXPECT_EQ(test, wy_core_batch_result(3, 0),       (ssize_t)(3 * sizeof(params_t)));
+    KUNIT_EXPECT_EQ(test, wy_core_batch_result(2, -EBUSY),  (ssize_t)(2 * sizeof(params_t)));
+    KUNIT_EXPECT_EQ(test, wy_core_batch_result(1, -EINVAL), (ssize_t)sizeof(params_t));
+}
+
+static void wy_core_test_window_ok(struct kunit *test)
+{
+    const uint64_t size = 65536;
+
+    KUNIT_EXPECT_TRUE(test,  wy_core_window_ok(0,        0,            size));
+    KUNIT_EXPECT_TRUE(test,  wy_core_window_ok(0,        size,         size));
+    KUNIT_EXPECT_TRUE(test,  wy_core_window_ok(size - 1, 1,            size));
+    KUNIT_EXPECT_TRUE(test,  wy_core_window_ok(size,     0,            size));
+    KUNIT_EXPECT_FALSE(test, wy_core_window_ok(0,        size + 1,     size));
+    KUNIT_EXPECT_FALSE(test, wy_core_window_ok(size - 1, 2,            size));
+    KUNIT_EXPECT_FALSE(test, wy_core_window_ok(size,     1,            size));
+    KUNIT_EXPECT_FALSE(test, wy_core_window_ok(size + 1, 0,            size));
+
+    // Ranges whose end would overflow
+    KUNIT_EXPECT_FALSE(test, wy_core_window_ok(8,        U64_MAX - 4,  size));
+    KUNIT_EXPECT_FALSE(test, wy_core_window_ok(U64_MAX,  2,            size));
+
+    // An empty window only holds empty ranges at 0
+    KUNIT_EXPECT_TRUE(test,  wy_core_window_ok(0,        0,            0));
+    KUNIT_EXPECT_FALSE(test, wy_core_window_ok(0,        1,            0));
+}
+
+// ------------------------------------------------------------
+// Credits
+// ------------------------------------------------------------
+
+static void wy_core_test_credit(struct kunit *test)
+{
+    atomic_t count = ATOMIC_INIT(0);
+
+    // Up to the limit are granted, and a refusal leaves the count unchanged
+    KUNIT_EXPECT_TRUE(test,  wy_core_credit_get(&count, 2));
+    KUNIT_EXPECT_TRUE(test,  wy_core_credit_get(&count, 2));
+    KUNIT_EXPECT_FALSE(test, wy_core_credit_get(&count, 2));
+    KUNIT_EXPECT_EQ(test, atomic_read(&count), 2);
+
+    // A returned credit can be taken again, once
+    wy_core_credit_put(&count);
+    KUNIT_EXPECT_EQ(test, atomic_read(&count), 1);
+    KUNIT_EXPECT_TRUE(test,  wy_core_credit_get(&count, 2));
+    KUNIT_EXPECT_FALSE(test, wy_core_credit_get(&count, 2));
+
+    // A lowered limit refuses until enough are returned
+    KUNIT_EXPECT_FALSE(test, wy_core_credit_get(&count, 1));
+    KUNIT_EXPECT_EQ(test, atomic_read(&count), 2);
+
+    wy_core_credit_put(&count);
+    wy_core_credit_put(&count);
+    KUNIT_EXPECT_EQ(test, atomic_read(&count), 0);
+
+    // No credits at all with a zero limit
+    KUNIT_EXPECT_FALSE(test, wy_core_credit_get(&count, 0));
+    KUNIT_EXPECT_EQ(test, atomic_read(&count), 0);
+}
+
+// ------------------------------------------------------------
+// Rings
+// ------------------------------------------------------------
+
+static void wy_core_test_ring_slot(struct kunit *test)
+{
+    KUNIT_EXPECT_EQ(test, wy_core_ring_slot(0,           8), 0U);
+    KUNIT_EXPECT_EQ(test, wy_core_ring_slot(9,           8), 1U);
+    KUNIT_EXPECT_EQ(test, wy_core_ring_slot(U32_MAX,     8), 7U);
+    KUNIT_EXPECT_EQ(test, wy_core_ring_slot(U32_MAX + 1, 8), 0U);
+}
+
+static void wy_core_test_ring_ready(struct kunit *test)
+{
+    // Empty SQ, or a CQ with no room
+    KUNIT_EXPECT_FALSE(test, wy_core_ring_ready(5, 5, 4, 0, 0, 8));
+    KUNIT_EXPECT_FALSE(test, wy_core_ring_ready(5, 6, 4, 0, 8, 8));
+    KUNIT_EXPECT_TRUE(test,  wy_core_ring_ready(5, 6, 4, 0, 7, 8));
+
+    // A full SQ is ready, and a tail further ahead can only be corrupt
+    KUNIT_EXPECT_TRUE(test,  wy_core_ring_ready(5, 9,  4, 0, 0, 8));
+    KUNIT_EXPECT_FALSE(test, wy_core_ring_ready(5, 10, 4, 0, 0, 8));
+
+    // As is a tail behind the head
+    KUNIT_EXPECT_FALSE(test, wy_core_ring_ready(5, 4, 4, 0, 0, 8));
+
+    // Across the wrap of the SQ indices
+    KUNIT_EXPECT_TRUE(test,  wy_core_ring_ready(U32_MAX - 1, 1, 4, 0, 0, 8));
+    KUNIT_EXPECT_TRUE(test,  wy_core_ring_ready(U32_MAX,     0, 4, 0, 0, 8));
+    KUNIT_EXPECT_FALSE(test, wy_core_ring_ready(U32_MAX - 1, 3, 4, 0, 0, 8));
+
+    // And of the CQ indices
+    KUNIT_EXPECT_TRUE(test,  wy_core_ring_ready(0, 1, 4, U32_MAX - 2, 4, 8));
+    KUNIT_EXPECT_FALSE(test, wy_core_ring_ready(0, 1, 4, U32_MAX - 2, 5, 8));
+    KUNIT_EXPECT_TRUE(test,  wy_core_ring_ready(0, 1, 4, U32_MAX,     U32_MAX, 8));
+}
+
+static void wy_core_test_ring_layout(struct kunit *test)
+{
+    wy_ring_setup_t setup = { .sq_entries = 8 };
+    ssize_t         size  = wy_core_ring_layout(&setup);
+
+    // The CQ defaults to twice the SQ, with the SQ after the header and the CQ after the SQ
+    KUNIT_EXPECT_EQ(test, setup.cq_entries, 16U);
+    KUNIT_EXPECT_EQ(test, setup.sq_off,     (uint32_t)sizeof(wy_ring_hdr_t));
+    KUNIT_EXPECT_EQ(test, setup.cq_off,     (uint32_t)(sizeof(wy_ring_hdr_t) + 8 * sizeof(params_t)));
+    KUNIT_EXPECT_EQ(test, size,             (ssize_t)(setup.cq_off + 16 * sizeof(params_t)));
+
+    // An explicit CQ size is kept, even smaller than the SQ
+    setup  = (wy_ring_setup_t){ .sq_entries = 8, .cq_entries = 2 };
+    size   = wy_core_ring_layout(&setup);
+
+    KUNIT_EXPECT_EQ(test, setup.cq_entries, 2U);
+    KUNIT_EXPECT_EQ(test, size,             (ssize_t)(setup.cq_off + 2 * sizeof(params_t)));
+
+    // The largest rings
+    setup  = (wy_ring_setup_t){ .sq_entries = WY_MAX_QDEPTH };
+    size   = wy_core_ring_layout(&setup);
+
+    KUNIT_EXPECT_EQ(test, setup.cq_entries, 2U * WY_MAX_QDEPTH);
+    KUNIT_EXPECT_GT(test, size,             (ssize_t)0);
+
+    // Sizes that are zero, not powers of 2 or too large are rejected
+    setup = (wy_ring_setup_t){ .sq_entries = 0 };
+    KUNIT_EXPECT_EQ(test, wy_core_ring_layout(&setup), (ssize_t)-EINVAL);
+
+    setup = (wy_ring_setup_t){ .sq_entries = 6 };
+    KUNIT_EXPECT_EQ(test, wy_core_ring_layout(&setup), (ssize_t)-EINVAL);
+
+    setup = (wy_ring_setup_t){ .sq_entries = 8, .cq_entries = 12 };
+    KUNIT_EXPECT_EQ(test, wy_core_ring_layout(&setup), (ssize_t)-EINVAL);
+
+    setup = (wy_ring_setup_t){ .sq_entries = 2 * WY_MAX_QDEPTH };
+    KUNIT_EXPECT_EQ(test, wy_core_ring_layout(&setup), (ssize_t)-EINVAL);
+
+    setup = (wy_ring_setup_t){ .sq_entries = 8, .cq_entries = 4 * WY_MAX_QDEPTH };
+    KUNIT_EXPECT_EQ(test, wy_core_ring_layout(&setup), (ssize_t)-EINVAL);
+
+    // A doubled default that would overflow is rejected, not wrapped to 0
+    setup = (wy_ring_setup_t){ .sq_entries = 1U << 31 };
+    KUNIT_EXPECT_EQ(test, wy_core_ring_layout(&setup), (ssize_t)-EINVAL);
+}
+
+// ------------------------------------------------------------
+// Statistics
+// ------------------------------------------------------------
+
+static void wy_core_test_account(struct kunit *test)
+{
+    wy_cmd_stats_t stats = { ATOMIC64_INIT(0), ATOMIC64_INIT(0) };
+
+    wy_core_account(&stats, 0);
+    wy_core_account(&stats, -EFAULT);
+    wy_core_account(&stats, 0);
+
+    KUNIT_EXPECT_EQ(test, atomic64_read(&stats.count),  3LL);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&stats.errors), 1LL);
+}
+
+// ------------------------------------------------------------
+// Engine fixture
+// ------------------------------------------------------------
+
+#define WY_ENGINE_TEST_DEPTH        4          // Queue depth of the fixture's file
+#define WY_ENGINE_TEST_THRESHOLD    64         // Length from which bulk commands are deferred
+
+// A device with two engine workers and an open file
+static int wy_engine_test_init(struct kunit *test)
+{
+    wy_engine_test_t* t;
+    wy_config_t*      cfg;
+    unsigned long     uaddr;
+    int               status;
+
+    t   = kunit_kzalloc(test, sizeof(wy_engine_test_t), GFP_KERNEL);
+    cfg = kunit_kzalloc(test, sizeof(wy_config_t),      GFP_KERNEL);
+
+    if (!t || !cfg)
+    {
+        return -ENOMEM;
+    }
+
+    // Completions and written descriptors are copied to and from user memory
+    uaddr = kunit_vm_mmap(test, NULL, 0, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, 0);
+
+    if (uaddr >= TASK_SIZE)
+    {
+        kunit_warn(test, "no user memory\n");
+
+        return -ENOMEM;
+    }
+
+    cfg->queue_depth     = WY_ENGINE_TEST_DEPTH;
+    cfg->defer_threshold = WY_ENGINE_TEST_THRESHOLD;
+    cfg->cq_coalesce     = 1;
+    cfg->cmd_enable      = WY_CMD_ALL;
+
+    RCU_INIT_POINTER(t->dev.cfg, cfg);
+
+    t->ubuf    = (char __user*)uaddr;
+    t->dev.wq  = alloc_workqueue("wy_engine_test", WQ_UNBOUND, 2);
+
+    if (!t->dev.wq)
+    {
+        return -ENOMEM;
+    }
+
+    status = wy_module_engine_alloc(&t->dev, 2);
+
+    if (!status)
+    {
+        status = wy_module_file_init(&t->ctx, &t->dev);
+    }
+
+    if (status)
+    {
+        destroy_workqueue(t->dev.wq);
+        wy_module_engine_free(&t->dev);
+
+        return status;
+    }
+
+    test->priv = t;
+
+    return 0;
+}
+
+static void wy_engine_test_exit(struct kunit *test)
+{
+    wy_engine_test_t* t = test->priv;
+
+    wy_module_file_drain(&t->ctx);
+    wy_module_file_free(&t->ctx);
+
+    destroy_workqueue(t->dev.wq);
+    wy_module_engine_free(&t->dev);
+}
+
+// A tagged descriptor of a command run inline
+static void wy_engine_test_tagged(params_t *p, uint64_t tag)
+{
+    wy_core_test_params(p);
+
+    p->cmd = WY_CMD_DEFAULT;
+    p->tag = tag;
+}
+
+// Read a file's next completion, or last parameters, through user memory
+static ssize_t wy_engine_test_read(struct kunit *test, params_t *p)
+{
+    wy_engine_test_t* t = test->priv;
+    ssize_t           status;
+
+    status = wy_module_cmd_read(&t->ctx, t->ubuf, sizeof(params_t), false);
+
+    KUNIT_EXPECT_EQ(test, copy_from_user(p, t->ubuf, sizeof(params_t)), 0UL);
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// Work stealing queues
+// ------------------------------------------------------------
+
+// An empty queue pops nothing and a full one refuses a push
+static void wy_engine_test_wsq_bounds(struct kunit *test)
+{
+    wy_wsq_cell_t cells[4];
+    wy_work_t     work[5];
+    wy_wsq_t      q;
+    uint32_t      idx;
+
+    wy_module_wsq_init(&q, cells, ARRAY_SIZE(cells));
+
+    KUNIT_EXPECT_NULL(test, wy_module_wsq_pop(&q));
+    KUNIT_EXPECT_FALSE(test, wy_module_wsq_ready(&q));
+    KUNIT_EXPECT_EQ(test, wy_module_wsq_len(&q), 0U);
+
+    for (idx = 0; idx < ARRAY_SIZE(cells); idx++)
+    {
+        KUNIT_EXPECT_TRUE(test, wy_module_wsq_push(&q, &work[idx]));
+    }
+
+    KUNIT_EXPECT_FALSE(test, wy_module_wsq_push(&q, &work[4]));
+    KUNIT_EXPECT_TRUE(test, wy_module_wsq_ready(&q));
+    KUNIT_EXPECT_EQ(test, wy_module_wsq_len(&q), 4U);
+
+    // Popping makes room again, and the queue drains to empty
+    KUNIT_EXPECT_PTR_EQ(test, wy_module_wsq_pop(&q), &work[0]);
+    KUNIT_EXPECT_TRUE(test, wy_module_wsq_push(&q, &work[4]));
+
+    for (idx = 1; idx < ARRAY_SIZE(work); idx++)
+    {
+        KUNIT_EXPECT_PTR_EQ(test, wy_module_wsq_pop(&q), &work[idx]);
+    }
+
+    KUNIT_EXPECT_NULL(test, wy_module_wsq_pop(&q));
+    KUNIT_EXPECT_EQ(test, wy_module_wsq_len(&q), 0U);
+}
+
+// Items come out in order as the indices lap the cells many times
+static void wy_engine_test_wsq_wrap(struct kunit *test)
+{
+    wy_wsq_cell_t cells[4];
+    wy_work_t     work[3];
+    wy_wsq_t      q;
+    uint32_t      lap;
+    uint32_t      idx;
+
+    wy_module_wsq_init(&q, cells, ARRAY_SIZE(cells));
+
+    for (lap = 0; lap < 10; lap++)
+    {
+        for (idx = 0; idx < ARRAY_SIZE(work); idx++)
+        {
+            KUNIT_EXPECT_TRUE(test, wy_module_wsq_push(&q, &work[idx]));
+        }
+
+        KUNIT_EXPECT_EQ(test, wy_module_wsq_len(&q), (uint32_t)ARRAY_SIZE(work));
+
+        for (idx = 0; idx < ARRAY_SIZE(work); idx++)
+        {
+            KUNIT_EXPECT_PTR_EQ(test, wy_module_wsq_pop(&q), &work[idx]);
+        }
+
+        KUNIT_EXPECT_NULL(test, wy_module_wsq_pop(&q));
+    }
+}
+
+// ------------------------------------------------------------
+// Dispatch
+// ------------------------------------------------------------
+
+// Commands reach their handlers through wy_module_cmds, with unknown ones
+// the default, and each is counted in its statistics
+static void wy_engine_test_dispatch(struct kunit *test)
+{
+    static const struct {
+        uint32_t     cmd;
+        wy_handler_t handler;
+    } cases[] =
+    {
+        { WY_CMD_DEFAULT,       wy_module_default      },
+        { WY_CMD_STREAM_START,  wy_module_stream_start },
+        { WY_CMD_STREAM_STOP,   wy_module_stream_stop  },
+        { WY_CMD_MEM_FILL,      wy_module_mem_fill     },
+        { WY_CMD_CRC32C,        wy_module_csum         },
+        { WY_CMD_XXH64,         wy_module_csum         },
+        { WY_CMD_COMPRESS,      wy_module_compress     },
+        { WY_CMD_DECOMPRESS,    wy_module_decompress   },
+        { WY_CMD_COPY_TO_DEV,   wy_module_copy         },
+        { WY_CMD_COPY_FROM_DEV, wy_module_copy         },
+        { WY_CMD_FLUSH,         wy_module_flush        },
+        { WY_CMD_NUM,           wy_module_default      },
+        { U32_MAX,              wy_module_default      },
+    };
+
+    wy_engine_test_t* t = test->priv;
+    params_t          p;
+    uint32_t          idx;
+
+    for (idx = 0; idx < ARRAY_SIZE(cases); idx++)
+    {
+        wy_core_test_params(&p);
+        p.cmd = cases[idx].cmd;
+
+        t->dev.handled = NULL;
+
+        KUNIT_EXPECT_EQ(test, wy_module_exec(&t->dev, &t->ctx, &p), 0);
+        KUNIT_EXPECT_PTR_EQ(test, t->dev.handled, cases[idx].handler);
+    }
+
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev.cmd_stats[WY_CMD_DEFAULT].count), 3LL);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev.cmd_stats[WY_CMD_CRC32C].count),  1LL);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev.cmd_stats[WY_CMD_CRC32C].errors), 0LL);
+}
+
+// A disabled command fails without reaching its handler
+static void wy_engine_test_dispatch_disabled(struct kunit *test)
+{
+    wy_engine_test_t* t = test->priv;
+    params_t          p;
+
+    rcu_dereference_protected(t->dev.cfg, 1)->cmd_enable = WY_CMD_ALL & ~BIT(WY_CMD_CRC32C);
+
+    wy_core_test_params(&p);
+    p.cmd = WY_CMD_CRC32C;
+
+    KUNIT_EXPECT_EQ(test, wy_module_exec(&t->dev, &t->ctx, &p), -EOPNOTSUPP);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->dev.runs), 0);
+    KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev.cmd_stats[WY_CMD_CRC32C].errors), 1LL);
+}
+
+// The doorbell has no file. A user buffer is refused, but a vaddr of 0,
+// which has a checksum use the memory window, reaches the handler
+static void wy_engine_test_dispatch_doorbell(struct kunit *test)
+{
+    wy_engine_test_t* t = test->priv;
+    params_t          p;
+
+    wy_core_test_params(&p);
+    p.cmd   = WY_CMD_CRC32C;
+    p.len   = 64;
+    p.vaddr = (uint64_t)(uintptr_t)t->ubuf;
+
+    KUNIT_EXPECT_EQ(test, wy_module_exec(&t->dev, NULL, &p), -EFAULT);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->dev.runs), 0);
+
+    p.vaddr = 0;
+
+    KUNIT_EXPECT_EQ(test, wy_module_exec(&t->dev, NULL, &p), 0);
+    KUNIT_EXPECT_PTR_EQ(test, t->dev.handled, wy_module_csum);
+}
+
+// ------------------------------------------------------------
+// Submission and completion
+// ------------------------------------------------------------
+
+// Tagged commands each hold a completion slot until read, so the queue
+// depth of them fills the queue. Untagged ones then still run inline
+static void wy_engine_test_submit_busy(struct kunit *test)
+{
+    wy_engine_test_t* t = test->priv;
+    params_t          p;
+    uint32_t          idx;
+
+    for (idx = 0; idx < WY_ENGINE_TEST_DEPTH; idx++)
+    {
+        wy_engine_test_tagged(&p, idx + 1);
+
+        KUNIT_EXPECT_EQ(test, wy_module_submit(&t->ctx, &p), 0);
+    }
+
+    KUNIT_EXPECT_EQ(test, wy_module_wsq_len(&t->ctx.cq),   (uint32_t)WY_ENGINE_TEST_DEPTH);
+    KUNIT_EXPECT_EQ(test, wy_module_wsq_len(&t->ctx.free), 0U);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->ctx.cq_reserved), WY_ENGINE_TEST_DEPTH);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->dev.live_cpls),   WY_ENGINE_TEST_DEPTH);
+
+    wy_engine_test_tagged(&p, WY_ENGINE_TEST_DEPTH + 1);
+
+    KUNIT_EXPECT_EQ(test, wy_module_submit(&t->ctx, &p), -EBUSY);
+    KUNIT_EXPECT_EQ(test, p.status, -EBUSY);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->dev.runs), WY_ENGINE_TEST_DEPTH);
+
+    wy_engine_test_tagged(&p, 0);
+
+    KUNIT_EXPECT_EQ(test, wy_module_submit(&t->ctx, &p), 0);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->dev.runs), WY_ENGINE_TEST_DEPTH + 1);
+
+    // Including a bulk one, which would otherwise be deferred
+    wy_core_test_params(&p);
+    p.cmd = WY_CMD_MEM_FILL;
+    p.len = WY_ENGINE_TEST_THRESHOLD;
+
+    KUNIT_EXPECT_EQ(test, wy_module_submit(&t->ctx, &p), 0);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->dev.runs), WY_ENGINE_TEST_DEPTH + 2);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->ctx.inflight), 0);
+    KUNIT_EXPECT_EQ(test, wy_module_wsq_len(&t->ctx.cq), (uint32_t)WY_ENGINE_TEST_DEPTH);
+}
+
+// Reading a completion returns its slot and then its reservation, in
+// submission order, after which the last parameters written are read
+static void wy_engine_test_cpl_read(struct kunit *test)
+{
+    wy_engine_test_t* t = test->priv;
+    params_t          p;
+    uint32_t          idx;
+
+    for (idx = 0; idx < WY_ENGINE_TEST_DEPTH; idx++)
+    {
+        wy_engine_test_tagged(&p, idx + 1);
+
+        KUNIT_EXPECT_EQ(test, copy_to_user(t->ubuf, &p, sizeof(params_t)), 0UL);
+        KUNIT_EXPECT_EQ(test, wy_module_cmd_write(&t->ctx, t->ubuf, sizeof(params_t)), (ssize_t)sizeof(params_t));
+    }
+
+    for (idx = 0; idx < WY_ENGINE_TEST_DEPTH; idx++)
+    {
+        KUNIT_EXPECT_EQ(test, wy_engine_test_read(test, &p), (ssize_t)sizeof(params_t));
+        KUNIT_EXPECT_EQ(test, p.tag, (uint64_t)idx + 1);
+        KUNIT_EXPECT_EQ(test, p.status, 0);
+
+        KUNIT_EXPECT_EQ(test, wy_module_wsq_len(&t->ctx.free), idx + 1);
+        KUNIT_EXPECT_EQ(test, atomic_read(&t->ctx.cq_reserved), (int)(WY_ENGINE_TEST_DEPTH - idx - 1));
+    }
+
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->dev.live_cpls), 0);
+
+    // Nothing queued or in flight, so the last descriptor written is read back
+    KUNIT_EXPECT_EQ(test, wy_engine_test_read(test, &p), (ssize_t)sizeof(params_t));
+    KUNIT_EXPECT_EQ(test, p.tag, (uint64_t)WY_ENGINE_TEST_DEPTH);
+
+    // And the freed slots take tagged commands again
+    wy_engine_test_tagged(&p, 1);
+
+    KUNIT_EXPECT_EQ(test, wy_module_submit(&t->ctx, &p), 0);
+}
+
+// Bulk commands at or above the threshold are deferred to the engine, and
+// their completions read as they finish
+static void wy_engine_test_deferred(struct kunit *test)
+{
+    wy_engine_test_t* t = test->priv;
+    params_t          p;
+    uint32_t          idx;
+
+    for (idx = 0; idx < WY_ENGINE_TEST_DEPTH; idx++)
+    {
+        wy_core_test_params(&p);
+        p.cmd = WY_CMD_MEM_FILL;
+        p.len = WY_ENGINE_TEST_THRESHOLD;
+
+        KUNIT_EXPECT_EQ(test, wy_module_submit(&t->ctx, &p), 0);
+    }
+
+    for (idx = 0; idx < WY_ENGINE_TEST_DEPTH; idx++)
+    {
+        KUNIT_EXPECT_EQ(test, wy_engine_test_read(test, &p), (ssize_t)sizeof(params_t));
+        KUNIT_EXPECT_EQ(test, p.cmd, (uint32_t)WY_CMD_MEM_FILL);
+        KUNIT_EXPECT_EQ(test, p.status, 0);
+    }
+
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->dev.runs), WY_ENGINE_TEST_DEPTH);
+    KUNIT_EXPECT_PTR_EQ(test, t->dev.handled, wy_module_mem_fill);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->ctx.inflight), 0);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->dev.live_deferred), 0);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->ctx.cq_reserved), 0);
+    KUNIT_EXPECT_EQ(test, wy_module_wsq_len(&t->ctx.free), (uint32_t)WY_ENGINE_TEST_DEPTH);
+
+    // Below the threshold the command runs inline, with no completion
+    wy_core_test_params(&p);
+    p.cmd = WY_CMD_MEM_FILL;
+    p.len = WY_ENGINE_TEST_THRESHOLD - 1;
+
+    KUNIT_EXPECT_EQ(test, wy_module_submit(&t->ctx, &p), 0);
+    KUNIT_EXPECT_EQ(test, wy_module_wsq_len(&t->ctx.cq), 0U);
+    KUNIT_EXPECT_EQ(test, atomic_read(&t->dev.runs), WY_ENGINE_TEST_DEPTH + 1);
+}
+
+// ------------------------------------------------------------
+// Suites
+// ------------------------------------------------------------
+
+static struct kunit_case wy_core_test_cases[] =
+{
+    KUNIT_CASE(wy_core_test_cmd_index),
+    KUNIT_CASE(wy_core_test_params_ok),
+    KUNIT_CASE(wy_core_test_batch_count),
+    KUNIT_CASE(wy_core_test_batch_result),
+    KUNIT_CASE(wy_core_test_window_ok),
+    KUNIT_CASE(wy_core_test_credit),
+    KUNIT_CASE(wy_core_test_ring_slot),
+    KUNIT_CASE(wy_core_test_ring_ready),
+    KUNIT_CASE(wy_core_test_ring_layout),
+    KUNIT_CASE(wy_core_test_account),
+    {}
+};
+
+static struct kunit_suite wy_core_test_suite =
+{
+    .name       = "wy_core",
+    .test_cases = wy_core_test_cases,
+};
+
+static struct kunit_case wy_engine_test_cases[] =
+{
+    KUNIT_CASE(wy_engine_test_wsq_bounds),
+    KUNIT_CASE(wy_engine_test_wsq_wrap),
+    KUNIT_CASE(wy_engine_test_dispatch),
+    KUNIT_CASE(wy_engine_test_dispatch_disabled),
+    KUNIT_CASE(wy_engine_test_dispatch_doorbell),
+    KUNIT_CASE(wy_engine_test_submit_busy),
+    KUNIT_CASE(wy_engine_test_cpl_read),
+    KUNIT_CASE(wy_engine_test_deferred),
+    {}
+};
+
+static struct kunit_suite wy_engine_test_suite =
+{
+    .name       = "wy_engine",
+    .init       = wy_engine_test_init,
+    .exit       = wy_engine_test_exit,
+    .test_cases = wy_engine_test_cases,
+};
+
+kunit_test_suites(&wy_core_test_suite, &wy_engine_test_suite);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("KUnit tests for the wy_module core and engine");
@@ -0,0 +1,886 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// Command dispatch, per-file queues and the engine of the
+// wy_module driver. This is included by wy_module.c, and by the
+// user space emulation in emu/ against its shims of the kernel
+// headers, so that both run the same code.
+//
+// The including file includes wy_engine.h and defines struct
+// wy_dev before including this, with at least these fields:
+//
+//   wy_config_t __rcu*       cfg;
+//   struct workqueue_struct* wq;
+//   wy_worker_t*             workers;
+//   uint32_t                 nworkers;
+//   atomic_t                 next_home;
+//   atomic64_t               steals;
+//   wy_cmd_stats_t           cmd_stats[WY_CMD_NUM];
+//   atomic_t                 live_deferred;
+//   atomic_t                 live_cpls;
+//
+// and afterwards the command handlers named in wy_module_cmds
+// which are not defined here, and wy_module_exec_mm.
+// ------------------------------------------------------------
+
+#include "wy_engine.h"
+
+// ------------------------------------------------------------
+// Command dispatch table
+// ------------------------------------------------------------
+
+static const wy_cmd_t wy_module_cmds[WY_CMD_NUM] =
+{
+    [WY_CMD_DEFAULT]       = { "default",       WY_DIR_NONE,     false, wy_module_default      },
+    [WY_CMD_STREAM_START]  = { "stream_start",  WY_DIR_NONE,     false, wy_module_stream_start },
+    [WY_CMD_STREAM_STOP]   = { "stream_stop",   WY_DIR_NONE,     false, wy_module_stream_stop  },
+    [WY_CMD_MEM_FILL]      = { "mem_fill",      WY_DIR_NONE,     true,  wy_module_mem_fill     },
+    [WY_CMD_SET_QDEPTH]    = { "set_qdepth",    WY_DIR_NONE,     false, wy_module_set_qdepth   },
+    [WY_CMD_CRC32C]        = { "crc32c",        WY_DIR_TO_DEV,   true,  wy_module_csum         },
+    [WY_CMD_XXH64]         = { "xxh64",         WY_DIR_TO_DEV,   true,  wy_module_csum         },
+    [WY_CMD_COMPRESS]      = { "compress",      WY_DIR_TO_DEV,   true,  wy_module_compress     },
+    [WY_CMD_DECOMPRESS]    = { "decompress",    WY_DIR_FROM_DEV, true,  wy_module_decompress   },
+    [WY_CMD_COPY_TO_DEV]   = { "copy_to_dev",   WY_DIR_TO_DEV,   true,  wy_module_copy         },
+    [WY_CMD_COPY_FROM_DEV] = { "copy_from_dev", WY_DIR_FROM_DEV, true,  wy_module_copy         },
+    [WY_CMD_FLUSH]         = { "flush",         WY_DIR_NONE,     false, wy_module_flush        },
+};
+
+// Look up a command's descriptor. Unknown commands get the default
+static inline const wy_cmd_t* wy_module_cmd(uint32_t cmd)
+{
+    return &wy_module_cmds[wy_core_cmd_index(cmd)];
+}
+
+// ------------------------------------------------------------
+// Execute a command, either from a write or from the doorbell.
+// For the doorbell there is no file context, and ctx is NULL
+// ------------------------------------------------------------
+
+static int wy_module_exec(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    const wy_cmd_t* cmd   = wy_module_cmd(p->cmd);
+    wy_cmd_stats_t* stats = &dev->cmd_stats[cmd - wy_module_cmds];
+    bool            enabled;
+    int             status;
+
+    rcu_read_lock();
+    enabled = rcu_dereference(dev->cfg)->cmd_enable & BIT(cmd - wy_module_cmds);
+    rcu_read_unlock();
+
+    // Check any user buffer before handing it to the command. Without a file
+    // or an address space, as for the doorbell thread, there is no user
+    // memory, and access_ok alone would pass a non-zero vaddr. A vaddr of 0
+    // has commands such as the checksums use the memory window instead
+    if (!enabled)
+    {
+        status = -EOPNOTSUPP;
+    }
+    else if (cmd->dir != WY_DIR_NONE && p->vaddr && (!ctx || !current->mm))
+    {
+        status = -EFAULT;
+    }
+    else if (cmd->dir != WY_DIR_NONE && !access_ok(u64_to_user_ptr(p->vaddr), p->len))
+    {
+        status = -EFAULT;
+    }
+    else
+    {
+        status = cmd->handler(dev, ctx, p);
+    }
+
+    wy_core_account(stats, status);
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// Command interface write. Expects one or more whole
+// descriptors, submitted in order. Writes on the file run
+// concurrently, and only the last descriptor of each is kept
+// for read
+// ------------------------------------------------------------
+
+static ssize_t wy_module_cmd_write(wy_file_t *ctx, const char *buffer, size_t len)
+{
+    params_t p;
+    bool     submitted;
+    ssize_t  status;
+
+    status = wy_core_write(ctx, &p, buffer, len, wy_module_submit, &submitted);
+
+    if (submitted)
+    {
+        wy_module_last_write(ctx, &p);
+    }
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// Command interface read. Returns the next completion of a
+// deferred or tagged command, or if there are none queued or
+// in flight the last parameters written
+// ------------------------------------------------------------
+
+static ssize_t wy_module_cmd_read(wy_file_t *ctx, char *buffer, size_t len, bool nonblock)
+{
+    params_t params;
+    ssize_t  status;
+
+    // Expecting a whole descriptor
+    if (len != sizeof(params_t))
+    {
+        return -EINVAL;
+    }
+
+    // Completions of deferred commands are returned in preference to the last parameters
+    status = wy_module_cpl_read(ctx, buffer, len, nonblock);
+
+    if (status)
+    {
+        return status;
+    }
+
+    wy_module_last_read(ctx, &params);
+
+    if (copy_to_user(buffer, &params, len))
+    {
+        return -EFAULT;
+    }
+
+    return len;
+}
+
+// ------------------------------------------------------------
+// Publish the last parameters written, in this CPU's copy. The
+// copy is only written here, and with preemption disabled, so
+// its sequence count needs no lock, and readers retry only on
+// meeting a write to the same copy
+// ------------------------------------------------------------
+
+static void wy_module_last_write(wy_file_t *ctx, const params_t *p)
+{
+    wy_last_t* last = get_cpu_ptr(ctx->last);
+
+    write_seqcount_begin(&last->seq);
+
+    last->gen    = atomic64_inc_return(&ctx->last_gen);
+    last->params = *p;
+
+    write_seqcount_end(&last->seq);
+
+    put_cpu_ptr(ctx->last);
+}
+
+// ------------------------------------------------------------
+// Take a copy of the last parameters written: the whole copy
+// of the latest generation of any CPU's, or zeros if none
+// ------------------------------------------------------------
+
+static void wy_module_last_read(wy_file_t *ctx, params_t *p)
+{
+    wy_last_t* last;
+    params_t   params;
+    uint64_t   latest = 0;
+    uint64_t   gen;
+    unsigned   seq;
+    int        cpu;
+
+    memset(p, 0, sizeof(params_t));
+
+    for_each_possible_cpu(cpu)
+    {
+        last = per_cpu_ptr(ctx->last, cpu);
+
+        do
+        {
+            seq    = read_seqcount_begin(&last->seq);
+            gen    = last->gen;
+            params = last->params;
+        } while (read_seqcount_retry(&last->seq, seq));
+
+        if (gen > latest)
+        {
+            latest = gen;
+            *p     = params;
+        }
+    }
+}
+
+// ------------------------------------------------------------
+// Initialise a zeroed file context for an instance, with the
+// instance's current queue depth
+// ------------------------------------------------------------
+
+static int wy_module_file_init(wy_file_t *ctx, wy_dev_t *dev)
+{
+    uint32_t depth;
+    int      status;
+    int      cpu;
+
+    ctx->dev  = dev;
+    ctx->home = (uint32_t)atomic_inc_return(&dev->next_home) % dev->nworkers;
+    ctx->last = alloc_percpu(wy_last_t);
+
+    if (!ctx->last)
+    {
+        return -ENOMEM;
+    }
+
+    for_each_possible_cpu(cpu)
+    {
+        seqcount_init(&per_cpu_ptr(ctx->last, cpu)->seq);
+    }
+
+    mutex_init(&ctx->lock);
+    mutex_init(&ctx->read_lock);
+    spin_lock_init(&ctx->cq_lock);
+    init_waitqueue_head(&ctx->cq_wq);
+
+    rcu_read_lock();
+    depth = rcu_dereference(dev->cfg)->queue_depth;
+    rcu_read_unlock();
+
+    status = percpu_init_rwsem(&ctx->qlock);
+
+    if (!status)
+    {
+        status = wy_module_queue_alloc(ctx, depth);
+
+        if (status)
+        {
+            percpu_free_rwsem(&ctx->qlock);
+        }
+    }
+
+    if (status)
+    {
+        free_percpu(ctx->last);
+    }
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// Wait for a closing file's deferred commands to finish
+// ------------------------------------------------------------
+
+static void wy_module_file_drain(wy_file_t *ctx)
+{
+    // Workers wake readers under cq_lock, so taking it ensures the last
+    // one is done with the context
+    wait_event(ctx->cq_wq, !atomic_read(&ctx->inflight));
+
+    spin_lock(&ctx->cq_lock);
+    spin_unlock(&ctx->cq_lock);
+}
+
+// ------------------------------------------------------------
+// Free a drained file's queues, discarding unread completions
+// ------------------------------------------------------------
+
+static void wy_module_file_free(wy_file_t *ctx)
+{
+    wy_module_queue_free(ctx);
+    percpu_free_rwsem(&ctx->qlock);
+    free_percpu(ctx->last);
+}
+
+// ------------------------------------------------------------
+// Submit a written command. Untagged commands run inline, as
+// before, unless a bulk command at or above defer_threshold.
+// These are deferred to the workqueue, as are tagged ones, with
+// completions posted to the file's completion queue. Tagged
+// commands run inline also post a completion, so that user
+// space can match all completions by tag. Takes no lock, so may
+// be called from any number of threads at once.
+// ------------------------------------------------------------
+
+static int wy_module_submit(wy_file_t *ctx, params_t *p)
+{
+    wy_work_t* w;
+    uint32_t   threshold;
+    bool       bulk;
+    bool       reserved;
+
+    if (!wy_core_params_ok(p))
+    {
+        p->status = -EINVAL;
+
+        return p->status;
+    }
+
+    rcu_read_lock();
+    threshold = rcu_dereference(ctx->dev->cfg)->defer_threshold;
+    rcu_read_unlock();
+
+    bulk = wy_module_cmd(p->cmd)->may_block && p->len >= threshold;
+
+    if (!p->tag && !bulk)
+    {
+        p->status = wy_module_exec(ctx->dev, ctx, p);
+
+        return p->status;
+    }
+
+    // Reserve completion space. A full queue fails a tagged command, whilst
+    // an untagged bulk command falls back to running inline. The queues
+    // cannot then be replaced until the reservation is returned by read
+    percpu_down_read(&ctx->qlock);
+    reserved = wy_core_credit_get(&ctx->cq_reserved, ctx->depth);
+    percpu_up_read(&ctx->qlock);
+
+    if (!reserved)
+    {
+        if (p->tag)
+        {
+            p->status = -EBUSY;
+
+            return p->status;
+        }
+
+        p->status = wy_module_exec(ctx->dev, ctx, p);
+
+        return p->status;
+    }
+
+    if (!bulk)
+    {
+        p->status = wy_module_exec(ctx->dev, ctx, p);
+    }
+
+    // A reservation guarantees a free slot, as read returns a slot to the
+    // queue before returning its reservation
+    w         = wy_module_wsq_pop(&ctx->free);
+    w->params = *p;
+
+    if (!bulk)
+    {
+        wy_module_wsq_push(&ctx->cq, w);
+        atomic_inc(&ctx->dev->live_cpls);
+
+        // Only take the wait queue's lock if a reader is waiting
+        if (wq_has_sleeper(&ctx->cq_wq))
+        {
+            wake_up(&ctx->cq_wq);
+        }
+
+        return 0;
+    }
+
+    // The command runs in the submitter's address space, which need not be
+    // the one that opened the file after a fork or a passed descriptor
+    w->mm = current->mm;
+
+    if (w->mm)
+    {
+        mmgrab(w->mm);
+    }
+
+    atomic_inc(&ctx->inflight);
+    atomic_inc(&ctx->dev->live_deferred);
+
+    wy_module_engine_submit(ctx, w);
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Execute a deferred command and post its completion. Deferred
+// commands run concurrently, and so may complete out of order
+// ------------------------------------------------------------
+
+static void wy_module_run(wy_work_t *w)
+{
+    wy_file_t* ctx = w->ctx;
+    uint32_t   coalesce;
+
+    w->params.status = wy_module_exec_mm(ctx, w->mm, &w->params);
+
+    if (w->mm)
+    {
+        mmdrop(w->mm);
+        w->mm = NULL;
+    }
+
+    rcu_read_lock();
+    coalesce = rcu_dereference(ctx->dev->cfg)->cq_coalesce;
+    rcu_read_unlock();
+
+    // Space was reserved on submission so this cannot fail, and the slot
+    // now belongs to the reader. The waiters are woken under the lock which
+    // release takes before freeing the context. Wake ups are coalesced until
+    // enough completions are queued, or the last command completes
+    wy_module_wsq_push(&ctx->cq, w);
+
+    atomic_inc(&ctx->dev->live_cpls);
+    atomic_dec(&ctx->dev->live_deferred);
+
+    spin_lock(&ctx->cq_lock);
+
+    if (atomic_dec_and_test(&ctx->inflight) || wy_module_wsq_len(&ctx->cq) >= coalesce)
+    {
+        wake_up(&ctx->cq_wq);
+    }
+
+    spin_unlock(&ctx->cq_lock);
+}
+
+// ------------------------------------------------------------
+// Return the next completion to user space, waiting for one if
+// commands are in flight, unless nonblock. Returns 0 if none
+// are queued or in flight
+// ------------------------------------------------------------
+
+static ssize_t wy_module_cpl_read(wy_file_t *ctx, char *buffer, size_t len, bool nonblock)
+{
+    wy_work_t* w;
+    params_t   cpl;
+    int        busy;
+
+    if (mutex_lock_interruptible(&ctx->read_lock))
+    {
+        return -ERESTARTSYS;
+    }
+
+    for (;;)
+    {
+        // Sampled before looking at the queue, as workers post a completion
+        // before dropping inflight
+        busy = atomic_read_acquire(&ctx->inflight);
+        w    = wy_module_wsq_pop(&ctx->cq);
+
+        if (w)
+        {
+            break;
+        }
+
+        mutex_unlock(&ctx->read_lock);
+
+        if (!busy)
+        {
+            return 0;
+        }
+
+        if (nonblock)
+        {
+            return -EAGAIN;
+        }
+
+        if (wait_event_interruptible(ctx->cq_wq, wy_module_wsq_ready(&ctx->cq) ||
+                                                 !atomic_read(&ctx->inflight)))
+        {
+            return -ERESTARTSYS;
+        }
+
+        if (mutex_lock_interruptible(&ctx->read_lock))
+        {
+            return -ERESTARTSYS;
+        }
+    }
+
+    // The single consumer returns the slot, and then its reservation, so
+    // that the free queue never runs out under a reservation. The free
+    // queue has a cell for every slot, so cannot be full
+    cpl = w->params;
+
+    wy_module_wsq_push(&ctx->free, w);
+    wy_core_credit_put(&ctx->cq_reserved);
+    atomic_dec(&ctx->dev->live_cpls);
+
+    mutex_unlock(&ctx->read_lock);
+
+    if (copy_to_user(buffer, &cpl, len))
+    {
+        return -EFAULT;
+    }
+
+    return len;
+}
+
+// ------------------------------------------------------------
+// Allocate a file's completion queue and deferred command
+// slots for the given depth, replacing any existing ones
+// ------------------------------------------------------------
+
+static int wy_module_queue_alloc(wy_file_t *ctx, uint32_t depth)
+{
+    wy_work_t*     work;
+    wy_wsq_cell_t* free;
+    wy_wsq_cell_t* cq;
+    uint32_t       cells;
+    uint32_t       idx;
+
+    if (!depth || depth > WY_MAX_QDEPTH)
+    {
+        return -EINVAL;
+    }
+
+    cells = roundup_pow_of_two(depth);
+    work  = kcalloc(depth, sizeof(wy_work_t),     GFP_KERNEL);
+    free  = kcalloc(cells, sizeof(wy_wsq_cell_t), GFP_KERNEL);
+    cq    = kcalloc(cells, sizeof(wy_wsq_cell_t), GFP_KERNEL);
+
+    if (!work || !free || !cq)
+    {
+        kfree(work);
+        kfree(free);
+        kfree(cq);
+
+        return -ENOMEM;
+    }
+
+    wy_module_queue_free(ctx);
+
+    wy_module_wsq_init(&ctx->free, free, cells);
+    wy_module_wsq_init(&ctx->cq,   cq,   cells);
+
+    for (idx = 0; idx < depth; idx++)
+    {
+        work[idx].ctx = ctx;
+
+        wy_module_wsq_push(&ctx->free, &work[idx]);
+    }
+
+    ctx->work  = work;
+    ctx->depth = depth;
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Free a file's queues. Nothing may be in flight
+// ------------------------------------------------------------
+
+static void wy_module_queue_free(wy_file_t *ctx)
+{
+    if (ctx->work)
+    {
+        atomic_sub(wy_module_wsq_len(&ctx->cq), &ctx->dev->live_cpls);
+    }
+
+    kfree(ctx->work);
+    kfree(ctx->free.cells);
+    kfree(ctx->cq.cells);
+
+    ctx->work       = NULL;
+    ctx->free.cells = NULL;
+    ctx->cq.cells   = NULL;
+}
+
+// ------------------------------------------------------------
+// Change a file's queue depth. Only allowed when nothing is in
+// flight or waiting to be read, so must be issued untagged
+// ------------------------------------------------------------
+
+static int wy_module_set_qdepth(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    int status = -EBUSY;
+
+    if (!ctx)
+    {
+        return -EINVAL;
+    }
+
+    // Stop reservations being taken whilst checking there are none, as each
+    // holds the queues, and whilst replacing the queues
+    mutex_lock(&ctx->read_lock);
+    percpu_down_write(&ctx->qlock);
+
+    if (!atomic_read(&ctx->cq_reserved))
+    {
+        status = wy_module_queue_alloc(ctx, p->len);
+    }
+
+    percpu_up_write(&ctx->qlock);
+    mutex_unlock(&ctx->read_lock);
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// Allocate an instance's engine workers, 1 to WY_MAX_WORKERS,
+// and their queues. On failure, those allocated are left for
+// wy_module_engine_free
+// ------------------------------------------------------------
+
+static int wy_module_engine_alloc(wy_dev_t *dev, uint32_t nworkers)
+{
+    wy_worker_t*   worker;
+    wy_wsq_cell_t* cells;
+    uint32_t       idx;
+
+    if (!nworkers || nworkers > WY_MAX_WORKERS)
+    {
+        return -EINVAL;
+    }
+
+    dev->workers = kcalloc(nworkers, sizeof(wy_worker_t), GFP_KERNEL);
+
+    for (idx = 0; dev->workers && idx < nworkers; idx++)
+    {
+        worker = &dev->workers[idx];
+
+        INIT_WORK(&worker->work, wy_module_engine_work);
+        worker->dev = dev;
+        worker->idx = idx;
+        cells       = kcalloc(WY_WSQ_SIZE, sizeof(wy_wsq_cell_t), GFP_KERNEL);
+
+        if (!cells)
+        {
+            break;
+        }
+
+        wy_module_wsq_init(&worker->q, cells, WY_WSQ_SIZE);
+
+        dev->nworkers++;
+    }
+
+    return dev->nworkers == nworkers ? 0 : -ENOMEM;
+}
+
+// ------------------------------------------------------------
+// Free an instance's engine workers. The workqueue running
+// them must have been destroyed
+// ------------------------------------------------------------
+
+static void wy_module_engine_free(wy_dev_t *dev)
+{
+    while (dev->nworkers--)
+    {
+        kfree(dev->workers[dev->nworkers].q.cells);
+    }
+
+    kfree(dev->workers);
+
+    dev->workers  = NULL;
+    dev->nworkers = 0;
+}
+
+// ------------------------------------------------------------
+// Hand a deferred command to the file's home engine worker. If
+// the home queue already has a backlog, a sibling worker is
+// also kicked so that it can steal from it
+// ------------------------------------------------------------
+
+static void wy_module_engine_submit(wy_file_t *ctx, wy_work_t *w)
+{
+    wy_dev_t*    dev  = ctx->dev;
+    wy_worker_t* home = &dev->workers[ctx->home];
+    wy_worker_t* sibling;
+    uint32_t     idx;
+
+    if (!wy_module_wsq_push(&home->q, w))
+    {
+        // Home queue full, so run the command here
+        wy_module_run(w);
+
+        return;
+    }
+
+    queue_work(dev->wq, &home->work);
+
+    if (dev->nworkers > 1 && wy_module_wsq_len(&home->q) > 1)
+    {
+        idx     = (uint32_t)atomic_inc_return(&dev->next_home) % dev->nworkers;
+        sibling = &dev->workers[idx == home->idx ? (idx + 1) % dev->nworkers : idx];
+
+        queue_work(dev->wq, &sibling->work);
+    }
+}
+
+// ------------------------------------------------------------
+// Engine worker. Runs commands from its own queue and, when
+// that is empty, steals from its siblings' queues
+// ------------------------------------------------------------
+
+static void wy_module_engine_work(struct work_struct *work)
+{
+    wy_worker_t* self = container_of(work, wy_worker_t, work);
+    wy_work_t*   w;
+
+    while ((w = wy_module_wsq_pop(&self->q)) || (w = wy_module_engine_steal(self)))
+    {
+        wy_module_run(w);
+
+        cond_resched();
+    }
+}
+
+// ------------------------------------------------------------
+// Steal a command from the first sibling worker with one queued
+// ------------------------------------------------------------
+
+static wy_work_t* wy_module_engine_steal(wy_worker_t *self)
+{
+    wy_dev_t*  dev = self->dev;
+    wy_work_t* w;
+    uint32_t   idx;
+
+    for (idx = 1; idx < dev->nworkers; idx++)
+    {
+        w = wy_module_wsq_pop(&dev->workers[(self->idx + idx) % dev->nworkers].q);
+
+        if (w)
+        {
+            atomic64_inc(&dev->steals);
+
+            return w;
+        }
+    }
+
+    return NULL;
+}
+
+// ------------------------------------------------------------
+// Initialise an empty work stealing queue over size cells, a
+// power of 2
+// ------------------------------------------------------------
+
+static void wy_module_wsq_init(wy_wsq_t *q, wy_wsq_cell_t *cells, uint32_t size)
+{
+    uint32_t idx;
+
+    for (idx = 0; idx < size; idx++)
+    {
+        atomic_set(&cells[idx].seq, idx);
+    }
+
+    atomic_set(&q->head, 0);
+    atomic_set(&q->tail, 0);
+
+    q->cells = cells;
+    q->size  = size;
+}
+
+// ------------------------------------------------------------
+// Push a command onto a work stealing queue. Returns false if
+// the queue is full
+// ------------------------------------------------------------
+
+static bool wy_module_wsq_push(wy_wsq_t *q, wy_work_t *w)
+{
+    wy_wsq_cell_t* cell;
+    int            pos = atomic_read(&q->tail);
+    int            diff;
+
+    for (;;)
+    {
+        cell = &q->cells[pos & (q->size - 1)];
+        diff = atomic_read_acquire(&cell->seq) - pos;
+
+        // Cell free for this position, so try to claim it
+        if (!diff)
+        {
+            if (atomic_try_cmpxchg(&q->tail, &pos, pos + 1))
+            {
+                break;
+            }
+        }
+        // Cell still holds an item from the previous lap
+        else if (diff < 0)
+        {
+            return false;
+        }
+        // Another pusher claimed it first
+        else
+        {
+            pos = atomic_read(&q->tail);
+        }
+    }
+
+    cell->item = w;
+
+    // Publish the item to poppers
+    atomic_set_release(&cell->seq, pos + 1);
+
+    return true;
+}
+
+// ------------------------------------------------------------
+// Pop the oldest command from a work stealing queue, from the
+// owning worker or a thief. Returns NULL if the queue is empty
+// ------------------------------------------------------------
+
+static wy_work_t* wy_module_wsq_pop(wy_wsq_t *q)
+{
+    wy_wsq_cell_t* cell;
+    wy_work_t*     w;
+    int            pos = atomic_read(&q->head);
+    int            diff;
+
+    for (;;)
+    {
+        cell = &q->cells[pos & (q->size - 1)];
+        diff = atomic_read_acquire(&cell->seq) - (pos + 1);
+
+        // Cell published for this position, so try to take it
+        if (!diff)
+        {
+            if (atomic_try_cmpxchg(&q->head, &pos, pos + 1))
+            {
+                break;
+            }
+        }
+        // Nothing published yet
+        else if (diff < 0)
+        {
+            return NULL;
+        }
+        // Another popper took it first
+        else
+        {
+            pos = atomic_read(&q->head);
+        }
+    }
+
+    w = cell->item;
+
+    // Free the cell for the push one lap on
+    atomic_set_release(&cell->seq, pos + q->size);
+
+    return w;
+}
+
+// ------------------------------------------------------------
+// Whether the oldest command in a work stealing queue has been
+// published, so that a pop would find it
+// ------------------------------------------------------------
+
+static bool wy_module_wsq_ready(wy_wsq_t *q)
+{
+    int pos = atomic_read(&q->head);
+
+    return atomic_read_acquire(&q->cells[pos & (q->size - 1)].seq) == pos + 1;
+}
+
+// ------------------------------------------------------------
+// Number of commands pushed onto a work stealing queue and not
+// yet popped, which may include pushes still in progress
+// ------------------------------------------------------------
+
+static uint32_t wy_module_wsq_len(wy_wsq_t *q)
+{
+    return atomic_read(&q->tail) - atomic_read(&q->head);
+}
@@ -0,0 +1,220 @@
+//=============================================================
+//
+// Copyright (c) 2023 Simon Southwell. All rights reserved.
+//
+// Date: 17th September 2023
+//
+// This file is part of the kernel module exmaple.
+//
+// The code is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This code is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this code. If not, see <http://www.gnu.org/licenses/>.
+//
+//=============================================================
+
+// ------------------------------------------------------------
+// Command dispatch, per-file queues and the engine of the
+// wy_module driver: the definitions shared by wy_module.c and
+// the user space emulation in emu/. The code is in wy_engine.c
+// ------------------------------------------------------------
+
+#ifndef _WY_ENGINE_H_
+#define _WY_ENGINE_H_
+
+#include <linux/kernel.h>
+#include <linux/cache.h>
+#include <linux/bitops.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/percpu.h>
+#include <linux/percpu-rwsem.h>
+
+#include "wy_core.h"
+
+// ------------------------------------------------------------
+// Definitions
+// ------------------------------------------------------------
+
+// Direction of the user buffer at params.vaddr for a command
+#define WY_DIR_NONE                 0          // vaddr not used
+#define WY_DIR_TO_DEV               1          // Read by the driver
+#define WY_DIR_FROM_DEV             2          // Written by the driver
+#define WY_DIR_BIDIR                (WY_DIR_TO_DEV | WY_DIR_FROM_DEV)
+
+// Maximum engine workers per instance, and the size of each worker's queue (a power of 2)
+#define WY_MAX_WORKERS              64
+#define WY_WSQ_SIZE                 1024
+
+// Commands are enabled by a bit each in wy_config_t.cmd_enable
+static_assert(WY_CMD_NUM <= 32, "too many commands for cmd_enable");
+
+#define WY_CMD_ALL ((uint32_t)(BIT_ULL(WY_CMD_NUM) - 1))
+
+// ------------------------------------------------------------
+// Structure definitions
+// ------------------------------------------------------------
+
+typedef struct wy_file wy_file_t;
+typedef struct wy_dev  wy_dev_t;
+typedef struct wy_ring wy_ring_t;
+
+// A file's command slot. Holds a command deferred to the engine, and then
+// any command's completion until it is read
+typedef struct {
+    wy_file_t*         ctx;
+    struct mm_struct*  mm;         // Submitter's address space, held while deferred
+    params_t           params;
+} wy_work_t;
+
+// Work stealing queue cell. seq tells pushers and poppers whose turn it is
+typedef struct {
+    atomic_t           seq;
+    wy_work_t*         item;
+} wy_wsq_cell_t;
+
+// Work stealing queue of command slots. This is a bounded lock free
+// multi-producer, multi-consumer FIFO (after Vyukov), since submitters on any
+// CPU push to a worker's queue and both the worker and its idle siblings pop.
+// Files' free slots and completions are queued the same way, so that their
+// submitters share them without a lock. The head and tail are on separate
+// cache lines to stop poppers and pushers contending.
+typedef struct {
+    atomic_t           head ____cacheline_aligned_in_smp;
+    atomic_t           tail ____cacheline_aligned_in_smp;
+    wy_wsq_cell_t*     cells;
+    uint32_t           size;       // Number of cells, a power of 2
+} wy_wsq_t;
+
+// Engine worker, run on the instance's unbound workqueue
+typedef struct {
+    struct work_struct work;
+    wy_dev_t*          dev;
+    uint32_t           idx;        // Index of this worker in dev->workers
+    wy_wsq_t           q;
+} wy_worker_t;
+
+// Command handler, returning 0 or a negative errno. The handler may update
+// the params, which are returned in any completion. The file context is
+// NULL for commands issued through the register page doorbell
+typedef int (*wy_handler_t)(wy_dev_t *, wy_file_t *, params_t *);
+
+// Command descriptor, indexed by params.cmd in wy_module_cmds
+typedef struct {
+    const char*   name;
+    uint32_t      dir;        // WY_DIR_xxx direction of the buffer at vaddr
+    bool          may_block;  // Long running, so deferred from defer_threshold bytes
+    wy_handler_t  handler;
+} wy_cmd_t;
+
+// Runtime configuration of an instance, initialised from the module parameters
+// and changed through sysfs. The command path reads it under RCU, and an update
+// replaces it with a new copy, so readers never see a partial change.
+typedef struct {
+    uint32_t        queue_depth;     // Queue depth of newly opened files
+    uint32_t        defer_threshold; // Length from which bulk commands are deferred
+    uint32_t        cq_coalesce;     // Deferred completions queued before waking readers
+    uint32_t        cmd_enable;      // Bit mask of enabled commands, indexed by cmd value
+    struct rcu_head rcu;
+} wy_config_t;
+
+// A CPU's copy of the last parameters written on a file. A write updates the
+// copy of the CPU it runs on, with preemption disabled, so writes on different
+// CPUs share only the generation counter, and read takes the newest whole copy
+typedef struct {
+    seqcount_t         seq;
+    uint64_t           gen;        // Order of the write, or 0 for none
+    params_t           params;
+} wy_last_t;
+
+// Per open file context. Submission takes no lock, so any number of threads
+// may write or ioctl commands on one file at once. A deferred or tagged
+// command takes a slot from free, and its completion is posted in the slot
+// to cq, for read to consume and return the slot. cq_reserved counts commands
+// in flight plus completions not yet read, and is limited to depth, so that a
+// reservation always finds a free slot and room in cq. A reservation is taken
+// holding qlock for reading, and qlock is held for writing to replace the
+// queues, which is only done with none held.
+struct wy_file {
+    wy_dev_t*                  dev;
+    uint32_t                   home;        // Index of this file's home engine worker
+    wy_last_t __percpu*        last;        // Last parameters written on each CPU, returned by read
+    atomic64_t                 last_gen;    // Generation of the latest write
+    struct mutex               lock;        // Serialises ring setup
+    struct mutex               read_lock;   // Serialises completion consumers
+    struct percpu_rw_semaphore qlock;       // Orders reservations with changes of depth
+    spinlock_t                 cq_lock;     // Held by workers waking readers, and by release
+    wait_queue_head_t          cq_wq;
+    atomic_t                   inflight;
+    atomic_t                   cq_reserved;
+    uint32_t                   depth;
+    wy_work_t*                 work;        // Preallocated command slots
+    wy_wsq_t                   free;        // Free slots
+    wy_wsq_t                   cq;          // Completions, in their slots
+    wy_ring_t*                 ring;        // Shared memory rings, once set up
+};
+
+// ------------------------------------------------------------
+// Function prototypes
+// ------------------------------------------------------------
+
+// Prototypes for command functions
+static int         wy_module_exec         (wy_dev_t *,  wy_file_t *,   params_t *);
+static ssize_t     wy_module_cmd_write    (wy_file_t *, const char *,  size_t);
+static ssize_t     wy_module_cmd_read     (wy_file_t *, char *,        size_t, bool);
+static void        wy_module_last_write   (wy_file_t *, const params_t *);
+static void        wy_module_last_read    (wy_file_t *, params_t *);
+
+// Prototypes for file functions
+static int         wy_module_file_init    (wy_file_t *, wy_dev_t *);
+static void        wy_module_file_drain   (wy_file_t *);
+static void        wy_module_file_free    (wy_file_t *);
+
+// Prototypes for deferred command functions
+static int         wy_module_submit       (wy_file_t *, params_t *);
+static void        wy_module_run          (wy_work_t *);
+static ssize_t     wy_module_cpl_read     (wy_file_t *, char *, size_t, bool);
+static int         wy_module_queue_alloc  (wy_file_t *, uint32_t);
+static void        wy_module_queue_free   (wy_file_t *);
+static int         wy_module_set_qdepth   (wy_dev_t *, wy_file_t *, params_t *);
+
+// Prototypes for engine functions
+static int         wy_module_engine_alloc (wy_dev_t *, uint32_t);
+static void        wy_module_engine_free  (wy_dev_t *);
+static void        wy_module_engine_submit(wy_file_t *, wy_work_t *);
+static void        wy_module_engine_work  (struct work_struct *);
+static wy_work_t*  wy_module_engine_steal (wy_worker_t *);
+static void        wy_module_wsq_init     (wy_wsq_t *, wy_wsq_cell_t *, uint32_t);
+static bool        wy_module_wsq_push     (wy_wsq_t *, wy_work_t *);
+static wy_work_t*  wy_module_wsq_pop      (wy_wsq_t *);
+static bool        wy_module_wsq_ready    (wy_wsq_t *);
+static uint32_t    wy_module_wsq_len      (wy_wsq_t *);
+
+// Prototypes for the functions provided by the including file. A build
+// without a command's device support returns -EOPNOTSUPP from its handler
+static int         wy_module_exec_mm      (wy_file_t *, struct mm_struct *, params_t *);
+static int         wy_module_default      (wy_dev_t *,  wy_file_t *,  params_t *);
+static int         wy_module_stream_start (wy_dev_t *,  wy_file_t *,  params_t *);
+static int         wy_module_stream_stop  (wy_dev_t *,  wy_file_t *,  params_t *);
+static int         wy_module_mem_fill     (wy_dev_t *,  wy_file_t *,  params_t *);
+static int         wy_module_csum         (wy_dev_t *,  wy_file_t *,  params_t *);
+static int         wy_module_compress     (wy_dev_t *,  wy_file_t *,  params_t *);
+static int         wy_module_decompress   (wy_dev_t *,  wy_file_t *,  params_t *);
+static int         wy_module_copy         (wy_dev_t *,  wy_file_t *,  params_t *);
+static int         wy_module_flush        (wy_dev_t *,  wy_file_t *,  params_t *);
+
+#endif
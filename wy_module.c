@@ -30,11 +30,44 @@
 #include <linux/kernel.h>
 #include <linux/fs.h>
 #include <linux/uaccess.h>
+#include <linux/kfifo.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/hrtimer.h>
+#include <linux/bitops.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/io.h>
+#include <linux/kthread.h>
+#include <linux/delay.h>
+#include <linux/workqueue.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/cdev.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/crc32c.h>
+#include <linux/xxhash.h>
+#include <linux/lz4.h>
+#include <linux/zstd.h>
+#include <linux/dmaengine.h>
+#include <linux/completion.h>
+#include <linux/highmem.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
 
 // Task specific APIs
 #include <linux/dma-mapping.h>
 #include <asm/cacheflush.h>
 
+// Definitions shared with user space, the core command decoding, and the
+// command dispatch and engine definitions shared with the emulation
+#include "uapi/wy_module.h"
+#include "wy_core.h"
+#include "wy_engine.h"
+
 // ------------------------------------------------------------
 // Definitions
 // ------------------------------------------------------------
@@ -42,6 +75,34 @@
 #define CLASS_NAME  "chardrv"
 #define DEVICE_NAME "wy_module"
 
+// Maximum number of device instances
+#define WY_MAX_INSTANCES            64
+
+// Compression level used for zstd
+#define WY_ZSTD_LEVEL               3
+
+// Default time an SQ poll thread spins idle before sleeping
+#define WY_SQPOLL_IDLE_MS           1000
+
+// Time allowed for a DMA copy to complete
+#define WY_DMA_TIMEOUT_MS           5000
+
+// Copy strategies, chosen per copy from their measured costs
+#define WY_COPY_CPU                 0          // copy_from_user/copy_to_user
+#define WY_COPY_PIN                 1          // Pin the user pages and memcpy through kernel mappings
+#define WY_COPY_DMA                 2          // Pin the user pages and DMA (when there is a channel)
+#define WY_COPY_NUM                 3
+
+// Copy cost model size buckets, one per power of 2 from 1 << WY_COPY_MIN_SHIFT bytes,
+// the number of copies each strategy gets on calibration and the EWMA weight (as a shift)
+#define WY_COPY_MIN_SHIFT           6
+#define WY_COPY_BUCKETS             16
+#define WY_COPY_SAMPLES             4
+#define WY_COPY_EWMA_SHIFT          3
+
+// Stream state flag bits
+#define WY_STREAM_OVERRUN           0          // Producer dropped data since the last read
+
 // ------------------------------------------------------------
 // Set the module configurations
 // ------------------------------------------------------------
@@ -51,6 +112,161 @@ MODULE_AUTHOR("Wyvern Semiconductors");
 MODULE_DESCRIPTION("A simple Linux module.");
 MODULE_VERSION("0.01");
 
+// ------------------------------------------------------------
+// Module parameters
+// ------------------------------------------------------------
+
+static unsigned int stream_fifo_size = 65536;  // Stream FIFO size in bytes (rounded up to a power of 2)
+static unsigned int stream_period_us = 1000;   // Emulated producer period in microseconds
+static unsigned int mem_window_size  = 65536;  // Size of the emulated device memory window in bytes
+static unsigned long regs_phys       = 0;      // Physical address of a real register page (0 = emulated)
+static unsigned int regs_poll_us     = 50;     // Emulated doorbell poll interval in microseconds
+static unsigned int defer_threshold  = 65536;  // Bulk commands of at least this many bytes run on the workqueue
+static unsigned int queue_depth      = 64;     // Default per-file limit on commands in flight plus unread completions
+static unsigned int cq_coalesce      = 1;      // Deferred completions queued before waking readers
+static unsigned int num_instances    = 1;      // Number of device instances, each with its own minor
+static unsigned int max_open         = 1;      // Maximum concurrent opens of each instance
+static unsigned int engine_workers   = 4;      // Engine workers per instance executing deferred commands
+static bool         use_dma          = true;   // Offload copies to a dmaengine memcpy channel, if there is one
+static unsigned int copy_calibrate_ms = 10000; // Interval between recalibrations of the copy cost model
+
+module_param(stream_fifo_size, uint, 0444);
+MODULE_PARM_DESC(stream_fifo_size, "Streaming read FIFO size in bytes");
+module_param(stream_period_us, uint, 0444);
+MODULE_PARM_DESC(stream_period_us, "Streaming producer period in microseconds");
+module_param(mem_window_size, uint, 0444);
+MODULE_PARM_DESC(mem_window_size, "Device memory window size in bytes");
+module_param(regs_phys, ulong, 0444);
+MODULE_PARM_DESC(regs_phys, "Physical address of instance 0's register page, with one page per instance (0 for emulated)");
+module_param(regs_poll_us, uint, 0444);
+MODULE_PARM_DESC(regs_poll_us, "Emulated doorbell poll interval in microseconds");
+module_param(defer_threshold, uint, 0444);
+MODULE_PARM_DESC(defer_threshold, "Initial length in bytes from which bulk commands are deferred to the workqueue");
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Initial per-file queue depth for tagged and deferred commands");
+module_param(cq_coalesce, uint, 0444);
+MODULE_PARM_DESC(cq_coalesce, "Initial number of deferred completions queued before waking readers");
+module_param(num_instances, uint, 0444);
+MODULE_PARM_DESC(num_instances, "Number of device instances");
+module_param(max_open, uint, 0644);
+MODULE_PARM_DESC(max_open, "Maximum number of concurrent opens of each device instance");
+module_param(engine_workers, uint, 0444);
+MODULE_PARM_DESC(engine_workers, "Engine workers per device instance for deferred commands");
+module_param(use_dma, bool, 0444);
+MODULE_PARM_DESC(use_dma, "Offload copy commands to a DMA_MEMCPY capable dmaengine channel when available");
+module_param(copy_calibrate_ms, uint, 0644);
+MODULE_PARM_DESC(copy_calibrate_ms, "Interval in milliseconds between copy strategy recalibrations (0 to calibrate once)");
+
+// ------------------------------------------------------------
+// Internal driver structure definitions
+// ------------------------------------------------------------
+
+// A DMA copy segment, lying within one page of both the user buffer and the window
+typedef struct {
+    dma_addr_t  src;
+    dma_addr_t  dst;
+    uint32_t    len;
+} wy_dma_seg_t;
+
+// Measured costs of the copy strategies for copies in one size range
+typedef struct {
+    uint32_t    cost[WY_COPY_NUM];   // EWMA of ns per byte in 24.8 fixed point, or 0 if unmeasured
+    atomic_t    explore;             // Copies left to cycle through all strategies
+} wy_copy_bucket_t;
+
+// A file's shared memory rings. The mapping holds a wy_ring_hdr_t followed by
+// the SQ and CQ entries. The consumer keeps its own indices and entry counts
+// since user space can write anything to the mapping.
+struct wy_ring {
+    void*               mem;
+    size_t              size;
+    wy_ring_hdr_t*      hdr;
+    params_t*           sqes;
+    params_t*           cqes;
+    uint32_t            sq_entries;
+    uint32_t            cq_entries;
+    uint32_t            sq_head;
+    uint32_t            cq_tail;
+    wy_file_t*          ctx;
+    struct mm_struct*   mm;          // Address space that set the ring up, in which entries run
+    struct work_struct  work;        // Consumer, run on the instance workqueue
+    struct task_struct* sq_task;     // Or the SQ poll thread consumer
+    unsigned long       sq_idle;     // SQ poll idle time in jiffies
+    wait_queue_head_t   sq_wq;       // Flushes waiting on the SQ poll thread
+};
+
+// Device instance context, one per minor number
+struct wy_dev {
+    struct cdev              cdev;
+    struct device*           device;
+    uint32_t                 minor;
+    atomic_t                 open_count;          // Count of opens, limited to max_open
+    uint8_t*                 mem;                 // Emulated device memory window
+    struct workqueue_struct* wq;                  // Workqueue running the engine workers
+
+    // Engine workers executing deferred commands. Each file submits to its home
+    // worker's queue and workers steal from their siblings when their own is empty
+    wy_worker_t*             workers;
+    uint32_t                 nworkers;
+    atomic_t                 next_home;           // Round robin assignment of files to home workers
+    atomic64_t               steals;              // Count of commands executed by a non-home worker
+
+    // Emulated register page and the thread standing in for the device's doorbell
+    // logic. The thread only runs while the page is mapped.
+    wy_regs_t*               regs;
+    struct task_struct*      regs_task;
+    struct mutex             regs_lock;
+
+    // Streaming state. The producer (timer) and the consumer (read) access the FIFO
+    // lock free, as kfifo allows for a single producer and single consumer. Readers
+    // are serialised with stream_lock so there is only ever one consumer. The stream
+    // belongs to the file that started it, whose reads drain the FIFO until the end
+    // of the stream, and which alone may stop it. Once stopped, another file may
+    // start a new stream, taking it over.
+    struct kfifo             stream_fifo;
+    struct hrtimer           stream_timer;
+    wy_file_t*               stream_owner;        // File reading the stream, or NULL
+    uint32_t*                stream_buf;          // A chunk of produced data
+    unsigned long            stream_flags;        // WY_STREAM_xxx bits
+    uint32_t                 stream_chunk;        // Bytes produced per period
+    uint32_t                 stream_seq;          // Next word of the produced data pattern
+    unsigned long            stream_overruns;     // Count of chunks dropped on a full FIFO
+    struct mutex             stream_lock;
+    wait_queue_head_t        stream_wq;
+
+    wy_cmd_stats_t           cmd_stats[WY_CMD_NUM];
+
+    // Live object accounting. With open_count, these all return to zero once
+    // every file is closed, which is checked when the instance is destroyed
+    atomic_t                 live_rings;          // Files' rings
+    atomic_t                 live_deferred;       // Commands submitted to the engine and not yet run
+    atomic_t                 live_cpls;           // Completions queued and not yet read
+
+    // Compression engine workspaces, allocated on first use. The engine is a
+    // single unit, so comp_lock serialises the commands using them
+    struct mutex             comp_lock;
+    void*                    lz4_wrk;
+    void*                    zstd_cws;            // zstd compression context workspace
+    size_t                   zstd_cws_size;
+    void*                    zstd_dws;            // zstd decompression context workspace
+    size_t                   zstd_dws_size;
+    zstd_parameters          zstd_params;
+
+    // DMA memcpy channel for copy commands, or NULL to copy with the CPU.
+    // dma_lock gives each command the channel in turn
+    struct dma_chan*         dma_chan;
+    struct mutex             dma_lock;
+
+    // Copy strategy cost model. Updates from concurrent copies may race,
+    // which only loses samples
+    wy_copy_bucket_t         copy_model[WY_COPY_BUCKETS];
+    struct delayed_work      copy_calib;
+
+    // Runtime configuration, with cfg_lock serialising updaters
+    wy_config_t __rcu*       cfg;
+    struct mutex             cfg_lock;
+};
+
 // ------------------------------------------------------------
 // Device file operation function prototypes
 // ------------------------------------------------------------
@@ -62,6 +278,47 @@ static int         wy_module_open      (struct inode *, struct file *);
 static int         wy_module_release   (struct inode *, struct file *);
 static ssize_t     wy_module_read      (struct file *,  char *, size_t, loff_t *);
 static ssize_t     wy_module_write     (struct file *,  const char *, size_t, loff_t *);
+static loff_t      wy_module_llseek    (struct file *,  loff_t, int);
+static int         wy_module_mmap      (struct file *,  struct vm_area_struct *);
+static long        wy_module_ioctl     (struct file *,  unsigned int, unsigned long);
+
+// Prototypes for device instance functions
+static int         wy_module_dev_create  (wy_dev_t *, uint32_t);
+static void        wy_module_dev_destroy (wy_dev_t *);
+
+// Prototypes for ring functions
+static int         wy_module_ring_setup   (wy_file_t *, wy_ring_setup_t *);
+static void        wy_module_ring_free    (wy_file_t *);
+static void        wy_module_ring_work    (struct work_struct *);
+static int         wy_module_ring_sqpoll  (void *);
+static bool        wy_module_ring_step    (wy_ring_t *);
+static bool        wy_module_ring_ready   (wy_ring_t *);
+static int         wy_module_ring_wake    (wy_ring_t *, bool);
+
+// Prototypes for emulated register functions
+static int         wy_module_regs_poll (void *);
+
+// Prototypes for memory window functions
+static ssize_t     wy_module_mem_read  (wy_dev_t *,     char *,       size_t, loff_t *);
+static ssize_t     wy_module_mem_write (wy_dev_t *,     const char *, size_t, loff_t *);
+
+// Prototypes for compression functions
+static int         wy_module_comp_alloc (wy_dev_t *,     uint32_t, bool);
+
+// Prototypes for copy functions
+static int         wy_module_cpu_copy       (wy_dev_t *,         params_t *,  bool);
+static int         wy_module_pin_copy       (wy_dev_t *,         params_t *,  bool);
+static int         wy_module_dma_copy       (wy_dev_t *,         params_t *,  bool);
+static int         wy_module_dma_run        (wy_dev_t *,         params_t *,  struct page **, wy_dma_seg_t *, uint32_t *, bool);
+static void        wy_module_dma_done       (void *);
+static uint32_t    wy_module_copy_best      (wy_dev_t *,         wy_copy_bucket_t *);
+static void        wy_module_copy_update    (wy_copy_bucket_t *, uint32_t,    u64,           uint32_t);
+static void        wy_module_copy_calibrate (struct work_struct *);
+
+// Prototypes for streaming functions
+static enum hrtimer_restart wy_module_stream_produce (struct hrtimer *);
+static ssize_t     wy_module_stream_read  (struct file *, char *,      size_t);
+static void        wy_module_stream_release(wy_file_t *);
 
 // ------------------------------------------------------------
 // Device file structure configuration
@@ -72,8 +329,14 @@ static struct file_operations fops =
 {
  .read    = wy_module_read,
  .write   = wy_module_write,
+ .llseek  = wy_module_llseek,
+ .mmap    = wy_module_mmap,
  .open    = wy_module_open,
- .release = wy_module_release
+ .release = wy_module_release,
+ .unlocked_ioctl = wy_module_ioctl,
+ // The ioctl arguments have the same layout for 32 and 64 bit user space,
+ // and WY_IOC_FLUSH's flags survive the pointer conversion
+ .compat_ioctl   = compat_ptr_ioctl
 };
 
 // Register initialisation and exit functions
@@ -81,25 +344,200 @@ module_init (wy_module_init);
 module_exit (wy_module_exit);
 
 // ------------------------------------------------------------
-// Internal driver parameter structure definition
+// Static variables
 // ------------------------------------------------------------
 
-// Define a structure for received parameters
-typedef struct {
-    uint32_t  cmd;
-    uint32_t* vaddr;
-    uint32_t  len;
-} params_t;
+static dev_t          wy_module_devt;            // First device number, with the major assigned at initialisation
+static struct class*  wy_module_class;
+static wy_dev_t*      wy_module_devs;            // Device instances, indexed by minor number
+
+// Copy strategy names, indexed by WY_COPY_xxx
+static const char* const wy_module_copy_names[WY_COPY_NUM] = { "cpu", "pin", "dma" };
 
 // ------------------------------------------------------------
-// Static variables
+// Command dispatch table, submission and the engine, shared
+// with the user space emulation
 // ------------------------------------------------------------
 
-static int            wy_module_open_count = 0;  // Count of open instances---we will only allow 1
-static int            wy_module_major_num;       // Storage for major number assigned at initialisation
-static params_t       params;                    // Structure containing driver parameters
-static struct class*  wy_module_class;
-static struct device* wy_module_device;
+#include "wy_engine.c"
+
+// ------------------------------------------------------------
+// Device attributes
+// ------------------------------------------------------------
+
+static ssize_t stream_overruns_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    wy_dev_t* dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "%lu\n", READ_ONCE(dev->stream_overruns));
+}
+
+static ssize_t stream_level_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    wy_dev_t* dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "%u\n", kfifo_len(&dev->stream_fifo));
+}
+
+// One line per command of name, count and error count
+static ssize_t cmd_stats_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    wy_dev_t* dev = dev_get_drvdata(device);
+    ssize_t   len = 0;
+    uint32_t  cmd;
+
+    for (cmd = 0; cmd < WY_CMD_NUM; cmd++)
+    {
+        len += sysfs_emit_at(buf, len, "%-12s %llu %llu\n", wy_module_cmds[cmd].name,
+                             (unsigned long long)atomic64_read(&dev->cmd_stats[cmd].count),
+                             (unsigned long long)atomic64_read(&dev->cmd_stats[cmd].errors));
+    }
+
+    return len;
+}
+
+// Live object counts, as name and value lines
+static ssize_t accounting_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    wy_dev_t* dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "files %d\nrings %d\ndeferred %d\ncompletions %d\n",
+                      atomic_read(&dev->open_count), atomic_read(&dev->live_rings),
+                      atomic_read(&dev->live_deferred), atomic_read(&dev->live_cpls));
+}
+
+static ssize_t engine_steals_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    wy_dev_t* dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "%llu\n", (unsigned long long)atomic64_read(&dev->steals));
+}
+
+// Replace one field of the runtime configuration with a value
+// parsed from buf. Readers see either the old or the new copy
+static ssize_t wy_module_cfg_store(struct device *device, size_t field, uint32_t min, uint32_t max,
+                                   const char *buf, size_t count)
+{
+    wy_dev_t*    dev = dev_get_drvdata(device);
+    wy_config_t* old;
+    wy_config_t* cfg;
+    unsigned int val;
+    int          status;
+
+    status = kstrtouint(buf, 0, &val);
+
+    if (status)
+    {
+        return status;
+    }
+
+    if (val < min || val > max)
+    {
+        return -EINVAL;
+    }
+
+    cfg = kmalloc(sizeof(wy_config_t), GFP_KERNEL);
+
+    if (!cfg)
+    {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&dev->cfg_lock);
+
+    old  = rcu_dereference_protected(dev->cfg, lockdep_is_held(&dev->cfg_lock));
+    *cfg = *old;
+    *(uint32_t*)((char*)cfg + field) = val;
+
+    rcu_assign_pointer(dev->cfg, cfg);
+
+    mutex_unlock(&dev->cfg_lock);
+
+    kfree_rcu(old, rcu);
+
+    return count;
+}
+
+// Define a read/write attribute for a runtime configuration field
+#define WY_CONFIG_ATTR(_field, _fmt, _min, _max)                                                  \
+static ssize_t _field##_show(struct device *device, struct device_attribute *attr, char *buf)    \
+{                                                                                                \
+    wy_dev_t* dev = dev_get_drvdata(device);                                                     \
+    uint32_t  val;                                                                               \
+                                                                                                 \
+    rcu_read_lock();                                                                             \
+    val = rcu_dereference(dev->cfg)->_field;                                                     \
+    rcu_read_unlock();                                                                           \
+                                                                                                 \
+    return sysfs_emit(buf, _fmt "\n", val);                                                      \
+}                                                                                                \
+                                                                                                 \
+static ssize_t _field##_store(struct device *device, struct device_attribute *attr,              \
+                              const char *buf, size_t count)                                     \
+{                                                                                                \
+    return wy_module_cfg_store(device, offsetof(wy_config_t, _field), _min, _max, buf, count);   \
+}                                                                                                \
+                                                                                                 \
+static DEVICE_ATTR_RW(_field)
+
+WY_CONFIG_ATTR(queue_depth,     "%u",   1, WY_MAX_QDEPTH);
+WY_CONFIG_ATTR(defer_threshold, "%u",   0, UINT_MAX);
+WY_CONFIG_ATTR(cq_coalesce,     "%u",   1, WY_MAX_QDEPTH);
+WY_CONFIG_ATTR(cmd_enable,      "%#x",  0, WY_CMD_ALL);
+
+// The engine used by copy commands
+static ssize_t copy_engine_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    wy_dev_t* dev = dev_get_drvdata(device);
+
+    return sysfs_emit(buf, "%s\n", dev->dma_chan ? dma_chan_name(dev->dma_chan) : "cpu");
+}
+
+// One line per copy size bucket of its smallest size, the cost of the cpu,
+// pin and dma strategies in ns per KiB (0 if unmeasured) and the choice
+static ssize_t copy_model_show(struct device *device, struct device_attribute *attr, char *buf)
+{
+    wy_dev_t*         dev = dev_get_drvdata(device);
+    wy_copy_bucket_t* b;
+    ssize_t           len = 0;
+    uint32_t          bucket;
+
+    for (bucket = 0; bucket < WY_COPY_BUCKETS; bucket++)
+    {
+        b    = &dev->copy_model[bucket];
+        len += sysfs_emit_at(buf, len, "%8lu %8u %8u %8u %s\n", 1UL << (bucket + WY_COPY_MIN_SHIFT),
+                             READ_ONCE(b->cost[WY_COPY_CPU]) * 4, READ_ONCE(b->cost[WY_COPY_PIN]) * 4,
+                             READ_ONCE(b->cost[WY_COPY_DMA]) * 4, wy_module_copy_names[wy_module_copy_best(dev, b)]);
+    }
+
+    return len;
+}
+
+static DEVICE_ATTR_RO(stream_overruns);
+static DEVICE_ATTR_RO(stream_level);
+static DEVICE_ATTR_RO(cmd_stats);
+static DEVICE_ATTR_RO(engine_steals);
+static DEVICE_ATTR_RO(accounting);
+static DEVICE_ATTR_RO(copy_engine);
+static DEVICE_ATTR_RO(copy_model);
+
+static struct attribute *wy_module_attrs[] =
+{
+    &dev_attr_stream_overruns.attr,
+    &dev_attr_stream_level.attr,
+    &dev_attr_cmd_stats.attr,
+    &dev_attr_engine_steals.attr,
+    &dev_attr_accounting.attr,
+    &dev_attr_copy_engine.attr,
+    &dev_attr_copy_model.attr,
+    &dev_attr_queue_depth.attr,
+    &dev_attr_defer_threshold.attr,
+    &dev_attr_cq_coalesce.attr,
+    &dev_attr_cmd_enable.attr,
+    NULL
+};
+
+ATTRIBUTE_GROUPS(wy_module);
 
 // ------------------------------------------------------------
 // Module initialisation on loading
@@ -107,20 +545,46 @@ static struct device* wy_module_device;
 
 static int __init wy_module_init(void)
 {
-    // Try to register character device. A first argument of 0 means allocate a major number for us.
-    // This value is returned by the function.
-    wy_module_major_num = register_chrdev(0, "wy_module", &fops);
+    int      status;
+    uint32_t idx;
 
-    // If major number negative, an error occured
-    if (wy_module_major_num < 0)
+    if (!num_instances || num_instances > WY_MAX_INSTANCES)
     {
-        printk(KERN_ALERT "Could not register device: %d\n", wy_module_major_num);
+        printk(KERN_ALERT "wy_module: num_instances must be 1 to %d\n", WY_MAX_INSTANCES);
 
-        return wy_module_major_num;
+        return -EINVAL;
+    }
+
+    if (!engine_workers || engine_workers > WY_MAX_WORKERS)
+    {
+        printk(KERN_ALERT "wy_module: engine_workers must be 1 to %d\n", WY_MAX_WORKERS);
+
+        return -EINVAL;
+    }
+
+    wy_module_devs = kcalloc(num_instances, sizeof(wy_dev_t), GFP_KERNEL);
+
+    if (!wy_module_devs)
+    {
+        return -ENOMEM;
+    }
+
+    // Try to register a range of character device numbers, one minor per instance, with
+    // a major number allocated for us.
+    status = alloc_chrdev_region(&wy_module_devt, 0, num_instances, DEVICE_NAME);
+
+    // If status negative, an error occured
+    if (status < 0)
+    {
+        printk(KERN_ALERT "Could not register device: %d\n", status);
+
+        kfree(wy_module_devs);
+
+        return status;
     }
 
     // Send a message to advertise the assigned major number.
-    printk(KERN_INFO "wy_module module loaded successfully. Major number = %d\n", wy_module_major_num);
+    printk(KERN_INFO "wy_module module loaded successfully. Major number = %d\n", MAJOR(wy_module_devt));
 
     // Register the device class
     wy_module_class = class_create(THIS_MODULE, CLASS_NAME);
@@ -128,7 +592,8 @@ static int __init wy_module_init(void)
     // Check for error and clean up if there is
     if (IS_ERR(wy_module_class))
     {
-        unregister_chrdev(wy_module_major_num, DEVICE_NAME);
+        unregister_chrdev_region(wy_module_devt, num_instances);
+        kfree(wy_module_devs);
 
         printk(KERN_ALERT "Failed to register device class\n");
 
@@ -137,18 +602,27 @@ static int __init wy_module_init(void)
 
     printk(KERN_INFO "wy_module: device class registered correctly\n");
 
-    // Register the device driver
-    wy_module_device = device_create(wy_module_class, NULL, MKDEV(wy_module_major_num, 0), NULL, DEVICE_NAME);
-
-    if (IS_ERR(wy_module_device))
+    // Create each device instance
+    for (idx = 0; idx < num_instances; idx++)
     {
-        // Clean up if there is an error
-        class_destroy(wy_module_class);
-        unregister_chrdev(wy_module_major_num, DEVICE_NAME);
+        status = wy_module_dev_create(&wy_module_devs[idx], idx);
+
+        if (status)
+        {
+            // Clean up if there is an error
+            while (idx--)
+            {
+                wy_module_dev_destroy(&wy_module_devs[idx]);
+            }
 
-        printk(KERN_ALERT "wy_module: Failed to create the device\n");
+            class_destroy(wy_module_class);
+            unregister_chrdev_region(wy_module_devt, num_instances);
+            kfree(wy_module_devs);
 
-        return PTR_ERR(wy_module_device);
+            printk(KERN_ALERT "wy_module: Failed to create the device\n");
+
+            return status;
+        }
     }
 
     printk(KERN_INFO "wy_module: device class created correctly\n");
@@ -161,8 +635,13 @@ static int __init wy_module_init(void)
 
 static void __exit wy_module_exit(void)
 {
-    // Remove the device
-    device_destroy(wy_module_class, MKDEV(wy_module_major_num, 0));
+    uint32_t idx;
+
+    // Remove the devices
+    for (idx = 0; idx < num_instances; idx++)
+    {
+        wy_module_dev_destroy(&wy_module_devs[idx]);
+    }
 
     // Unregister the device class
     class_unregister(wy_module_class);
@@ -170,30 +649,240 @@ static void __exit wy_module_exit(void)
     // Remove the device class
     class_destroy(wy_module_class);
 
-    // Unregister the character device
-    unregister_chrdev(wy_module_major_num, DEVICE_NAME);
+    // Unregister the character device numbers
+    unregister_chrdev_region(wy_module_devt, num_instances);
 
-    // #########################
-    // Put any tidy up code here
-    // #########################
+    kfree(wy_module_devs);
 
     printk(KERN_INFO "Exiting wy_module\n");
 }
 
+// ------------------------------------------------------------
+// Create a device instance with the given minor number
+// ------------------------------------------------------------
+
+static int wy_module_dev_create(wy_dev_t *dev, uint32_t minor)
+{
+    wy_config_t*     cfg;
+    struct dma_chan* chan;
+    dma_cap_mask_t   mask;
+    char         name[32];
+    int          status;
+
+    dev->minor = minor;
+
+    mutex_init(&dev->regs_lock);
+    mutex_init(&dev->stream_lock);
+    mutex_init(&dev->cfg_lock);
+    mutex_init(&dev->comp_lock);
+    mutex_init(&dev->dma_lock);
+    init_waitqueue_head(&dev->stream_wq);
+
+    hrtimer_init(&dev->stream_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    dev->stream_timer.function = wy_module_stream_produce;
+
+    INIT_DELAYED_WORK(&dev->copy_calib, wy_module_copy_calibrate);
+
+    // Allocate the streaming FIFO for the emulated producer
+    status = kfifo_alloc(&dev->stream_fifo, stream_fifo_size, GFP_KERNEL);
+
+    if (status)
+    {
+        printk(KERN_ALERT "wy_module: Failed to allocate stream FIFO: %d\n", status);
+
+        return status;
+    }
+
+    // The producer's staging buffer, for up to a FIFO full
+    dev->stream_buf = kmalloc(kfifo_size(&dev->stream_fifo), GFP_KERNEL);
+
+    // Initial runtime configuration from the module parameters, with all commands enabled
+    cfg = kzalloc(sizeof(wy_config_t), GFP_KERNEL);
+
+    if (cfg)
+    {
+        cfg->queue_depth     = clamp_t(uint32_t, queue_depth, 1, WY_MAX_QDEPTH);
+        cfg->defer_threshold = defer_threshold;
+        cfg->cq_coalesce     = clamp_t(uint32_t, cq_coalesce, 1, WY_MAX_QDEPTH);
+        cfg->cmd_enable      = WY_CMD_ALL;
+
+        RCU_INIT_POINTER(dev->cfg, cfg);
+    }
+
+    // Allocate the emulated device memory window
+    dev->mem = vzalloc(mem_window_size);
+
+    // Look for a memcpy channel for the copy commands, using the CPU if there is none
+    if (use_dma)
+    {
+        dma_cap_zero(mask);
+        dma_cap_set(DMA_MEMCPY, mask);
+
+        chan          = dma_request_chan_by_mask(&mask);
+        dev->dma_chan = IS_ERR(chan) ? NULL : chan;
+    }
+
+    // Allocate the emulated register page, unless mapping a real one
+    if (!regs_phys)
+    {
+        dev->regs = (wy_regs_t*)get_zeroed_page(GFP_KERNEL);
+    }
+
+    // Deferred commands run unbound, with nice level and CPU affinity
+    // configurable from /sys/devices/virtual/workqueue/wy_module<minor>
+    dev->wq = alloc_workqueue("wy_module%u", WQ_UNBOUND | WQ_SYSFS, 0, minor);
+
+    // Allocate the engine workers and their queues
+    status = wy_module_engine_alloc(dev, engine_workers);
+
+    if (!cfg || !dev->stream_buf || !dev->mem || (!regs_phys && !dev->regs) || !dev->wq || status)
+    {
+        printk(KERN_ALERT "wy_module: Failed to allocate device resources\n");
+
+        wy_module_dev_destroy(dev);
+
+        return -ENOMEM;
+    }
+
+    // Calibrate the copy strategies from the first copies, and periodically after
+    queue_delayed_work(dev->wq, &dev->copy_calib, 0);
+
+    // Add the character device for this minor
+    cdev_init(&dev->cdev, &fops);
+    dev->cdev.owner = THIS_MODULE;
+
+    status = cdev_add(&dev->cdev, MKDEV(MAJOR(wy_module_devt), minor), 1);
+
+    if (status)
+    {
+        wy_module_dev_destroy(dev);
+
+        return status;
+    }
+
+    // Register the device, with its status attributes. Instance 0 keeps the original name
+    if (minor)
+    {
+        snprintf(name, sizeof(name), "%s%u", DEVICE_NAME, minor);
+    }
+    else
+    {
+        snprintf(name, sizeof(name), "%s", DEVICE_NAME);
+    }
+
+    dev->device = device_create_with_groups(wy_module_class, NULL, dev->cdev.dev, dev, wy_module_groups, "%s", name);
+
+    if (IS_ERR(dev->device))
+    {
+        status      = PTR_ERR(dev->device);
+        dev->device = NULL;
+
+        wy_module_dev_destroy(dev);
+
+        return status;
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Destroy a device instance, including a partially created one
+// ------------------------------------------------------------
+
+static void wy_module_dev_destroy(wy_dev_t *dev)
+{
+    // Every file is closed, so anything still accounted for has leaked
+    if (atomic_read(&dev->open_count) || atomic_read(&dev->live_rings) ||
+        atomic_read(&dev->live_deferred) || atomic_read(&dev->live_cpls))
+    {
+        printk(KERN_ALERT "wy_module%u: leaked files %d rings %d deferred %d completions %d\n", dev->minor,
+               atomic_read(&dev->open_count), atomic_read(&dev->live_rings),
+               atomic_read(&dev->live_deferred), atomic_read(&dev->live_cpls));
+    }
+
+    // Remove the device and character device
+    if (dev->device)
+    {
+        device_destroy(wy_module_class, dev->cdev.dev);
+    }
+
+    if (dev->cdev.dev)
+    {
+        cdev_del(&dev->cdev);
+    }
+
+    // Stop any streaming and release the FIFO
+    hrtimer_cancel(&dev->stream_timer);
+    kfifo_free(&dev->stream_fifo);
+    kfree(dev->stream_buf);
+
+    // Release the memory window and register page
+    vfree(dev->mem);
+    free_page((unsigned long)dev->regs);
+
+    // All files are closed, and wait for their commands, so none remain
+    if (dev->wq)
+    {
+        cancel_delayed_work_sync(&dev->copy_calib);
+        destroy_workqueue(dev->wq);
+    }
+
+    wy_module_engine_free(dev);
+
+    // Copy commands have all completed, so the channel is idle
+    if (dev->dma_chan)
+    {
+        dma_release_channel(dev->dma_chan);
+    }
+
+    // Release any compression workspaces
+    kvfree(dev->lz4_wrk);
+    kvfree(dev->zstd_cws);
+    kvfree(dev->zstd_dws);
+
+    // No readers remain, the device and files being gone
+    kfree(rcu_dereference_protected(dev->cfg, 1));
+
+    memset(dev, 0, sizeof(wy_dev_t));
+}
+
 // ------------------------------------------------------------
 // Called on opening the device file
 // ------------------------------------------------------------
 
 static int wy_module_open(struct inode *inode, struct file *file)
 {
-    // If device is open, return busy
-    if (wy_module_open_count)
+    wy_dev_t*  dev = container_of(inode->i_cdev, wy_dev_t, cdev);
+    wy_file_t* ctx;
+    int        status;
+
+    // If device is open max_open times, return busy
+    if (!wy_core_credit_get(&dev->open_count, READ_ONCE(max_open)))
     {
         return -EBUSY;
     }
 
-    // Increment the open count
-    wy_module_open_count++;
+    // Allocate the per file context and its queues
+    ctx = kzalloc(sizeof(wy_file_t), GFP_KERNEL);
+
+    if (!ctx)
+    {
+        wy_core_credit_put(&dev->open_count);
+
+        return -ENOMEM;
+    }
+
+    status = wy_module_file_init(ctx, dev);
+
+    if (status)
+    {
+        kfree(ctx);
+        wy_core_credit_put(&dev->open_count);
+
+        return status;
+    }
+
+    file->private_data = ctx;
 
     try_module_get(THIS_MODULE);
 
@@ -206,15 +895,36 @@ static int wy_module_open(struct inode *inode, struct file *file)
 
 static int wy_module_release(struct inode *inode, struct file *file)
 {
-    // Decrement the open counter
-    if (wy_module_open_count)
+    wy_file_t* ctx = file->private_data;
+    wy_dev_t*  dev = ctx->dev;
+
+    // Stop any stream the file started
+    wy_module_stream_release(ctx);
+
+    // Wait for deferred commands to finish
+    wy_module_file_drain(ctx);
+
+    // Any ring mapping held a file open, so the rings are now unmapped
+    wy_module_ring_free(ctx);
+
+    // Discard unread completions
+    wy_module_file_free(ctx);
+    kfree(ctx);
+
+    // Any register page mapping held a file open, so if this is the last
+    // file it is now unmapped and the emulated doorbell logic can stop
+    mutex_lock(&dev->regs_lock);
+
+    if (atomic_read(&dev->open_count) == 1 && dev->regs_task)
     {
-        wy_module_open_count--;
+        kthread_stop(dev->regs_task);
+        dev->regs_task = NULL;
     }
 
-    // #########################
-    // Put any tidy up code here
-    // #########################
+    // Decrement the open counter
+    wy_core_credit_put(&dev->open_count);
+
+    mutex_unlock(&dev->regs_lock);
 
     module_put(THIS_MODULE);
 
@@ -227,37 +937,26 @@ static int wy_module_release(struct inode *inode, struct file *file)
 
 static ssize_t wy_module_write(struct file *fp, const char *buffer, size_t len, loff_t *offset)
 {
-    int   bytes_written = 0;
-    char* paramPtr      = (char*)&params;
+    wy_file_t* ctx = fp->private_data;
 
-    // Expecting exactly the right number of parameter bytes
-    if (len != sizeof(params_t))
+    // Positional writes beyond the command interface go to the memory window
+    if (*offset >= WY_MEM_BASE)
     {
-        return 0;
+        return wy_module_mem_write(ctx->dev, buffer, len, offset);
     }
 
-    // Get the user-land bytes and put in the parameter buffer
-    while (bytes_written < len)
-    {
-        // Use put_user to send message to user domain.
-        get_user(*paramPtr, buffer++);
-        paramPtr++;
-        bytes_written++;
-    }
+    return wy_module_cmd_write(ctx, buffer, len);
+}
 
-    // ######################
-    // Driver write code here
-    // ######################
-    switch(params.cmd)
-    {
+// ------------------------------------------------------------
+// Default command operation
+// ------------------------------------------------------------
 
-        default:
-        printk(KERN_INFO "wy_module write default operation\n");
-    break;
-    }
-    // ######################
+static int wy_module_default(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    printk(KERN_INFO "wy_module write default operation\n");
 
-    return bytes_written;
+    return 0;
 }
 
 // ------------------------------------------------------------
@@ -266,23 +965,1577 @@ static ssize_t wy_module_write(struct file *fp, const char *buffer, size_t len,
 
 static ssize_t wy_module_read(struct file *fp, char *buffer, size_t len, loff_t *offset)
 {
-    int   bytes_read = 0;
-    char* paramPtr    = (char*)&params;
+    wy_file_t* ctx = fp->private_data;
 
-    // Expecting exactly the right number of parameter bytes to be read
-    if (len != sizeof(params_t))
+    // Positional reads beyond the command interface come from the memory window
+    if (*offset >= WY_MEM_BASE)
     {
-        return 0;
+        return wy_module_mem_read(ctx->dev, buffer, len, offset);
     }
 
-    // Put the parameter bytes in the user-land buffer
-    while (bytes_read < len)
+    // When this file is streaming, drain the stream FIFO instead of returning parameters
+    if (READ_ONCE(ctx->dev->stream_owner) == ctx)
     {
-        // Use put_user to send message to user domain.
-        put_user(*paramPtr, buffer++);
-        paramPtr++;
-        bytes_read++;
+        return wy_module_stream_read(fp, buffer, len);
     }
 
-    return bytes_read;
+    return wy_module_cmd_read(ctx, buffer, len, fp->f_flags & O_NONBLOCK);
+}
+
+// ------------------------------------------------------------
+// Device seek operation. The file spans the command interface
+// followed by the memory window, so SEEK_END is the window end
+// ------------------------------------------------------------
+
+static loff_t wy_module_llseek(struct file *fp, loff_t offset, int whence)
+{
+    return fixed_size_llseek(fp, offset, whence, WY_MEM_BASE + mem_window_size);
+}
+
+// ------------------------------------------------------------
+// Execute a command for a file from any context. A kernel thread
+// adopts the given address space for the command, so that it can
+// access a buffer at vaddr
+// ------------------------------------------------------------
+
+static int wy_module_exec_mm(wy_file_t *ctx, struct mm_struct *mm, params_t *p)
+{
+    int status;
+
+    if (!mm || current->mm == mm || !(current->flags & PF_KTHREAD))
+    {
+        return wy_module_exec(ctx->dev, ctx, p);
+    }
+
+    // Fail if the submitter has gone
+    if (!mmget_not_zero(mm))
+    {
+        return -ESRCH;
+    }
+
+    kthread_use_mm(mm);
+
+    status = wy_module_exec(ctx->dev, ctx, p);
+
+    kthread_unuse_mm(mm);
+    mmput(mm);
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// Create a file's rings, to be mapped at WY_RING_OFFSET. Called
+// with ctx->lock held
+// ------------------------------------------------------------
+
+static int wy_module_ring_setup(wy_file_t *ctx, wy_ring_setup_t *setup)
+{
+    wy_ring_t*          ring;
+    struct task_struct* task;
+    ssize_t             bytes = wy_core_ring_layout(setup);
+
+    if (bytes < 0)
+    {
+        return bytes;
+    }
+
+    if ((setup->flags & ~WY_RING_SETUP_SQPOLL) ||
+        (setup->sq_cpu >= 0 && (setup->sq_cpu >= nr_cpu_ids || !cpu_online(setup->sq_cpu))))
+    {
+        return -EINVAL;
+    }
+
+    if (ctx->ring)
+    {
+        return -EBUSY;
+    }
+
+    ring = kzalloc(sizeof(wy_ring_t), GFP_KERNEL);
+
+    if (!ring)
+    {
+        return -ENOMEM;
+    }
+
+    setup->size = PAGE_ALIGN(bytes);
+
+    // Zeroed and suitable for mapping to user space
+    ring->mem = vmalloc_user(setup->size);
+
+    if (!ring->mem)
+    {
+        kfree(ring);
+
+        return -ENOMEM;
+    }
+
+    ring->size       = setup->size;
+    ring->hdr        = ring->mem;
+    ring->sqes       = ring->mem + setup->sq_off;
+    ring->cqes       = ring->mem + setup->cq_off;
+    ring->sq_entries = setup->sq_entries;
+    ring->cq_entries = setup->cq_entries;
+    ring->ctx        = ctx;
+    ring->mm         = current->mm;
+
+    mmgrab(ring->mm);
+
+    INIT_WORK(&ring->work, wy_module_ring_work);
+    init_waitqueue_head(&ring->sq_wq);
+
+    // The consumer starts idle
+    ring->hdr->flags = WY_RING_NEED_WAKEUP;
+
+    // Start any SQ poll thread, which then sleeps until the first flush
+    if (setup->flags & WY_RING_SETUP_SQPOLL)
+    {
+        ring->sq_idle = msecs_to_jiffies(setup->sq_idle_ms ? setup->sq_idle_ms : WY_SQPOLL_IDLE_MS);
+        task          = kthread_create(wy_module_ring_sqpoll, ring, "wy_module_sq%u", ctx->dev->minor);
+
+        if (IS_ERR(task))
+        {
+            mmdrop(ring->mm);
+            vfree(ring->mem);
+            kfree(ring);
+
+            return PTR_ERR(task);
+        }
+
+        if (setup->sq_cpu >= 0)
+        {
+            kthread_bind(task, setup->sq_cpu);
+        }
+
+        ring->sq_task = task;
+
+        wake_up_process(task);
+    }
+
+    // Flushes and mmap find the ring without taking ctx->lock
+    smp_store_release(&ctx->ring, ring);
+    atomic_inc(&ctx->dev->live_rings);
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Free a file's rings, which must no longer be mapped
+// ------------------------------------------------------------
+
+static void wy_module_ring_free(wy_file_t *ctx)
+{
+    wy_ring_t* ring = ctx->ring;
+
+    if (!ring)
+    {
+        return;
+    }
+
+    if (ring->sq_task)
+    {
+        kthread_stop(ring->sq_task);
+    }
+
+    cancel_work_sync(&ring->work);
+
+    mmdrop(ring->mm);
+    vfree(ring->mem);
+    kfree(ring);
+
+    ctx->ring = NULL;
+    atomic_dec(&ctx->dev->live_rings);
+}
+
+// ------------------------------------------------------------
+// Ring consumer. Executes SQ entries in order, posting each one's
+// completion to the CQ, until the SQ is empty or the CQ full, and
+// then flags that it needs waking. Work items do not run
+// concurrently with themselves, so there is one consumer
+// ------------------------------------------------------------
+
+static void wy_module_ring_work(struct work_struct *work)
+{
+    wy_ring_t*     ring = container_of(work, wy_ring_t, work);
+    wy_ring_hdr_t* hdr  = ring->hdr;
+
+    // Run the whole batch in the address space that set up the ring
+    if (!mmget_not_zero(ring->mm))
+    {
+        return;
+    }
+
+    kthread_use_mm(ring->mm);
+
+    WRITE_ONCE(hdr->flags, 0);
+
+    for (;;)
+    {
+        if (wy_module_ring_step(ring))
+        {
+            cond_resched();
+            continue;
+        }
+
+        // Going idle, so flag that a flush is needed and look again. The barrier
+        // pairs with the one user space makes between writing sq_tail and reading
+        // flags, so either the new entries are seen here or the flag is seen there
+        WRITE_ONCE(hdr->flags, WY_RING_NEED_WAKEUP);
+        smp_mb();
+
+        if (!wy_module_ring_ready(ring))
+        {
+            break;
+        }
+
+        WRITE_ONCE(hdr->flags, 0);
+    }
+
+    kthread_unuse_mm(ring->mm);
+    mmput(ring->mm);
+}
+
+// ------------------------------------------------------------
+// SQ poll thread consumer. Polls the SQ for as long as entries
+// keep arriving within the idle time, so that a busy producer
+// makes no system calls at all. Once idle it sleeps, with
+// WY_RING_NEED_WAKEUP set, until a flush or until stopped when
+// the file is released
+// ------------------------------------------------------------
+
+static int wy_module_ring_sqpoll(void *data)
+{
+    wy_ring_t*     ring    = data;
+    wy_ring_hdr_t* hdr     = ring->hdr;
+    unsigned long  timeout = jiffies + ring->sq_idle;
+    bool           has_mm  = false;
+    bool           mm_live = true;
+
+    while (!kthread_should_stop())
+    {
+        // The ring's address space is only held whilst polling. Holding it
+        // whilst idle would stop an exiting owner from tearing it down, and
+        // so from unmapping the rings and releasing the file, which is what
+        // stops this thread. Once it has gone it cannot come back
+        if (!has_mm && mm_live)
+        {
+            mm_live = has_mm = mmget_not_zero(ring->mm);
+
+            if (has_mm)
+            {
+                kthread_use_mm(ring->mm);
+            }
+        }
+
+        if (has_mm && wy_module_ring_step(ring))
+        {
+            timeout = jiffies + ring->sq_idle;
+
+            if (wq_has_sleeper(&ring->sq_wq))
+            {
+                wake_up_all(&ring->sq_wq);
+            }
+
+            cond_resched();
+            continue;
+        }
+
+        // Nothing to do, but keep polling until the idle time has passed
+        if (has_mm && time_before(jiffies, timeout))
+        {
+            cond_resched();
+            cpu_relax();
+            continue;
+        }
+
+        // Going idle, so let the address space go. mmput may sleep, so this
+        // is done before setting the task state
+        if (has_mm)
+        {
+            kthread_unuse_mm(ring->mm);
+            mmput(ring->mm);
+
+            has_mm = false;
+        }
+
+        // The task state is set first so that a flush's wake up between
+        // setting the flag and sleeping is not lost
+        set_current_state(TASK_INTERRUPTIBLE);
+
+        WRITE_ONCE(hdr->flags, WY_RING_NEED_WAKEUP);
+        smp_mb();
+
+        wake_up_all(&ring->sq_wq);
+
+        if (mm_live && wy_module_ring_ready(ring))
+        {
+            __set_current_state(TASK_RUNNING);
+        }
+        else if (!kthread_should_stop())
+        {
+            schedule();
+        }
+
+        __set_current_state(TASK_RUNNING);
+
+        WRITE_ONCE(hdr->flags, 0);
+
+        timeout = jiffies + ring->sq_idle;
+    }
+
+    if (has_mm)
+    {
+        kthread_unuse_mm(ring->mm);
+        mmput(ring->mm);
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Execute the next SQ entry, if there is one and room for its
+// completion, returning whether there was. Called in the
+// address space that set up the ring
+// ------------------------------------------------------------
+
+static bool wy_module_ring_step(wy_ring_t *ring)
+{
+    wy_file_t*     ctx = ring->ctx;
+    wy_ring_hdr_t* hdr = ring->hdr;
+    params_t       p;
+
+    if (!wy_module_ring_ready(ring))
+    {
+        return false;
+    }
+
+    // Take a copy of the entry, which user space could change under us
+    memcpy(&p, &ring->sqes[wy_core_ring_slot(ring->sq_head, ring->sq_entries)], sizeof(params_t));
+    smp_store_release(&hdr->sq_head, ++ring->sq_head);
+
+    // Runs alongside written commands, as submissions do
+    p.status = wy_core_params_ok(&p) ? wy_module_exec(ctx->dev, ctx, &p) : -EINVAL;
+
+    ring->cqes[wy_core_ring_slot(ring->cq_tail, ring->cq_entries)] = p;
+    smp_store_release(&hdr->cq_tail, ++ring->cq_tail);
+
+    return true;
+}
+
+// ------------------------------------------------------------
+// Whether the ring consumer has an SQ entry to execute and room
+// for its completion
+// ------------------------------------------------------------
+
+static bool wy_module_ring_ready(wy_ring_t *ring)
+{
+    return wy_core_ring_ready(ring->sq_head, smp_load_acquire(&ring->hdr->sq_tail), ring->sq_entries,
+                              smp_load_acquire(&ring->hdr->cq_head), ring->cq_tail, ring->cq_entries);
+}
+
+// ------------------------------------------------------------
+// Flush command. Wakes the file's ring consumer
+// ------------------------------------------------------------
+
+static int wy_module_flush(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    wy_ring_t* ring = ctx ? smp_load_acquire(&ctx->ring) : NULL;
+
+    if (!ring)
+    {
+        return -ENXIO;
+    }
+
+    return wy_module_ring_wake(ring, false);
+}
+
+// ------------------------------------------------------------
+// Wake a ring's consumer and, if wait is set, wait until the SQ
+// entries submitted so far have been consumed, or until it has
+// gone idle without being able to consume them (as when the CQ
+// is full). Only the address space that set up the ring, in
+// which its entries run, may wake it
+// ------------------------------------------------------------
+
+static int wy_module_ring_wake(wy_ring_t *ring, bool wait)
+{
+    uint32_t tail;
+
+    if (current->mm != ring->mm)
+    {
+        return -EPERM;
+    }
+
+    tail = smp_load_acquire(&ring->hdr->sq_tail);
+
+    if (!ring->sq_task)
+    {
+        queue_work(ring->ctx->dev->wq, &ring->work);
+
+        // The work consumer runs until idle
+        if (wait)
+        {
+            flush_work(&ring->work);
+        }
+
+        return 0;
+    }
+
+    wake_up_process(ring->sq_task);
+
+    if (!wait)
+    {
+        return 0;
+    }
+
+    // Every SQ entry gets a CQ entry, so the two indices move together. The
+    // flag may still be set from before the wake up, so it only counts once
+    // the consumer can make no progress
+    if (wait_event_interruptible(ring->sq_wq, (int32_t)(READ_ONCE(ring->cq_tail) - tail) >= 0 ||
+                                              ((READ_ONCE(ring->hdr->flags) & WY_RING_NEED_WAKEUP) &&
+                                               !wy_module_ring_ready(ring))))
+    {
+        return -ERESTARTSYS;
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Device ioctl operation
+// ------------------------------------------------------------
+
+static long wy_module_ioctl(struct file *fp, unsigned int cmd, unsigned long arg)
+{
+    wy_file_t*      ctx = fp->private_data;
+    wy_ring_setup_t setup;
+    wy_ring_t*      ring;
+    params_t        p;
+    long            status;
+
+    switch (cmd)
+    {
+    case WY_IOC_RING_SETUP:
+        if (copy_from_user(&setup, (void*)arg, sizeof(wy_ring_setup_t)))
+        {
+            return -EFAULT;
+        }
+
+        mutex_lock(&ctx->lock);
+        status = wy_module_ring_setup(ctx, &setup);
+        mutex_unlock(&ctx->lock);
+
+        if (!status && copy_to_user((void*)arg, &setup, sizeof(wy_ring_setup_t)))
+        {
+            status = -EFAULT;
+        }
+
+        return status;
+
+    case WY_IOC_FLUSH:
+        ring = smp_load_acquire(&ctx->ring);
+
+        if (!ring)
+        {
+            return -ENXIO;
+        }
+
+        return wy_module_ring_wake(ring, arg & WY_FLUSH_WAIT);
+
+    case WY_IOC_CMD:
+        // As a write of the whole params_t and read back, in one call
+        if (copy_from_user(&p, (void*)arg, sizeof(params_t)))
+        {
+            return -EFAULT;
+        }
+
+        status = wy_module_submit(ctx, &p);
+
+        if (copy_to_user((void*)arg, &p, sizeof(params_t)))
+        {
+            return -EFAULT;
+        }
+
+        return status;
+
+    default:
+        return -ENOTTY;
+    }
+}
+
+// ------------------------------------------------------------
+// Device mmap operation. Maps the register page at offset 0 so
+// that a doorbell is a single store, or the file's rings at
+// WY_RING_OFFSET. The mapping holds the file open, so it is
+// covered by the same open limit as the file
+// ------------------------------------------------------------
+
+static int wy_module_mmap(struct file *fp, struct vm_area_struct *vma)
+{
+    wy_file_t*    ctx  = fp->private_data;
+    wy_dev_t*     dev  = ctx->dev;
+    wy_ring_t*    ring;
+    unsigned long size = vma->vm_end - vma->vm_start;
+    int           status;
+
+    if (vma->vm_pgoff == WY_RING_OFFSET >> PAGE_SHIFT)
+    {
+        ring = smp_load_acquire(&ctx->ring);
+
+        if (!ring || size != ring->size)
+        {
+            return -EINVAL;
+        }
+
+        // The ring's entries run in the address space that set it up, so it
+        // may only be mapped there, and is not inherited over fork
+        if (current->mm != ring->mm)
+        {
+            return -EPERM;
+        }
+
+        vm_flags_set(vma, VM_DONTCOPY);
+
+        return remap_vmalloc_range(vma, ring->mem, 0);
+    }
+
+    // Otherwise only the single register page can be mapped
+    if (vma->vm_pgoff != WY_REGS_OFFSET >> PAGE_SHIFT || size != PAGE_SIZE)
+    {
+        return -EINVAL;
+    }
+
+    // Real device registers are mapped uncached. Emulated ones are ordinary memory
+    if (regs_phys)
+    {
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+
+        return io_remap_pfn_range(vma, vma->vm_start, (regs_phys >> PAGE_SHIFT) + dev->minor, size, vma->vm_page_prot);
+    }
+
+    status = remap_pfn_range(vma, vma->vm_start, virt_to_phys(dev->regs) >> PAGE_SHIFT, size, vma->vm_page_prot);
+
+    if (status)
+    {
+        return status;
+    }
+
+    // Start the emulated doorbell logic if not already running
+    mutex_lock(&dev->regs_lock);
+
+    if (!dev->regs_task)
+    {
+        dev->regs_task = kthread_run(wy_module_regs_poll, dev, "wy_module_regs%u", dev->minor);
+
+        if (IS_ERR(dev->regs_task))
+        {
+            status         = PTR_ERR(dev->regs_task);
+            dev->regs_task = NULL;
+        }
+    }
+
+    mutex_unlock(&dev->regs_lock);
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// Emulated doorbell logic. Polls the doorbell register and
+// executes the command registers each time it changes
+// ------------------------------------------------------------
+
+static int wy_module_regs_poll(void *data)
+{
+    wy_dev_t*  dev  = data;
+    wy_regs_t* regs = dev->regs;
+    params_t   p;
+    uint32_t   doorbell;
+    uint32_t   last = READ_ONCE(regs->doorbell);
+
+    while (!kthread_should_stop())
+    {
+        doorbell = READ_ONCE(regs->doorbell);
+
+        if (doorbell == last)
+        {
+            usleep_range(regs_poll_us, regs_poll_us * 2);
+            continue;
+        }
+
+        last = doorbell;
+
+        // Command registers are read only after seeing the doorbell. There is
+        // no file or user context, so wy_module_exec fails any command with a
+        // user buffer direction with -EFAULT
+        smp_rmb();
+
+        memset(&p, 0, sizeof(p));
+        p.cmd = READ_ONCE(regs->cmd);
+        p.len = READ_ONCE(regs->len);
+
+        WRITE_ONCE(regs->status, wy_module_exec(dev, NULL, &p));
+
+        // Status is visible before completion is signalled
+        smp_wmb();
+        WRITE_ONCE(regs->done, doorbell);
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Memory window read, from file offset *offset. Accesses are
+// unsynchronised, as they would be for real device memory
+// ------------------------------------------------------------
+
+static ssize_t wy_module_mem_read(wy_dev_t *dev, char *buffer, size_t len, loff_t *offset)
+{
+    loff_t pos = *offset - WY_MEM_BASE;
+
+    // Reading at or beyond the end of the window is end of file
+    if (pos >= mem_window_size)
+    {
+        return 0;
+    }
+
+    len = min_t(size_t, len, mem_window_size - pos);
+
+    if (copy_to_user(buffer, dev->mem + pos, len))
+    {
+        return -EFAULT;
+    }
+
+    *offset += len;
+
+    return len;
+}
+
+// ------------------------------------------------------------
+// Memory window write, to file offset *offset
+// ------------------------------------------------------------
+
+static ssize_t wy_module_mem_write(wy_dev_t *dev, const char *buffer, size_t len, loff_t *offset)
+{
+    loff_t pos = *offset - WY_MEM_BASE;
+
+    if (pos >= mem_window_size)
+    {
+        return -ENOSPC;
+    }
+
+    len = min_t(size_t, len, mem_window_size - pos);
+
+    if (copy_from_user(dev->mem + pos, buffer, len))
+    {
+        return -EFAULT;
+    }
+
+    *offset += len;
+
+    return len;
+}
+
+// ------------------------------------------------------------
+// Fill the first len bytes of the memory window with an
+// incrementing word pattern
+// ------------------------------------------------------------
+
+static int wy_module_mem_fill(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    uint32_t* mem = (uint32_t*)dev->mem;
+    uint32_t  len = p->len;
+    uint32_t  idx;
+
+    if (len > mem_window_size || (len % sizeof(uint32_t)))
+    {
+        return -EINVAL;
+    }
+
+    for (idx = 0; idx < len / sizeof(uint32_t); idx++)
+    {
+        mem[idx] = idx;
+
+        // Bulk fills can be long, so give up the CPU every page
+        if (!((idx + 1) % (PAGE_SIZE / sizeof(uint32_t))))
+        {
+            cond_resched();
+        }
+    }
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Checksum params.len bytes, at vaddr or, when vaddr is 0,
+// at offset in the memory window. The kernel's CRC32C and
+// xxHash libraries pick up any accelerated implementation, and
+// manage the FPU state themselves. The window is summed in place
+// whilst user data goes a page at a time via a bounce buffer.
+// CRC32C is seeded and finalised by inversion, so a zero seed
+// gives the standard CRC and a previous result continues it.
+// ------------------------------------------------------------
+
+static int wy_module_csum(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    struct xxh64_state state;
+    const uint8_t*     src;
+    uint8_t*           bounce = NULL;
+    uint32_t           crc    = ~p->seed;
+    uint32_t           done;
+    uint32_t           chunk;
+
+    if (p->vaddr)
+    {
+        bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+
+        if (!bounce)
+        {
+            return -ENOMEM;
+        }
+    }
+    else if (!wy_core_window_ok(p->offset, p->len, mem_window_size))
+    {
+        return -EINVAL;
+    }
+
+    xxh64_reset(&state, p->seed);
+
+    for (done = 0; done < p->len; done += chunk)
+    {
+        chunk = min_t(uint32_t, p->len - done, PAGE_SIZE);
+
+        if (bounce)
+        {
+            if (copy_from_user(bounce, (const uint8_t*)u64_to_user_ptr(p->vaddr) + done, chunk))
+            {
+                kfree(bounce);
+
+                return -EFAULT;
+            }
+
+            src = bounce;
+        }
+        else
+        {
+            src = dev->mem + p->offset + done;
+        }
+
+        if (p->cmd == WY_CMD_CRC32C)
+        {
+            crc = crc32c(crc, src, chunk);
+        }
+        else
+        {
+            xxh64_update(&state, src, chunk);
+        }
+
+        cond_resched();
+    }
+
+    kfree(bounce);
+
+    p->result = p->cmd == WY_CMD_CRC32C ? (uint64_t)~crc : xxh64_digest(&state);
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Compress params.len bytes at vaddr into the memory window at
+// params.offset, as a header followed by the compressed data.
+// params.result returns the frame length, header included
+// ------------------------------------------------------------
+
+static int wy_module_compress(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    wy_comp_hdr_t hdr;
+    uint8_t*      src;
+    uint8_t*      dst;
+    size_t        cap;
+    size_t        clen   = 0;
+    int           status;
+
+    if (!wy_core_window_ok(p->offset, sizeof(wy_comp_hdr_t), mem_window_size) || p->len > mem_window_size)
+    {
+        return -EINVAL;
+    }
+
+    dst = dev->mem + p->offset + sizeof(wy_comp_hdr_t);
+    cap = mem_window_size - p->offset - sizeof(wy_comp_hdr_t);
+
+    src = kvmalloc(p->len, GFP_KERNEL);
+
+    if (!src)
+    {
+        return -ENOMEM;
+    }
+
+    if (copy_from_user(src, u64_to_user_ptr(p->vaddr), p->len))
+    {
+        kvfree(src);
+
+        return -EFAULT;
+    }
+
+    mutex_lock(&dev->comp_lock);
+
+    status = wy_module_comp_alloc(dev, p->algo, true);
+
+    // Failing for lack of space is the only error on valid input. The
+    // checks of the configuration, which comp_alloc has also made, leave
+    // no call to a library that is not built
+    if (!status && p->algo == WY_ALGO_LZ4 && IS_ENABLED(CONFIG_LZ4_COMPRESS))
+    {
+        clen   = LZ4_compress_default((const char*)src, (char*)dst, p->len, cap, dev->lz4_wrk);
+        status = clen ? 0 : -ENOSPC;
+    }
+    else if (!status && p->algo == WY_ALGO_ZSTD && IS_ENABLED(CONFIG_ZSTD_COMPRESS))
+    {
+        clen   = zstd_compress_cctx(zstd_init_cctx(dev->zstd_cws, dev->zstd_cws_size),
+                                    dst, cap, src, p->len, &dev->zstd_params);
+        status = zstd_is_error(clen) ? -ENOSPC : 0;
+    }
+
+    mutex_unlock(&dev->comp_lock);
+
+    kvfree(src);
+
+    if (status)
+    {
+        return status;
+    }
+
+    hdr.magic  = WY_COMP_MAGIC;
+    hdr.algo   = p->algo;
+    hdr.rawlen = p->len;
+    hdr.clen   = clen;
+
+    // Offsets need not be aligned
+    memcpy(dev->mem + p->offset, &hdr, sizeof(wy_comp_hdr_t));
+
+    p->result = sizeof(wy_comp_hdr_t) + clen;
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Decompress the frame in the memory window at params.offset to
+// vaddr, which has room for params.len bytes. params.result
+// returns the decompressed length
+// ------------------------------------------------------------
+
+static int wy_module_decompress(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    wy_comp_hdr_t hdr;
+    uint8_t*      dst;
+    size_t        rawlen = 0;
+    int           status = 0;
+
+    if (!wy_core_window_ok(p->offset, sizeof(wy_comp_hdr_t), mem_window_size))
+    {
+        return -EINVAL;
+    }
+
+    memcpy(&hdr, dev->mem + p->offset, sizeof(wy_comp_hdr_t));
+
+    // The window is writable by user space, so trust nothing in the header
+    if (hdr.magic != WY_COMP_MAGIC || hdr.clen > mem_window_size - p->offset - sizeof(wy_comp_hdr_t) ||
+        hdr.rawlen > mem_window_size)
+    {
+        return -EINVAL;
+    }
+
+    if (hdr.rawlen > p->len)
+    {
+        return -ENOSPC;
+    }
+
+    dst = kvmalloc(hdr.rawlen, GFP_KERNEL);
+
+    if (!dst)
+    {
+        return -ENOMEM;
+    }
+
+    if (hdr.algo == WY_ALGO_LZ4 && IS_ENABLED(CONFIG_LZ4_DECOMPRESS))
+    {
+        rawlen = max_t(int, LZ4_decompress_safe((const char*)dev->mem + p->offset + sizeof(wy_comp_hdr_t),
+                                                (char*)dst, hdr.clen, hdr.rawlen), 0);
+    }
+    else if (hdr.algo == WY_ALGO_ZSTD && IS_ENABLED(CONFIG_ZSTD_DECOMPRESS))
+    {
+        mutex_lock(&dev->comp_lock);
+
+        status = wy_module_comp_alloc(dev, hdr.algo, false);
+
+        if (!status)
+        {
+            rawlen = zstd_decompress_dctx(zstd_init_dctx(dev->zstd_dws, dev->zstd_dws_size), dst, hdr.rawlen,
+                                          dev->mem + p->offset + sizeof(wy_comp_hdr_t), hdr.clen);
+            rawlen = zstd_is_error(rawlen) ? 0 : rawlen;
+        }
+
+        mutex_unlock(&dev->comp_lock);
+    }
+    else
+    {
+        status = -EOPNOTSUPP;
+    }
+
+    // Corrupt data either fails or decompresses to the wrong length
+    if (status >= 0 && rawlen != hdr.rawlen)
+    {
+        status = -EILSEQ;
+    }
+    else if (status >= 0 && copy_to_user(u64_to_user_ptr(p->vaddr), dst, rawlen))
+    {
+        status = -EFAULT;
+    }
+
+    kvfree(dst);
+
+    if (status < 0)
+    {
+        return status;
+    }
+
+    p->result = rawlen;
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Allocate the workspace for compressing or decompressing with
+// an algorithm, if not already allocated. Called with comp_lock
+// held. Operations not built into the kernel are unsupported
+// ------------------------------------------------------------
+
+static int wy_module_comp_alloc(wy_dev_t *dev, uint32_t algo, bool compress)
+{
+    if (algo == WY_ALGO_LZ4 && compress && IS_ENABLED(CONFIG_LZ4_COMPRESS))
+    {
+        if (!dev->lz4_wrk)
+        {
+            dev->lz4_wrk = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+        }
+
+        return dev->lz4_wrk ? 0 : -ENOMEM;
+    }
+
+    if (algo == WY_ALGO_ZSTD && compress && IS_ENABLED(CONFIG_ZSTD_COMPRESS))
+    {
+        // Parameters for the largest input, which suit any smaller one
+        if (!dev->zstd_cws)
+        {
+            dev->zstd_params   = zstd_get_params(WY_ZSTD_LEVEL, mem_window_size);
+            dev->zstd_cws_size = zstd_cctx_workspace_bound(&dev->zstd_params.cParams);
+            dev->zstd_cws      = kvmalloc(dev->zstd_cws_size, GFP_KERNEL);
+        }
+
+        return dev->zstd_cws ? 0 : -ENOMEM;
+    }
+
+    if (algo == WY_ALGO_ZSTD && !compress && IS_ENABLED(CONFIG_ZSTD_DECOMPRESS))
+    {
+        if (!dev->zstd_dws)
+        {
+            dev->zstd_dws_size = zstd_dctx_workspace_bound();
+            dev->zstd_dws      = kvmalloc(dev->zstd_dws_size, GFP_KERNEL);
+        }
+
+        return dev->zstd_dws ? 0 : -ENOMEM;
+    }
+
+    return -EOPNOTSUPP;
+}
+
+// ------------------------------------------------------------
+// Copy params.len bytes between vaddr and the memory window at
+// params.offset. The strategy is the one measured cheapest for
+// copies of about this size, except whilst calibrating, when
+// copies cycle through all of them. A user copy is the fallback
+// when another strategy fails
+// ------------------------------------------------------------
+
+static int wy_module_copy(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    bool              to_dev = p->cmd == WY_CMD_COPY_TO_DEV;
+    uint32_t          nways  = dev->dma_chan ? WY_COPY_NUM : WY_COPY_DMA;
+    wy_copy_bucket_t* b;
+    uint32_t          how;
+    u64               start;
+    int               explore;
+    int               status;
+
+    if (!wy_core_window_ok(p->offset, p->len, mem_window_size))
+    {
+        return -EINVAL;
+    }
+
+    if (!p->len)
+    {
+        return 0;
+    }
+
+    // Unlike the checksums, a copy has no use for a vaddr of 0, and without
+    // an address space, as for the doorbell thread, there is nothing to pin
+    if (!ctx || !current->mm)
+    {
+        return -EFAULT;
+    }
+
+    b       = &dev->copy_model[clamp_t(int, ilog2(p->len), WY_COPY_MIN_SHIFT,
+                                       WY_COPY_MIN_SHIFT + WY_COPY_BUCKETS - 1) - WY_COPY_MIN_SHIFT];
+    explore = atomic_dec_if_positive(&b->explore);
+    how     = explore >= 0 ? explore % nways : wy_module_copy_best(dev, b);
+    start   = ktime_get_ns();
+
+    if (how == WY_COPY_DMA)
+    {
+        status = wy_module_dma_copy(dev, p, to_dev);
+    }
+    else if (how == WY_COPY_PIN)
+    {
+        status = wy_module_pin_copy(dev, p, to_dev);
+    }
+    else
+    {
+        status = wy_module_cpu_copy(dev, p, to_dev);
+    }
+
+    if (!status)
+    {
+        wy_module_copy_update(b, how, ktime_get_ns() - start, p->len);
+    }
+    else if (how != WY_COPY_CPU)
+    {
+        // Pages that cannot be pinned, as in VM_IO or VM_PFNMAP mappings, or a
+        // failed transfer, must not fail a copy that a user copy can do. The
+        // model is left alone, as the failed strategy's cost is unknown
+        status = wy_module_cpu_copy(dev, p, to_dev);
+    }
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// Copy with copy_from_user or copy_to_user
+// ------------------------------------------------------------
+
+static int wy_module_cpu_copy(wy_dev_t *dev, params_t *p, bool to_dev)
+{
+    if (to_dev)
+    {
+        return copy_from_user(dev->mem + p->offset, u64_to_user_ptr(p->vaddr), p->len) ? -EFAULT : 0;
+    }
+
+    return copy_to_user(u64_to_user_ptr(p->vaddr), dev->mem + p->offset, p->len) ? -EFAULT : 0;
+}
+
+// ------------------------------------------------------------
+// Copy by pinning the user buffer and copying each page through
+// a temporary kernel mapping. This avoids the per-access fault
+// handling of a user copy at the cost of the pinning
+// ------------------------------------------------------------
+
+static int wy_module_pin_copy(wy_dev_t *dev, params_t *p, bool to_dev)
+{
+    struct page**  pages;
+    unsigned long  uaddr  = (unsigned long)p->vaddr;
+    int            npages = DIV_ROUND_UP(offset_in_page(uaddr) + p->len, PAGE_SIZE);
+    int            pinned;
+    uint8_t*       kaddr;
+    uint32_t       pos;
+    uint32_t       uoff;
+    uint32_t       chunk;
+    int            status = 0;
+
+    pages = kvmalloc_array(npages, sizeof(struct page*), GFP_KERNEL);
+
+    if (!pages)
+    {
+        return -ENOMEM;
+    }
+
+    pinned = pin_user_pages_fast(uaddr & PAGE_MASK, npages, to_dev ? 0 : FOLL_WRITE, pages);
+
+    if (pinned != npages)
+    {
+        status = -EFAULT;
+    }
+
+    for (pos = 0; !status && pos < p->len; pos += chunk)
+    {
+        uoff  = offset_in_page(uaddr + pos);
+        chunk = min_t(uint32_t, p->len - pos, PAGE_SIZE - uoff);
+        kaddr = kmap_local_page(pages[(offset_in_page(uaddr) + pos) >> PAGE_SHIFT]);
+
+        if (to_dev)
+        {
+            memcpy(dev->mem + p->offset + pos, kaddr + uoff, chunk);
+        }
+        else
+        {
+            memcpy(kaddr + uoff, dev->mem + p->offset + pos, chunk);
+        }
+
+        kunmap_local(kaddr);
+    }
+
+    if (pinned > 0)
+    {
+        unpin_user_pages_dirty_lock(pages, pinned, !to_dev && !status);
+    }
+
+    kvfree(pages);
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// The cheapest available copy strategy for a size bucket. An
+// unmeasured strategy counts as cheapest, so that it is tried
+// ------------------------------------------------------------
+
+static uint32_t wy_module_copy_best(wy_dev_t *dev, wy_copy_bucket_t *b)
+{
+    uint32_t nways = dev->dma_chan ? WY_COPY_NUM : WY_COPY_DMA;
+    uint32_t best  = WY_COPY_CPU;
+    uint32_t how;
+
+    for (how = 1; how < nways; how++)
+    {
+        if (READ_ONCE(b->cost[how]) < READ_ONCE(b->cost[best]))
+        {
+            best = how;
+        }
+    }
+
+    return best;
+}
+
+// ------------------------------------------------------------
+// Fold a copy's duration into its strategy's cost for the size
+// ------------------------------------------------------------
+
+static void wy_module_copy_update(wy_copy_bucket_t *b, uint32_t how, u64 ns, uint32_t len)
+{
+    uint32_t sample = min_t(u64, div_u64(ns << 8, len), U32_MAX);
+    uint32_t cost   = READ_ONCE(b->cost[how]);
+
+    if (cost)
+    {
+        sample = cost - (cost >> WY_COPY_EWMA_SHIFT) + (sample >> WY_COPY_EWMA_SHIFT);
+    }
+
+    WRITE_ONCE(b->cost[how], sample);
+}
+
+// ------------------------------------------------------------
+// Periodic recalibration, so that the model follows changes in
+// load and in the channel. Each size bucket's next copies cycle
+// through all the strategies again
+// ------------------------------------------------------------
+
+static void wy_module_copy_calibrate(struct work_struct *work)
+{
+    wy_dev_t*    dev = container_of(to_delayed_work(work), wy_dev_t, copy_calib);
+    unsigned int ms  = READ_ONCE(copy_calibrate_ms);
+    uint32_t     bucket;
+
+    for (bucket = 0; bucket < WY_COPY_BUCKETS; bucket++)
+    {
+        atomic_set(&dev->copy_model[bucket].explore, WY_COPY_NUM * WY_COPY_SAMPLES);
+    }
+
+    if (ms)
+    {
+        queue_delayed_work(dev->wq, &dev->copy_calib, msecs_to_jiffies(ms));
+    }
+}
+
+// ------------------------------------------------------------
+// Copy by DMA. The user buffer is pinned and the copy split into
+// segments within a page on both sides, each mapped for the
+// channel's device. The segments are unmapped, and the pages
+// unpinned, once the transfer completes or fails
+// ------------------------------------------------------------
+
+static int wy_module_dma_copy(wy_dev_t *dev, params_t *p, bool to_dev)
+{
+    struct device*  dma_dev = dmaengine_get_dma_device(dev->dma_chan);
+    struct page**   pages;
+    wy_dma_seg_t*   segs;
+    unsigned long   uaddr   = (unsigned long)p->vaddr;
+    int             npages  = DIV_ROUND_UP(offset_in_page(uaddr) + p->len, PAGE_SIZE);
+    int             wpages  = DIV_ROUND_UP(offset_in_page(dev->mem + p->offset) + p->len, PAGE_SIZE);
+    int             pinned  = 0;
+    uint32_t        nsegs   = 0;
+    uint32_t        idx;
+    int             status;
+
+    // Each page boundary on either side starts a new segment
+    pages = kvmalloc_array(npages, sizeof(struct page*), GFP_KERNEL);
+    segs  = kvmalloc_array(npages + wpages, sizeof(wy_dma_seg_t), GFP_KERNEL);
+
+    if (pages)
+    {
+        pinned = pin_user_pages_fast(uaddr & PAGE_MASK, npages, to_dev ? 0 : FOLL_WRITE, pages);
+    }
+
+    if (!pages || !segs)
+    {
+        status = -ENOMEM;
+    }
+    else if (pinned != npages)
+    {
+        status = -EFAULT;
+    }
+    else
+    {
+        status = wy_module_dma_run(dev, p, pages, segs, &nsegs, to_dev);
+    }
+
+    for (idx = 0; idx < nsegs; idx++)
+    {
+        dma_unmap_page(dma_dev, segs[idx].src, segs[idx].len, DMA_TO_DEVICE);
+        dma_unmap_page(dma_dev, segs[idx].dst, segs[idx].len, DMA_FROM_DEVICE);
+    }
+
+    // User pages written by the device are dirtied
+    if (pinned > 0)
+    {
+        unpin_user_pages_dirty_lock(pages, pinned, !to_dev && !status);
+    }
+
+    kvfree(segs);
+    kvfree(pages);
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// Map the segments of a DMA copy, counted in *nsegs, and then
+// submit them and wait for the transfer. The channel executes
+// descriptors in order, so only the last needs a callback
+// ------------------------------------------------------------
+
+static int wy_module_dma_run(wy_dev_t *dev, params_t *p, struct page **pages, wy_dma_seg_t *segs,
+                             uint32_t *nsegs, bool to_dev)
+{
+    struct dma_chan*                chan    = dev->dma_chan;
+    struct device*                  dma_dev = dmaengine_get_dma_device(chan);
+    struct dma_async_tx_descriptor* tx      = NULL;
+    unsigned long                   uaddr   = (unsigned long)p->vaddr;
+    struct page*                    upage;
+    struct page*                    wpage;
+    uint8_t*                        waddr;
+    wy_dma_seg_t*                   seg;
+    uint32_t                        pos;
+    uint32_t                        uoff;
+    uint32_t                        woff;
+    uint32_t                        chunk;
+    uint32_t                        idx;
+    int                             status  = 0;
+
+    DECLARE_COMPLETION_ONSTACK(done);
+
+    for (pos = 0; pos < p->len; pos += chunk)
+    {
+        waddr = dev->mem + p->offset + pos;
+        uoff  = offset_in_page(uaddr + pos);
+        woff  = offset_in_page(waddr);
+        chunk = min_t(uint32_t, p->len - pos, min_t(uint32_t, PAGE_SIZE - uoff, PAGE_SIZE - woff));
+        upage = pages[(offset_in_page(uaddr) + pos) >> PAGE_SHIFT];
+        wpage = vmalloc_to_page(waddr);
+        seg   = &segs[*nsegs];
+
+        seg->len = chunk;
+        seg->src = dma_map_page(dma_dev, to_dev ? upage : wpage, to_dev ? uoff : woff, chunk, DMA_TO_DEVICE);
+
+        if (dma_mapping_error(dma_dev, seg->src))
+        {
+            return -ENOMEM;
+        }
+
+        seg->dst = dma_map_page(dma_dev, to_dev ? wpage : upage, to_dev ? woff : uoff, chunk, DMA_FROM_DEVICE);
+
+        if (dma_mapping_error(dma_dev, seg->dst))
+        {
+            dma_unmap_page(dma_dev, seg->src, chunk, DMA_TO_DEVICE);
+
+            return -ENOMEM;
+        }
+
+        (*nsegs)++;
+    }
+
+    mutex_lock(&dev->dma_lock);
+
+    for (idx = 0; idx < *nsegs; idx++)
+    {
+        tx = dmaengine_prep_dma_memcpy(chan, segs[idx].dst, segs[idx].src, segs[idx].len,
+                                       idx == *nsegs - 1 ? DMA_PREP_INTERRUPT | DMA_CTRL_ACK : DMA_CTRL_ACK);
+
+        if (!tx)
+        {
+            status = -ENOMEM;
+            break;
+        }
+
+        if (idx == *nsegs - 1)
+        {
+            tx->callback       = wy_module_dma_done;
+            tx->callback_param = &done;
+        }
+
+        if (dma_submit_error(dmaengine_submit(tx)))
+        {
+            status = -EIO;
+            break;
+        }
+    }
+
+    if (!status)
+    {
+        dma_async_issue_pending(chan);
+
+        if (!wait_for_completion_timeout(&done, msecs_to_jiffies(WY_DMA_TIMEOUT_MS)))
+        {
+            status = -ETIMEDOUT;
+        }
+    }
+
+    // Abort anything outstanding before the segments are unmapped. The lock
+    // means that only this command's descriptors are on the channel
+    if (status)
+    {
+        dmaengine_terminate_sync(chan);
+    }
+
+    mutex_unlock(&dev->dma_lock);
+
+    return status;
+}
+
+// ------------------------------------------------------------
+// DMA completion callback, in the channel's tasklet context
+// ------------------------------------------------------------
+
+static void wy_module_dma_done(void *param)
+{
+    complete(param);
+}
+
+// ------------------------------------------------------------
+// Streaming producer, called periodically from the stream timer
+// to emulate the device generating data
+// ------------------------------------------------------------
+
+static enum hrtimer_restart wy_module_stream_produce(struct hrtimer *timer)
+{
+    wy_dev_t* dev = container_of(timer, wy_dev_t, stream_timer);
+    uint32_t  words = dev->stream_chunk / sizeof(uint32_t);
+    uint32_t  idx;
+
+    // A device cannot stall, so if there is no room for the whole chunk
+    // it is dropped and the overrun flagged for the reader
+    if (kfifo_avail(&dev->stream_fifo) < dev->stream_chunk)
+    {
+        dev->stream_overruns++;
+        set_bit(WY_STREAM_OVERRUN, &dev->stream_flags);
+    }
+    else
+    {
+        // Produce an incrementing word pattern, queued as one chunk
+        for (idx = 0; idx < words; idx++)
+        {
+            dev->stream_buf[idx] = dev->stream_seq++;
+        }
+
+        kfifo_in(&dev->stream_fifo, dev->stream_buf, dev->stream_chunk);
+    }
+
+    wake_up_interruptible(&dev->stream_wq);
+
+    hrtimer_forward_now(timer, us_to_ktime(stream_period_us));
+
+    return HRTIMER_RESTART;
+}
+
+// ------------------------------------------------------------
+// Start streaming to this file, producing chunk bytes every
+// period. Fails whilst another file's stream is producing. The
+// doorbell has no file to read the stream, so cannot start one
+// ------------------------------------------------------------
+
+static int wy_module_stream_start(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    uint32_t chunk = p->len;
+
+    // Chunks are whole words and must fit in the FIFO
+    if (!ctx || !chunk || (chunk % sizeof(uint32_t)) || chunk > kfifo_size(&dev->stream_fifo))
+    {
+        return -EINVAL;
+    }
+
+    mutex_lock(&dev->stream_lock);
+
+    if (dev->stream_owner && dev->stream_owner != ctx && hrtimer_active(&dev->stream_timer))
+    {
+        mutex_unlock(&dev->stream_lock);
+
+        return -EBUSY;
+    }
+
+    // Stop any current producer and discard old data before restarting
+    hrtimer_cancel(&dev->stream_timer);
+
+    kfifo_reset(&dev->stream_fifo);
+    clear_bit(WY_STREAM_OVERRUN, &dev->stream_flags);
+
+    dev->stream_chunk = chunk;
+    dev->stream_seq   = 0;
+
+    WRITE_ONCE(dev->stream_owner, ctx);
+
+    hrtimer_start(&dev->stream_timer, us_to_ktime(stream_period_us), HRTIMER_MODE_REL);
+
+    mutex_unlock(&dev->stream_lock);
+
+    // Wake any reader of a stream taken over, to see that it has ended
+    wake_up_interruptible(&dev->stream_wq);
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Stop the producer of this file's stream. Read stays in stream
+// mode until the FIFO is drained, at which point it returns 0
+// (end of stream)
+// ------------------------------------------------------------
+
+static int wy_module_stream_stop(wy_dev_t *dev, wy_file_t *ctx, params_t *p)
+{
+    mutex_lock(&dev->stream_lock);
+
+    if (!ctx || dev->stream_owner != ctx)
+    {
+        mutex_unlock(&dev->stream_lock);
+
+        return -EBUSY;
+    }
+
+    hrtimer_cancel(&dev->stream_timer);
+
+    mutex_unlock(&dev->stream_lock);
+
+    // Wake any blocked reader so that it sees the end of the stream
+    wake_up_interruptible(&dev->stream_wq);
+
+    return 0;
+}
+
+// ------------------------------------------------------------
+// Stop and give up a closing file's stream, if it has one
+// ------------------------------------------------------------
+
+static void wy_module_stream_release(wy_file_t *ctx)
+{
+    wy_dev_t* dev = ctx->dev;
+
+    mutex_lock(&dev->stream_lock);
+
+    if (dev->stream_owner == ctx)
+    {
+        hrtimer_cancel(&dev->stream_timer);
+
+        WRITE_ONCE(dev->stream_owner, NULL);
+    }
+
+    mutex_unlock(&dev->stream_lock);
+}
+
+// ------------------------------------------------------------
+// Stream read. Drains up to len bytes from the stream FIFO,
+// blocking for data unless the file is O_NONBLOCK
+// ------------------------------------------------------------
+
+static ssize_t wy_module_stream_read(struct file *fp, char *buffer, size_t len)
+{
+    wy_file_t*   ctx = fp->private_data;
+    wy_dev_t*    dev = ctx->dev;
+    unsigned int copied;
+    int          status;
+
+    if (mutex_lock_interruptible(&dev->stream_lock))
+    {
+        return -ERESTARTSYS;
+    }
+
+    // Taken over by another file, which ends this file's stream
+    if (dev->stream_owner != ctx)
+    {
+        mutex_unlock(&dev->stream_lock);
+
+        return 0;
+    }
+
+    while (kfifo_is_empty(&dev->stream_fifo))
+    {
+        // Report lost data before waiting for more
+        if (test_bit(WY_STREAM_OVERRUN, &dev->stream_flags))
+        {
+            break;
+        }
+
+        // Producer stopped and nothing left, so end the stream and revert to parameter reads
+        if (!hrtimer_active(&dev->stream_timer))
+        {
+            WRITE_ONCE(dev->stream_owner, NULL);
+            mutex_unlock(&dev->stream_lock);
+
+            return 0;
+        }
+
+        mutex_unlock(&dev->stream_lock);
+
+        if (fp->f_flags & O_NONBLOCK)
+        {
+            return -EAGAIN;
+        }
+
+        if (wait_event_interruptible(dev->stream_wq,
+                                     !kfifo_is_empty(&dev->stream_fifo)                ||
+                                     test_bit(WY_STREAM_OVERRUN, &dev->stream_flags) ||
+                                     !hrtimer_active(&dev->stream_timer)             ||
+                                     READ_ONCE(dev->stream_owner) != ctx))
+        {
+            return -ERESTARTSYS;
+        }
+
+        if (mutex_lock_interruptible(&dev->stream_lock))
+        {
+            return -ERESTARTSYS;
+        }
+
+        if (dev->stream_owner != ctx)
+        {
+            mutex_unlock(&dev->stream_lock);
+
+            return 0;
+        }
+    }
+
+    // Overruns are reported once, on the first read after data was lost
+    if (test_and_clear_bit(WY_STREAM_OVERRUN, &dev->stream_flags))
+    {
+        mutex_unlock(&dev->stream_lock);
+
+        return -EOVERFLOW;
+    }
+
+    status = kfifo_to_user(&dev->stream_fifo, buffer, len, &copied);
+
+    mutex_unlock(&dev->stream_lock);
+
+    return status ? status : copied;
 }